@@ -8,15 +8,12 @@ void abstract_file_init (AbstractFile *f, const char *name)
 {
     f->id = 0;
     g_strlcpy(f->name, name, MAX_FILE_NAME_LENGTH);
-    sem_init(&f->file_lock, 0, 1);
+    lock_init(&f->file_lock);
 }
 
 void abstract_file_destroy (AbstractFile *f)
 {
-    if (sem_destroy(&f->file_lock) != 0)
-    {
-        error("abstract_file_destroy: sem_destroy error (%d)", errno);
-    }
+    lock_destroy(&f->file_lock);
 }
 
 char *abstract_file_to_string (AbstractFile *f, char buffer[MAX_FILE_NAME_LENGTH])
@@ -2,7 +2,6 @@
 #define ABSTRACT_FILE_H
 #include <glib.h>
 #include <stdint.h> /* for file_id_t */
-#include <semaphore.h>
 #include "lock.h"
 
 typedef uint64_t file_id_t;
@@ -18,7 +17,7 @@ typedef struct AbstractFile
        Previously stored in in the TagTable under the "name" tag but moved for
        easier access. File names don't have to be unique to the file. */
     char name[MAX_FILE_NAME_LENGTH];
-    sem_t file_lock;
+    lock_t file_lock;
 } AbstractFile;
 
 void abstract_file_init (AbstractFile *f, const char *name);
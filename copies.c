@@ -0,0 +1,975 @@
+/* For O_PATH and copy_file_range */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#include "log.h"
+#include "util.h"
+#include "copies.h"
+
+/* Longest name of a copy relative to its top level subdirectory */
+#define COPIES_NAME_LEN 32
+/* Copies moved by the migration thread between checks for a stop */
+#define COPIES_MIGRATE_BATCH 1024
+
+/* Where _migrate_short_names keeps copies on their way */
+#define COPIES_MIGRATING_DIR "migrating"
+
+/* How the cached handles are opened. Without O_PATH, opening a fifo for
+ * reading mustn't wait for a writer */
+#ifdef O_PATH
+#define COPIES_FD_FLAGS (O_PATH | O_NOFOLLOW | O_CLOEXEC)
+#else
+#define COPIES_FD_FLAGS (O_RDONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC)
+#endif
+#define PROC_FD_PATH_LEN 32
+/* Appended to a copy's name for the file which replaces it */
+#define COPIES_TMP_SUFFIX ".new"
+/* Bytes copied at a time when copy_file_range can't be used */
+#define COPIES_COPY_BUF (128 * 1024)
+
+/* A cached handle on a copy. It's closed when it has been dropped from the
+ * cache and nothing is using it */
+typedef struct
+{
+    file_id_t id;
+    int fd;
+    mode_t mode;
+    /* One for being in the cache and one for each user */
+    int refs;
+    GList *link;
+} CopiesFd;
+
+#define SHARD(_id) ((_id) & 0xff)
+#define SUBSHARD(_id) (((_id) >> 8) & 0xff)
+
+static int _res (int r)
+{
+    return (r < 0) ? -errno : r;
+}
+
+/* Opens a stream on the directory dir_fd without taking it over. The
+ * duplicate shares its offset, so the stream has to start from the
+ * beginning */
+static DIR *_opendir_at (int dir_fd)
+{
+    int fd = dup(dir_fd);
+    DIR *d = (fd < 0) ? NULL : fdopendir(fd);
+    if (d)
+    {
+        rewinddir(d);
+    }
+    else if (fd >= 0)
+    {
+        close(fd);
+    }
+    return d;
+}
+
+/* Whether the entry name in dir_fd is a copy at the top level: named by a
+ * file ID and not a directory. The top level subdirectories have names of
+ * two hex digits, which can be the same as the IDs 10 to 99 */
+static gboolean _is_top_level_copy (int dir_fd, const char *name)
+{
+    if (!*name)
+    {
+        return FALSE;
+    }
+    for (const char *p = name; *p; p++)
+    {
+        if (*p < '0' || *p > '9')
+        {
+            return FALSE;
+        }
+    }
+    struct stat st;
+    return strlen(name) != 2 ||
+        (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && !S_ISDIR(st.st_mode));
+}
+
+static gboolean _has_top_level_copies (int dir_fd)
+{
+    DIR *d = _opendir_at(dir_fd);
+    gboolean res = FALSE;
+    if (d)
+    {
+        struct dirent *de;
+        while (!res && (de = readdir(d)) != NULL)
+        {
+            res = _is_top_level_copy(dir_fd, de->d_name);
+        }
+        closedir(d);
+    }
+    return res;
+}
+
+static int _locate_new (Copies *c, file_id_t id, char *name);
+
+/* Moves the copies which could have the same names as top level
+ * subdirectories, the IDs 10 to 99, out of the way and then into place, so
+ * that the rest can be moved while the copies are in use */
+static int _migrate_short_names (Copies *c)
+{
+    const char *tmp = COPIES_MIGRATING_DIR;
+    char name[2 * COPIES_NAME_LEN];
+    char id_name[COPIES_NAME_LEN];
+    if (mkdirat(c->dir_fd, tmp, 0755) != 0 && errno != EEXIST)
+    {
+        return -errno;
+    }
+    for (file_id_t id = 10; id < 100; id++)
+    {
+        snprintf(id_name, COPIES_NAME_LEN, "%" G_GUINT64_FORMAT, id);
+        snprintf(name, sizeof(name), "%s/%s", tmp, id_name);
+        if (_is_top_level_copy(c->dir_fd, id_name) &&
+                renameat(c->dir_fd, id_name, c->dir_fd, name) != 0)
+        {
+            return -errno;
+        }
+    }
+    for (file_id_t id = 10; id < 100; id++)
+    {
+        char new_name[COPIES_NAME_LEN];
+        snprintf(name, sizeof(name), "%s/%" G_GUINT64_FORMAT, tmp, id);
+        if (faccessat(c->dir_fd, name, F_OK, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+            continue;
+        }
+        int fd = _locate_new(c, id, new_name);
+        if (fd < 0)
+        {
+            return fd;
+        }
+        if (renameat(c->dir_fd, name, fd, new_name) != 0)
+        {
+            return -errno;
+        }
+    }
+    return _res(unlinkat(c->dir_fd, tmp, AT_REMOVEDIR));
+}
+
+Copies *copies_new (const char *dir, guint max_fds)
+{
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+    {
+        return NULL;
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    Copies *res = g_malloc0(sizeof(Copies));
+    res->dir = g_strdup(dir);
+    res->dir_fd = fd;
+    for (int i = 0; i < COPIES_SHARDS; i++)
+    {
+        res->shard_fds[i] = -1;
+    }
+    pthread_mutex_init(&res->lock, NULL);
+    pthread_mutex_init(&res->fd_lock, NULL);
+    res->fds = g_hash_table_new(g_direct_hash, g_direct_equal);
+    res->fd_lru = g_queue_new();
+    res->max_fds = max_fds;
+    res->proc_fds = (access("/proc/self/fd", F_OK) == 0);
+    res->migrating = _has_top_level_copies(fd) ||
+        faccessat(fd, COPIES_MIGRATING_DIR, F_OK, 0) == 0;
+    if (res->migrating)
+    {
+        info("copies: %s has copies at the top level, which will be moved into subdirectories", dir);
+        if (_migrate_short_names(res) != 0)
+        {
+            error("copies: couldn't move the copies of files 10 to 99 in %s", dir);
+        }
+    }
+    return res;
+}
+
+static void _fds_clear (Copies *c);
+
+void copies_destroy (Copies *c)
+{
+    if (c)
+    {
+        pthread_mutex_lock(&c->lock);
+        gboolean started = c->migration_started;
+        c->migration_stop = TRUE;
+        pthread_mutex_unlock(&c->lock);
+        if (started)
+        {
+            pthread_join(c->migration_thread, NULL);
+        }
+
+        _fds_clear(c);
+        g_hash_table_destroy(c->fds);
+        g_queue_free(c->fd_lru);
+        for (int i = 0; i < COPIES_SHARDS; i++)
+        {
+            if (c->shard_fds[i] >= 0)
+            {
+                close(c->shard_fds[i]);
+            }
+        }
+        close(c->dir_fd);
+        pthread_mutex_destroy(&c->fd_lock);
+        pthread_mutex_destroy(&c->lock);
+        g_free(c->dir);
+        g_free(c);
+    }
+}
+
+static void *_migration_main (void *arg)
+{
+    Copies *c = arg;
+    int res;
+    do
+    {
+        res = copies_migrate(c, COPIES_MIGRATE_BATCH);
+        pthread_mutex_lock(&c->lock);
+        gboolean stop = c->migration_stop;
+        pthread_mutex_unlock(&c->lock);
+        if (stop)
+        {
+            break;
+        }
+    } while (res > 0);
+
+    if (res < 0)
+    {
+        error("copies: moving the copies in %s into subdirectories failed: %s",
+                c->dir, strerror(-res));
+    }
+    return NULL;
+}
+
+/* Starts moving the top level copies on the first access, so that the
+ * thread runs in the process which serves the mount after FUSE forks */
+static void _start_migration (Copies *c)
+{
+    pthread_mutex_lock(&c->lock);
+    if (!c->migration_started && !c->migration_stop)
+    {
+        if (pthread_create(&c->migration_thread, NULL, _migration_main, c) == 0)
+        {
+            g_atomic_int_set(&c->migration_started, TRUE);
+        }
+        else
+        {
+            error("copies: couldn't start the migration thread");
+            /* Don't try again on every access */
+            c->migration_stop = TRUE;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* The fd of the top level subdirectory for id, opening it if necessary.
+ * With create, the subdirectory is made if it doesn't exist */
+static int _shard_fd (Copies *c, file_id_t id, gboolean create)
+{
+    int i = SHARD(id);
+    int fd = g_atomic_int_get(&c->shard_fds[i]);
+    if (fd >= 0)
+    {
+        return fd;
+    }
+
+    char name[4];
+    sprintf(name, "%02x", i);
+    pthread_mutex_lock(&c->lock);
+    fd = c->shard_fds[i];
+    if (fd < 0)
+    {
+        if (create && mkdirat(c->dir_fd, name, 0755) != 0 && errno != EEXIST)
+        {
+            fd = -errno;
+        }
+        else
+        {
+            fd = _res(openat(c->dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        }
+        if (fd >= 0)
+        {
+            g_atomic_int_set(&c->shard_fds[i], fd);
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    return fd;
+}
+
+static void _shard_name (file_id_t id, char *name)
+{
+    snprintf(name, COPIES_NAME_LEN, "%02x/%" G_GUINT64_FORMAT, (guint) SUBSHARD(id), id);
+}
+
+/* Finds where to look for id's copy on the given try. The first try is
+ * where it belongs. While copies are being moved, the second is the top
+ * level and the third is where it belongs again, in case it was moved in
+ * between. Returns the directory fd and sets name, or returns -errno */
+static int _locate (Copies *c, file_id_t id, int try, char *name)
+{
+    if (g_atomic_int_get(&c->migrating) && !g_atomic_int_get(&c->migration_started))
+    {
+        _start_migration(c);
+    }
+
+    if (try == 1)
+    {
+        snprintf(name, COPIES_NAME_LEN, "%" G_GUINT64_FORMAT, id);
+        return c->dir_fd;
+    }
+    _shard_name(id, name);
+    return _shard_fd(c, id, FALSE);
+}
+
+/* Sets _res to the result of _call, which uses dirfd and name, on id's
+ * copy, wherever it is */
+#define COPIES_AT(_c, _id, _res, _call) \
+    for (int _try = 0; _try < 3; _try++) \
+    { \
+        char name[COPIES_NAME_LEN]; \
+        int dirfd = _locate(_c, _id, _try, name); \
+        _res = (dirfd < 0) ? dirfd : (_call); \
+        if (_res != -ENOENT || !g_atomic_int_get(&(_c)->migrating)) \
+        { \
+            break; \
+        } \
+    }
+
+/* Makes the subdirectories for a new copy of id. Returns the top level
+ * one's fd and sets name, or returns -errno */
+static int _locate_new (Copies *c, file_id_t id, char *name)
+{
+    int fd = _shard_fd(c, id, TRUE);
+    if (fd < 0)
+    {
+        return fd;
+    }
+    char sub[4];
+    sprintf(sub, "%02x", (guint) SUBSHARD(id));
+    if (mkdirat(fd, sub, 0755) != 0 && errno != EEXIST)
+    {
+        return -errno;
+    }
+    _shard_name(id, name);
+    return fd;
+}
+
+/* As COPIES_AT for calls which make the copy. The subdirectories are made
+ * if the call finds they don't exist */
+#define COPIES_NEW(_c, _id, _res, _call) \
+    { \
+        char name[COPIES_NAME_LEN]; \
+        _shard_name(_id, name); \
+        int dirfd = _shard_fd(_c, _id, FALSE); \
+        _res = (dirfd < 0) ? dirfd : (_call); \
+        if (_res == -ENOENT) \
+        { \
+            dirfd = _locate_new(_c, _id, name); \
+            _res = (dirfd < 0) ? dirfd : (_call); \
+        } \
+    }
+
+/* Must be called with the fd lock held */
+static void _fd_unref (CopiesFd *e)
+{
+    if (--e->refs == 0)
+    {
+        close(e->fd);
+        g_free(e);
+    }
+}
+
+/* Must be called with the fd lock held */
+static void _fd_drop (Copies *c, CopiesFd *e)
+{
+    g_hash_table_remove(c->fds, TO_SP(e->id));
+    g_queue_delete_link(c->fd_lru, e->link);
+    _fd_unref(e);
+}
+
+static void _fds_clear (Copies *c)
+{
+    pthread_mutex_lock(&c->fd_lock);
+    while (!g_queue_is_empty(c->fd_lru))
+    {
+        _fd_drop(c, g_queue_peek_head(c->fd_lru));
+    }
+    pthread_mutex_unlock(&c->fd_lock);
+}
+
+/* Gets the handle on id's copy from the cache. With fill, the copy is
+ * opened and cached if it isn't there, which is only worth it when the copy
+ * is being opened: a stat would take three calls instead of one. Returns
+ * NULL if there's no handle, and sets res to -errno if the copy couldn't be
+ * opened. The handle has to be given back with _fd_put */
+static CopiesFd *_fd_get (Copies *c, file_id_t id, gboolean fill, int *res)
+{
+    pthread_mutex_lock(&c->fd_lock);
+    CopiesFd *e = g_hash_table_lookup(c->fds, TO_SP(id));
+    guint64 forgets = c->fd_forgets;
+    if (e)
+    {
+        e->refs++;
+        g_queue_unlink(c->fd_lru, e->link);
+        g_queue_push_head_link(c->fd_lru, e->link);
+    }
+    pthread_mutex_unlock(&c->fd_lock);
+    if (e || !fill || c->max_fds == 0)
+    {
+        return e;
+    }
+
+    int fd;
+    struct stat st;
+    COPIES_AT(c, id, fd, _res(openat(dirfd, name, COPIES_FD_FLAGS)));
+    if (fd < 0)
+    {
+        *res = fd;
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0)
+    {
+        *res = -errno;
+        close(fd);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&c->fd_lock);
+    e = g_hash_table_lookup(c->fds, TO_SP(id));
+    if (e)
+    {
+        /* Opened by someone else in the meantime */
+        close(fd);
+    }
+    else if (c->fd_forgets != forgets)
+    {
+        /* A copy was unlinked or replaced while this was being opened, and
+         * it could have been this one. The caller goes by the path */
+        pthread_mutex_unlock(&c->fd_lock);
+        close(fd);
+        return NULL;
+    }
+    else
+    {
+        if (g_hash_table_size(c->fds) >= c->max_fds)
+        {
+            _fd_drop(c, g_queue_peek_tail(c->fd_lru));
+        }
+        e = g_malloc0(sizeof(CopiesFd));
+        e->id = id;
+        e->fd = fd;
+        e->mode = st.st_mode;
+        e->refs = 1;
+        g_queue_push_head(c->fd_lru, e);
+        e->link = g_queue_peek_head_link(c->fd_lru);
+        g_hash_table_insert(c->fds, TO_SP(id), e);
+    }
+    e->refs++;
+    pthread_mutex_unlock(&c->fd_lock);
+    return e;
+}
+
+static void _fd_put (Copies *c, CopiesFd *e)
+{
+    pthread_mutex_lock(&c->fd_lock);
+    _fd_unref(e);
+    pthread_mutex_unlock(&c->fd_lock);
+}
+
+/* Call after id's copy has been unlinked or replaced */
+static void _fd_forget (Copies *c, file_id_t id)
+{
+    pthread_mutex_lock(&c->fd_lock);
+    c->fd_forgets++;
+    CopiesFd *e = g_hash_table_lookup(c->fds, TO_SP(id));
+    if (e)
+    {
+        _fd_drop(c, e);
+    }
+    pthread_mutex_unlock(&c->fd_lock);
+}
+
+/* Gets a handle on id's copy which can be used as a path through
+ * /proc/self/fd, which only works for regular files. Sets path to that
+ * path. Returns NULL if there's no such handle, in which case res is set
+ * to -errno if the copy couldn't be opened or is left alone otherwise */
+static CopiesFd *_fd_get_path (Copies *c, file_id_t id, gboolean fill, char *path, int *res)
+{
+    if (!c->proc_fds)
+    {
+        return NULL;
+    }
+    CopiesFd *e = _fd_get(c, id, fill, res);
+    if (e && !S_ISREG(e->mode))
+    {
+        _fd_put(c, e);
+        return NULL;
+    }
+    if (e)
+    {
+        snprintf(path, PROC_FD_PATH_LEN, "/proc/self/fd/%d", e->fd);
+    }
+    return e;
+}
+
+char *copies_path (Copies *c, file_id_t id)
+{
+    char name[COPIES_NAME_LEN + 3];
+    struct stat st;
+    snprintf(name, 4, "%02x/", (guint) SHARD(id));
+    _shard_name(id, name + 3);
+    if (g_atomic_int_get(&c->migrating) && fstatat(c->dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+        snprintf(name, COPIES_NAME_LEN, "%" G_GUINT64_FORMAT, id);
+    }
+    return g_strdup_printf("%s/%s", c->dir, name);
+}
+
+int copies_open (Copies *c, file_id_t id, int flags, mode_t mode)
+{
+    int res = 0;
+    char path[PROC_FD_PATH_LEN];
+    CopiesFd *e;
+    if (flags & O_CREAT)
+    {
+        COPIES_NEW(c, id, res, _res(openat(dirfd, name, flags, mode)));
+    }
+    else if ((e = _fd_get_path(c, id, TRUE, path, &res)))
+    {
+        res = _res(open(path, flags));
+        _fd_put(c, e);
+    }
+    else if (res == 0)
+    {
+        COPIES_AT(c, id, res, _res(openat(dirfd, name, flags)));
+    }
+    return res;
+}
+
+int copies_stat (Copies *c, file_id_t id, struct stat *st)
+{
+    int res = 0;
+    CopiesFd *e = _fd_get(c, id, FALSE, &res);
+    if (e)
+    {
+        res = _res(fstat(e->fd, st));
+        _fd_put(c, e);
+    }
+    else if (res == 0)
+    {
+        COPIES_AT(c, id, res, _res(fstatat(dirfd, name, st, AT_SYMLINK_NOFOLLOW)));
+    }
+    return res;
+}
+
+int copies_truncate (Copies *c, file_id_t id, off_t size)
+{
+    int fd = copies_open(c, id, O_WRONLY, 0);
+    if (fd < 0)
+    {
+        return fd;
+    }
+    int res = _res(ftruncate(fd, size));
+    close(fd);
+    return res;
+}
+
+int copies_chmod (Copies *c, file_id_t id, mode_t mode)
+{
+    int res = 0;
+    char path[PROC_FD_PATH_LEN];
+    CopiesFd *e = _fd_get_path(c, id, FALSE, path, &res);
+    if (e)
+    {
+        res = _res(chmod(path, mode));
+        _fd_put(c, e);
+    }
+    else if (res == 0)
+    {
+        COPIES_AT(c, id, res, _res(fchmodat(dirfd, name, mode, 0)));
+    }
+    return res;
+}
+
+int copies_chown (Copies *c, file_id_t id, uid_t uid, gid_t gid)
+{
+    int res = 0;
+    char path[PROC_FD_PATH_LEN];
+    CopiesFd *e = _fd_get_path(c, id, FALSE, path, &res);
+    if (e)
+    {
+        res = _res(chown(path, uid, gid));
+        _fd_put(c, e);
+    }
+    else if (res == 0)
+    {
+        COPIES_AT(c, id, res, _res(fchownat(dirfd, name, uid, gid, AT_SYMLINK_NOFOLLOW)));
+    }
+    return res;
+}
+
+int copies_utimens (Copies *c, file_id_t id, const struct timespec ts[2])
+{
+    int res = 0;
+    char path[PROC_FD_PATH_LEN];
+    CopiesFd *e = _fd_get_path(c, id, FALSE, path, &res);
+    if (e)
+    {
+        res = _res(utimensat(AT_FDCWD, path, ts, 0));
+        _fd_put(c, e);
+    }
+    else if (res == 0)
+    {
+        COPIES_AT(c, id, res, _res(utimensat(dirfd, name, ts, AT_SYMLINK_NOFOLLOW)));
+    }
+    return res;
+}
+
+int copies_unlink (Copies *c, file_id_t id)
+{
+    int res;
+    COPIES_AT(c, id, res, _res(unlinkat(dirfd, name, 0)));
+    _fd_forget(c, id);
+    return res;
+}
+
+int copies_mknod (Copies *c, file_id_t id, mode_t mode, dev_t dev)
+{
+    int res;
+    if (S_ISFIFO(mode))
+    {
+        COPIES_NEW(c, id, res, _res(mkfifoat(dirfd, name, mode)));
+    }
+    else
+    {
+        COPIES_NEW(c, id, res, _res(mknodat(dirfd, name, mode, dev)));
+    }
+    return res;
+}
+
+int copies_symlink (Copies *c, file_id_t id, const char *target)
+{
+    int res;
+    COPIES_NEW(c, id, res, _res(symlinkat(target, dirfd, name)));
+    return res;
+}
+
+int copies_link (Copies *c, file_id_t id, file_id_t new_id)
+{
+    int res;
+    char new_name[COPIES_NAME_LEN];
+    int new_fd = _locate_new(c, new_id, new_name);
+    if (new_fd < 0)
+    {
+        return new_fd;
+    }
+    COPIES_AT(c, id, res, _res(linkat(dirfd, name, new_fd, new_name, 0)));
+    return res;
+}
+
+int copies_readlink (Copies *c, file_id_t id, char *buf, size_t size)
+{
+    int res;
+    COPIES_AT(c, id, res, _res(readlinkat(dirfd, name, buf, size)));
+    return res;
+}
+
+/* Makes dst_name in dst_fd a clone of src_name in src_fd, sharing its
+ * blocks, with the given mode */
+static int _clone_at (int src_fd, const char *src_name, int dst_fd, const char *dst_name, mode_t mode)
+{
+#ifdef FICLONE
+    int src = openat(src_fd, src_name, O_RDONLY | O_CLOEXEC);
+    if (src < 0)
+    {
+        return -errno;
+    }
+    int dst = openat(dst_fd, dst_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+    int res = (dst < 0) ? -errno : _res(ioctl(dst, FICLONE, src));
+    if (dst >= 0)
+    {
+        if (res == 0)
+        {
+            /* The umask may have taken some of it */
+            fchmod(dst, mode);
+        }
+        close(dst);
+        if (res < 0)
+        {
+            unlinkat(dst_fd, dst_name, 0);
+        }
+    }
+    close(src);
+    return res;
+#else
+    return -EOPNOTSUPP;
+#endif
+}
+
+static int _export_at (int dirfd, const char *name, int dst_fd, const char *dst_name, gboolean reflink)
+{
+    if (reflink)
+    {
+        struct stat st;
+        if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+            return -errno;
+        }
+        return _clone_at(dirfd, name, dst_fd, dst_name, st.st_mode & 07777);
+    }
+    return _res(linkat(dirfd, name, dst_fd, dst_name, 0));
+}
+
+int copies_export (Copies *c, file_id_t id, int dst_fd, const char *dst_name, gboolean reflink)
+{
+    int res;
+    COPIES_AT(c, id, res, _export_at(dirfd, name, dst_fd, dst_name, reflink));
+    return res;
+}
+
+static int _import_at (int dirfd, const char *name, int src_fd, const char *src_name, gboolean reflink)
+{
+    struct stat st;
+    struct stat src_st;
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+            fstatat(src_fd, src_name, &src_st, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+        return -errno;
+    }
+    if (st.st_dev == src_st.st_dev && st.st_ino == src_st.st_ino)
+    {
+        /* Already the same file, which renameat would leave alone */
+        return 0;
+    }
+
+    char tmp[COPIES_NAME_LEN + sizeof(COPIES_TMP_SUFFIX)];
+    snprintf(tmp, sizeof(tmp), "%s" COPIES_TMP_SUFFIX, name);
+    unlinkat(dirfd, tmp, 0);
+    int res = reflink ? _clone_at(src_fd, src_name, dirfd, tmp, st.st_mode & 07777)
+        : _res(linkat(src_fd, src_name, dirfd, tmp, 0));
+    if (res == 0 && reflink)
+    {
+        /* A clone is a file of its own, so it keeps the copy's owner and
+         * times */
+        struct timespec ts[2] = {st.st_atim, st.st_mtim};
+        fchownat(dirfd, tmp, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW);
+        utimensat(dirfd, tmp, ts, AT_SYMLINK_NOFOLLOW);
+    }
+    if (res == 0 && renameat(dirfd, tmp, dirfd, name) != 0)
+    {
+        res = -errno;
+        unlinkat(dirfd, tmp, 0);
+    }
+    return res;
+}
+
+int copies_import (Copies *c, file_id_t id, int src_fd, const char *src_name, gboolean reflink)
+{
+    int res;
+    COPIES_AT(c, id, res, _import_at(dirfd, name, src_fd, src_name, reflink));
+    _fd_forget(c, id);
+    return res;
+}
+
+/* Copies everything from src to dst, within the kernel where it can */
+static int _copy_data (int src, int dst)
+{
+    ssize_t n;
+    while ((n = copy_file_range(src, NULL, dst, NULL, SSIZE_MAX, 0)) > 0);
+    if (n == 0)
+    {
+        return 0;
+    }
+    if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP)
+    {
+        return -errno;
+    }
+
+    char *buf = g_malloc(COPIES_COPY_BUF);
+    int res = 0;
+    while ((n = read(src, buf, COPIES_COPY_BUF)) > 0)
+    {
+        if (write(dst, buf, n) != n)
+        {
+            res = -EIO;
+            break;
+        }
+    }
+    if (n < 0)
+    {
+        res = -errno;
+    }
+    g_free(buf);
+    return res;
+}
+
+static int _unshare_at (int dirfd, const char *name)
+{
+    struct stat st;
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+        return -errno;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_nlink < 2)
+    {
+        return 0;
+    }
+
+    char tmp[COPIES_NAME_LEN + sizeof(COPIES_TMP_SUFFIX)];
+    snprintf(tmp, sizeof(tmp), "%s" COPIES_TMP_SUFFIX, name);
+    unlinkat(dirfd, tmp, 0);
+    int src = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (src < 0)
+    {
+        return -errno;
+    }
+    int dst = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+    int res = (dst < 0) ? -errno : _copy_data(src, dst);
+    if (dst >= 0)
+    {
+        if (res == 0)
+        {
+            struct timespec ts[2] = {st.st_atim, st.st_mtim};
+            fchmod(dst, st.st_mode & 07777);
+            /* Only works for root, who could be serving other users */
+            fchown(dst, st.st_uid, st.st_gid);
+            futimens(dst, ts);
+        }
+        close(dst);
+    }
+    close(src);
+    if (res == 0 && renameat(dirfd, tmp, dirfd, name) != 0)
+    {
+        res = -errno;
+    }
+    if (res < 0)
+    {
+        unlinkat(dirfd, tmp, 0);
+    }
+    return (res < 0) ? res : 1;
+}
+
+int copies_unshare (Copies *c, file_id_t id)
+{
+    int res;
+    COPIES_AT(c, id, res, _unshare_at(dirfd, name));
+    if (res > 0)
+    {
+        _fd_forget(c, id);
+    }
+    return res;
+}
+
+int copies_migrate (Copies *c, guint max)
+{
+    if (!g_atomic_int_get(&c->migrating))
+    {
+        return 0;
+    }
+
+    DIR *d = _opendir_at(c->dir_fd);
+    if (!d)
+    {
+        return -errno;
+    }
+
+    int moved = 0;
+    int res = 0;
+    struct dirent *de;
+    while ((max == 0 || moved < max) && (de = readdir(d)) != NULL)
+    {
+        if (!_is_top_level_copy(c->dir_fd, de->d_name))
+        {
+            continue;
+        }
+        file_id_t id = g_ascii_strtoull(de->d_name, NULL, 10);
+        char name[COPIES_NAME_LEN];
+        int fd = _locate_new(c, id, name);
+        if (fd < 0)
+        {
+            res = fd;
+            break;
+        }
+        /* Atomic, so the copy is always in one place or the other and
+         * anything which has it open keeps it */
+        if (renameat(c->dir_fd, de->d_name, fd, name) != 0 && errno != ENOENT)
+        {
+            res = -errno;
+            break;
+        }
+        moved++;
+    }
+    closedir(d);
+
+    if (res < 0)
+    {
+        return res;
+    }
+    if (moved == 0)
+    {
+        g_atomic_int_set(&c->migrating, FALSE);
+        info("copies: all of the copies in %s are in subdirectories", c->dir);
+    }
+    return moved;
+}
+
+/* Removes everything in the directory d. Closes d */
+static int _clear_dir (DIR *d)
+{
+    int res = 0;
+    struct dirent *de;
+    while (res == 0 && (de = readdir(d)) != NULL)
+    {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+        {
+            continue;
+        }
+        if (unlinkat(dirfd(d), de->d_name, 0) == 0)
+        {
+            continue;
+        }
+        if (errno != EISDIR && errno != EPERM)
+        {
+            res = -errno;
+            break;
+        }
+        int sub_fd = openat(dirfd(d), de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DIR *sub = (sub_fd < 0) ? NULL : fdopendir(sub_fd);
+        res = sub ? _clear_dir(sub) : -errno;
+        if (res == 0)
+        {
+            res = _res(unlinkat(dirfd(d), de->d_name, AT_REMOVEDIR));
+        }
+    }
+    closedir(d);
+    return res;
+}
+
+int copies_clear (Copies *c)
+{
+    _fds_clear(c);
+    pthread_mutex_lock(&c->lock);
+    for (int i = 0; i < COPIES_SHARDS; i++)
+    {
+        if (c->shard_fds[i] >= 0)
+        {
+            close(c->shard_fds[i]);
+            c->shard_fds[i] = -1;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    DIR *d = _opendir_at(c->dir_fd);
+    int res = d ? _clear_dir(d) : -errno;
+    g_atomic_int_set(&c->migrating, FALSE);
+    return res;
+}
@@ -0,0 +1,108 @@
+#ifndef COPIES_H
+#define COPIES_H
+#include <glib.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "abstract_file.h"
+
+/* The directory holding the content of the files, one entry per file ID.
+ *
+ * Copies are spread over two levels of subdirectories named by the low two
+ * bytes of the ID in hex, so the copy of file 0x12345 is at 45/23/74565.
+ * No directory holds more than a 65536th of the copies, and subdirectories
+ * are made as copies are put in them. The top level subdirectories are
+ * kept open, and the copies are reached with the *at() calls relative to
+ * them, so an access walks two short path components rather than the whole
+ * absolute path.
+ *
+ * Older data directories kept every copy at the top level. Those are moved
+ * into place by a thread which starts with the first access, so a mount
+ * can serve them at once. Until it's done, a copy which isn't where it
+ * belongs is looked for at the top level.
+ *
+ * Handles on recently opened copies are kept in a bounded cache, opened
+ * with O_PATH where there is one, so getting the attributes of a copy which
+ * was opened recently is an fstat. Regular files are changed and opened again
+ * through /proc/self/fd rather than by their paths. The handle on a copy
+ * is dropped when it's unlinked.
+ *
+ * Unless noted, the functions return 0 or more on success and -errno on
+ * failure, as the file system operations do.
+ */
+
+#define COPIES_SHARDS 256
+
+typedef struct
+{
+    char *dir;
+    int dir_fd;
+    /* The top level subdirectories, or -1 for those not opened yet */
+    int shard_fds[COPIES_SHARDS];
+    pthread_mutex_t lock;
+    /* Whether there may be copies still at the top level */
+    int migrating;
+    /* Set under lock, but read without it, atomically, on each access */
+    gboolean migration_started;
+    gboolean migration_stop;
+    pthread_t migration_thread;
+    /* File IDs to CopiesFds, with the most recently used at the head of
+     * fd_lru */
+    pthread_mutex_t fd_lock;
+    GHashTable *fds;
+    GQueue *fd_lru;
+    guint max_fds;
+    /* Counts the handles forgotten because their copies changed, so that
+     * one opened meanwhile isn't cached */
+    guint64 fd_forgets;
+    /* Whether copies can be reached through /proc/self/fd */
+    gboolean proc_fds;
+} Copies;
+
+/* Opens the copies directory dir, making it if it doesn't exist, and keeps
+ * handles on up to max_fds copies. Returns NULL and sets errno if it
+ * can't */
+Copies *copies_new (const char *dir, guint max_fds);
+/* Stops the migration, if one is running, and closes the directory */
+void copies_destroy (Copies *c);
+
+/* The absolute path of id's copy */
+char *copies_path (Copies *c, file_id_t id);
+
+/* Opens id's copy as open(2) does. With O_CREAT, the copy is made where it
+ * belongs */
+int copies_open (Copies *c, file_id_t id, int flags, mode_t mode);
+int copies_stat (Copies *c, file_id_t id, struct stat *st);
+int copies_truncate (Copies *c, file_id_t id, off_t size);
+int copies_chmod (Copies *c, file_id_t id, mode_t mode);
+int copies_chown (Copies *c, file_id_t id, uid_t uid, gid_t gid);
+int copies_utimens (Copies *c, file_id_t id, const struct timespec ts[2]);
+int copies_unlink (Copies *c, file_id_t id);
+int copies_mknod (Copies *c, file_id_t id, mode_t mode, dev_t dev);
+int copies_symlink (Copies *c, file_id_t id, const char *target);
+/* Makes new_id's copy another name for id's */
+int copies_link (Copies *c, file_id_t id, file_id_t new_id);
+/* Returns the length of the link's target, which isn't terminated */
+int copies_readlink (Copies *c, file_id_t id, char *buf, size_t size);
+
+/* Makes dst_name in the directory dst_fd another name for id's copy, or
+ * with reflink a clone of it which shares its blocks. A clone fails with
+ * -EOPNOTSUPP, or another error, where the file system can't make one */
+int copies_export (Copies *c, file_id_t id, int dst_fd, const char *dst_name, gboolean reflink);
+/* Replaces id's copy with another name for src_name in the directory
+ * src_fd, or with reflink a clone of it. The copy keeps its mode. Anything
+ * which has the copy open keeps the old one */
+int copies_import (Copies *c, file_id_t id, int src_fd, const char *src_name, gboolean reflink);
+/* If id's copy is a regular file with more than one name, replaces it with
+ * a file of its own with the same content and attributes, so it can be
+ * changed without changing the others. Returns 1 if it did, 0 if the copy
+ * wasn't shared or -errno */
+int copies_unshare (Copies *c, file_id_t id);
+
+/* Moves up to max copies from the top level to where they belong, or all
+ * of them if max is 0. Returns the number moved or -errno */
+int copies_migrate (Copies *c, guint max);
+/* Removes every copy */
+int copies_clear (Copies *c);
+
+#endif /* COPIES_H */
@@ -0,0 +1,333 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "log.h"
+#include "util.h"
+#include "sql.h"
+#include "dedup.h"
+
+/* Where the shared content is kept, in the copies directory */
+#define DEDUP_DIR "content"
+/* Longest name of a content's file relative to DEDUP_DIR */
+#define OBJECT_NAME_LEN 128
+/* Bytes read at a time when hashing */
+#define HASH_BUF (128 * 1024)
+
+enum { GETKEY ,
+    SETKEY ,
+    DELKEY ,
+    GETREF ,
+    SETREF ,
+    DELREF ,
+    NUMBER_OF_STMTS };
+#define STMT(_d,_i) ((_d)->stmts[(_i)])
+
+typedef int (*share_fn) (Copies *c, file_id_t id, int fd, const char *name, gboolean reflink);
+
+Dedup *dedup_new (Copies *c, sqlite3 *db)
+{
+    if (mkdirat(c->dir_fd, DEDUP_DIR, 0755) != 0 && errno != EEXIST)
+    {
+        return NULL;
+    }
+    int fd = openat(c->dir_fd, DEDUP_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    Dedup *res = g_malloc0(sizeof(Dedup));
+    res->copies = c;
+    res->db = db;
+    res->dir_fd = fd;
+    res->reflink = TRUE;
+    pthread_mutex_init(&res->lock, NULL);
+    res->writers = g_hash_table_new(g_direct_hash, g_direct_equal);
+    res->hashing = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    sql_prepare(db, "select key from file_content where file = ?", STMT(res, GETKEY));
+    sql_prepare(db, "insert or replace into file_content(file, key) values(?,?)", STMT(res, SETKEY));
+    sql_prepare(db, "delete from file_content where file = ?", STMT(res, DELKEY));
+    sql_prepare(db, "select refs from content where key = ?", STMT(res, GETREF));
+    sql_prepare(db, "insert or replace into content(key, refs) values(?,?)", STMT(res, SETREF));
+    sql_prepare(db, "delete from content where key = ?", STMT(res, DELREF));
+    return res;
+}
+
+void dedup_destroy (Dedup *d)
+{
+    if (d)
+    {
+        for (int i = 0; i < NUMBER_OF_STMTS; i++)
+        {
+            sqlite3_finalize(STMT(d, i));
+        }
+        g_hash_table_destroy(d->writers);
+        g_hash_table_destroy(d->hashing);
+        pthread_mutex_destroy(&d->lock);
+        close(d->dir_fd);
+        g_free(d);
+    }
+}
+
+static void _object_name (const char *key, char *name)
+{
+    snprintf(name, OBJECT_NAME_LEN, "%.2s/%s", key, key);
+}
+
+/* The key for id's copy: the hash of its content along with its mode and
+ * owner. Returns NULL if the copy isn't to be shared, as when it's been
+ * linked to another file's copy and a write through either should be seen
+ * by both */
+static char *_content_key (Dedup *d, file_id_t id)
+{
+    struct stat st;
+    if (copies_stat(d->copies, id, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < DEDUP_MIN_SIZE
+            || st.st_nlink > 1)
+    {
+        return NULL;
+    }
+    int fd = copies_open(d->copies, id, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA256);
+    guchar *buf = g_malloc(HASH_BUF);
+    ssize_t n;
+    while ((n = read(fd, buf, HASH_BUF)) > 0)
+    {
+        g_checksum_update(sum, buf, n);
+    }
+    char *res = NULL;
+    if (n == 0)
+    {
+        res = g_strdup_printf("%s-%o-%u-%u", g_checksum_get_string(sum),
+                (guint) (st.st_mode & 07777), (guint) st.st_uid, (guint) st.st_gid);
+    }
+    g_free(buf);
+    g_checksum_free(sum);
+    close(fd);
+    return res;
+}
+
+/* The rest must be called with the lock held */
+
+static char *_file_key (Dedup *d, file_id_t id)
+{
+    sqlite3_stmt *stmt = STMT(d, GETKEY);
+    char *res = NULL;
+    sqlite3_reset(stmt);
+    sqlite3_bind_int64(stmt, 1, id);
+    if (sql_next_row(stmt) == SQLITE_ROW)
+    {
+        res = g_strdup((const char*) sqlite3_column_text(stmt, 0));
+    }
+    sqlite3_reset(stmt);
+    return res;
+}
+
+static void _set_file_key (Dedup *d, file_id_t id, const char *key)
+{
+    sqlite3_stmt *stmt = STMT(d, key ? SETKEY : DELKEY);
+    sqlite3_reset(stmt);
+    sqlite3_bind_int64(stmt, 1, id);
+    if (key)
+    {
+        sqlite3_bind_text(stmt, 2, key, -1, SQLITE_TRANSIENT);
+    }
+    sql_step(stmt);
+}
+
+static int _refs (Dedup *d, const char *key)
+{
+    sqlite3_stmt *stmt = STMT(d, GETREF);
+    int res = 0;
+    sqlite3_reset(stmt);
+    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_TRANSIENT);
+    if (sql_next_row(stmt) == SQLITE_ROW)
+    {
+        res = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_reset(stmt);
+    return res;
+}
+
+/* Sets the number of copies with the content key, removing the content
+ * when there are none */
+static void _set_refs (Dedup *d, const char *key, int refs)
+{
+    sqlite3_stmt *stmt = STMT(d, (refs > 0) ? SETREF : DELREF);
+    sqlite3_reset(stmt);
+    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_TRANSIENT);
+    if (refs > 0)
+    {
+        sqlite3_bind_int(stmt, 2, refs);
+    }
+    sql_step(stmt);
+
+    if (refs <= 0)
+    {
+        char name[OBJECT_NAME_LEN];
+        _object_name(key, name);
+        if (unlinkat(d->dir_fd, name, 0) != 0 && errno != ENOENT)
+        {
+            warn("dedup: couldn't remove %s: %s", name, strerror(errno));
+        }
+    }
+}
+
+/* Stops counting id's copy towards the content key */
+static void _drop (Dedup *d, file_id_t id, const char *key)
+{
+    _set_file_key(d, id, NULL);
+    _set_refs(d, key, _refs(d, key) - 1);
+}
+
+/* Calls fn on id's copy and the content's file, cloning if that can be
+ * done and linking otherwise */
+static int _share (Dedup *d, file_id_t id, const char *name, share_fn fn)
+{
+    if (d->reflink)
+    {
+        int res = fn(d->copies, id, d->dir_fd, name, TRUE);
+        if (res != -EOPNOTSUPP && res != -EXDEV && res != -EINVAL && res != -ENOTTY)
+        {
+            return res;
+        }
+        info("dedup: copies can't be cloned, so they'll be shared by linking");
+        d->reflink = FALSE;
+    }
+    return fn(d->copies, id, d->dir_fd, name, FALSE);
+}
+
+int dedup_begin_write (Dedup *d, file_id_t id)
+{
+    int res = 0;
+    pthread_mutex_lock(&d->lock);
+    gulong n = TO_S(g_hash_table_lookup(d->writers, TO_SP(id)));
+    g_hash_table_insert(d->writers, TO_SP(id), TO_SP(n + 1));
+    /* Whatever is being hashed is out of date */
+    g_hash_table_remove(d->hashing, TO_SP(id));
+
+    char *key = _file_key(d, id);
+    if (key)
+    {
+        /* If no other copy has the content, removing the content's file
+         * leaves the copy with a file of its own, without copying it */
+        res = (_refs(d, key) > 1) ? copies_unshare(d->copies, id) : 0;
+        if (res >= 0 || res == -ENOENT)
+        {
+            _drop(d, id, key);
+            res = 0;
+        }
+        g_free(key);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return res;
+}
+
+int dedup_end_write (Dedup *d, file_id_t id)
+{
+    pthread_mutex_lock(&d->lock);
+    gulong n = TO_S(g_hash_table_lookup(d->writers, TO_SP(id)));
+    if (n > 1)
+    {
+        g_hash_table_insert(d->writers, TO_SP(id), TO_SP(n - 1));
+        pthread_mutex_unlock(&d->lock);
+        return 0;
+    }
+    g_hash_table_remove(d->writers, TO_SP(id));
+    gulong number = ++d->hash_number;
+    g_hash_table_insert(d->hashing, TO_SP(id), TO_SP(number));
+    pthread_mutex_unlock(&d->lock);
+
+    /* Hashing can take a while, so it's done without the lock */
+    char *key = _content_key(d, id);
+    if (d->hashed)
+    {
+        d->hashed(id);
+    }
+
+    int res = 0;
+    pthread_mutex_lock(&d->lock);
+    /* If the copy was written while it was being hashed, the hash is out
+     * of date, even if a later hash is under way */
+    gboolean current = (TO_S(g_hash_table_lookup(d->hashing, TO_SP(id))) == number);
+    if (current)
+    {
+        g_hash_table_remove(d->hashing, TO_SP(id));
+    }
+    if (current && key)
+    {
+        char name[OBJECT_NAME_LEN];
+        _object_name(key, name);
+
+        /* Left over if dedup_begin_write couldn't unshare the copy */
+        char *old = _file_key(d, id);
+        if (old)
+        {
+            _drop(d, id, old);
+            g_free(old);
+        }
+
+        int refs = _refs(d, key);
+        if (refs > 0 && faccessat(d->dir_fd, name, F_OK, AT_SYMLINK_NOFOLLOW) == 0)
+        {
+            res = _share(d, id, name, copies_import);
+        }
+        else
+        {
+            char dir[3];
+            g_strlcpy(dir, key, sizeof(dir));
+            if (mkdirat(d->dir_fd, dir, 0755) != 0 && errno != EEXIST)
+            {
+                res = -errno;
+            }
+            else
+            {
+                res = _share(d, id, name, copies_export);
+            }
+        }
+
+        if (res == 0)
+        {
+            _set_refs(d, key, refs + 1);
+            _set_file_key(d, id, key);
+            res = 1;
+        }
+        else
+        {
+            warn("dedup: couldn't share the copy of %" G_GUINT64_FORMAT ": %s", id, strerror(-res));
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+    g_free(key);
+    return res;
+}
+
+void dedup_forget (Dedup *d, file_id_t id)
+{
+    pthread_mutex_lock(&d->lock);
+    g_hash_table_remove(d->hashing, TO_SP(id));
+    char *key = _file_key(d, id);
+    if (key)
+    {
+        _drop(d, id, key);
+        g_free(key);
+    }
+    pthread_mutex_unlock(&d->lock);
+}
+
+gboolean dedup_is_shared (Dedup *d, file_id_t id)
+{
+    pthread_mutex_lock(&d->lock);
+    char *key = _file_key(d, id);
+    pthread_mutex_unlock(&d->lock);
+    g_free(key);
+    return key != NULL;
+}
@@ -0,0 +1,75 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+#include <glib.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include "abstract_file.h"
+#include "copies.h"
+
+/* A content-addressed store which shares the copies of files with the same
+ * content.
+ *
+ * When the last writer of a copy lets it go, the copy is hashed. The first
+ * copy with a given content is given a second name under content/ in the
+ * copies directory, and later copies with that content are replaced with
+ * clones of it (reflinks, sharing the blocks) where the file system can
+ * make them, or else with more names for it. The mode and owner are part
+ * of the content since linked copies share them. The content table counts
+ * the copies which share each content and file_content says which content
+ * each copy has. A content's file is removed with its last copy.
+ *
+ * Linked copies are shared outright, so a copy is given a file of its own
+ * before it's opened for writing or its attributes are changed, and it
+ * stops counting towards its content until it's hashed again.
+ */
+
+typedef struct
+{
+    Copies *copies;
+    sqlite3 *db;
+    /* content/ in the copies directory */
+    int dir_fd;
+    /* Whether to try cloning before linking. Cleared the first time the
+     * file system can't clone */
+    gboolean reflink;
+    /* Guards the tables and writers, and is held while a copy is being
+     * replaced */
+    pthread_mutex_t lock;
+    /* File IDs to the number of writers they have */
+    GHashTable *writers;
+    /* The IDs of the copies being hashed, to the number of the hash. An ID
+     * is taken out when its copy gets a writer, and a later hash gets a new
+     * number, so a hash is only stored if the copy hasn't been written
+     * since it started */
+    GHashTable *hashing;
+    gulong hash_number;
+    /* Called once a copy has been hashed, before the hash is stored. For
+     * tests */
+    void (*hashed) (file_id_t id);
+    sqlite3_stmt *stmts[6];
+} Dedup;
+
+/* Copies smaller than this aren't shared */
+#define DEDUP_MIN_SIZE 4096
+
+/* Keeps the shared content in the copies directory of c and the counts in
+ * db, which must have the content and file_content tables. Returns NULL if
+ * the content directory can't be made */
+Dedup *dedup_new (Copies *c, sqlite3 *db);
+void dedup_destroy (Dedup *d);
+
+/* Call before id's copy is opened for writing or changed, and
+ * dedup_end_write after. Gives the copy a file of its own if it's shared.
+ * Returns 0 or -errno, in which case the copy shouldn't be changed but
+ * dedup_end_write must still be called */
+int dedup_begin_write (Dedup *d, file_id_t id);
+/* Shares id's copy with any others with the same content once it has no
+ * more writers. Returns 1 if the copy is shared, 0 if not or -errno */
+int dedup_end_write (Dedup *d, file_id_t id);
+/* Call when id's copy is removed */
+void dedup_forget (Dedup *d, file_id_t id);
+/* Whether id's copy shares its content through the store. Such a copy has
+ * other names, but none of them are changed in place */
+gboolean dedup_is_shared (Dedup *d, file_id_t id);
+
+#endif /* DEDUP_H */
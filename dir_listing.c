@@ -0,0 +1,250 @@
+#include <string.h>
+#include "dir_listing.h"
+
+DirListing *dir_listing_new (void)
+{
+    DirListing *res = g_malloc(sizeof(DirListing));
+    res->names = g_string_new(NULL);
+    res->offsets = g_array_new(FALSE, FALSE, sizeof(guint32));
+    res->ref_count = 1;
+    res->files_left_out = FALSE;
+    return res;
+}
+
+DirListing *dir_listing_ref (DirListing *l)
+{
+    g_atomic_int_inc(&l->ref_count);
+    return l;
+}
+
+void dir_listing_unref (DirListing *l)
+{
+    if (l && g_atomic_int_dec_and_test(&l->ref_count))
+    {
+        g_string_free(l->names, TRUE);
+        g_array_free(l->offsets, TRUE);
+        g_free(l);
+    }
+}
+
+void dir_listing_add (DirListing *l, const char *name, guint64 ino)
+{
+    g_string_append_len(l->names, (char*) &ino, sizeof(ino));
+    guint32 offset = l->names->len;
+    /* Include the terminator so that each name can be used in place */
+    g_string_append_len(l->names, name, strlen(name) + 1);
+    g_array_append_val(l->offsets, offset);
+}
+
+guint64 dir_listing_ino (DirListing *l, guint i)
+{
+    guint64 res;
+    memcpy(&res, dir_listing_name(l, i) - sizeof(res), sizeof(res));
+    return res;
+}
+
+static gint _compare_names (gconstpointer a, gconstpointer b, gpointer names)
+{
+    return strcmp((char*) names + *(guint32*) a, (char*) names + *(guint32*) b);
+}
+
+void dir_listing_sort (DirListing *l)
+{
+    g_array_sort_with_data(l->offsets, _compare_names, l->names->str);
+
+    /* The duplicates' bytes stay in names, which is fine for a short-lived
+     * listing */
+    guint kept = 0;
+    for (guint i = 0; i < dir_listing_size(l); i++)
+    {
+        if (kept == 0 || strcmp(dir_listing_name(l, i), dir_listing_name(l, kept - 1)) != 0)
+        {
+            g_array_index(l->offsets, guint32, kept) = g_array_index(l->offsets, guint32, i);
+            kept++;
+        }
+    }
+    g_array_set_size(l->offsets, kept);
+}
+
+gboolean dir_listing_has (DirListing *l, const char *name)
+{
+    guint lo = 0;
+    guint hi = dir_listing_size(l);
+    while (lo < hi)
+    {
+        guint mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(dir_listing_name(l, mid), name);
+        if (cmp == 0)
+        {
+            return TRUE;
+        }
+        if (cmp < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return FALSE;
+}
+
+gsize dir_listing_bytes (DirListing *l)
+{
+    return sizeof(DirListing) + l->names->allocated_len + l->offsets->len * sizeof(guint32);
+}
+
+typedef struct
+{
+    tagdb_key_t key;
+    DirListing *listing;
+    gsize bytes;
+} cache_entry;
+
+/* Keys are compared in order since the stage's contents depend on the
+ * order of the tags in the path. key_equal compares them as sets */
+static guint _key_hash (gconstpointer k)
+{
+    tagdb_key_t key = (tagdb_key_t) k;
+    guint res = key->len;
+    for (guint i = 0; i < key->len; i++)
+    {
+        res = res * 31 + (guint) key_ref(key, i);
+    }
+    return res;
+}
+
+static gboolean _key_equal (gconstpointer a, gconstpointer b)
+{
+    tagdb_key_t x = (tagdb_key_t) a;
+    tagdb_key_t y = (tagdb_key_t) b;
+    return x->len == y->len &&
+        memcmp(x->data, y->data, x->len * sizeof(key_elem_t)) == 0;
+}
+
+DirListingCache *dir_listing_cache_new (gsize max_bytes)
+{
+    DirListingCache *res = g_malloc0(sizeof(DirListingCache));
+    pthread_mutex_init(&res->lock, NULL);
+    res->entries = g_hash_table_new(_key_hash, _key_equal);
+    g_queue_init(&res->lru);
+    res->max_bytes = max_bytes;
+    return res;
+}
+
+/* Must be called with the lock held */
+static void _cache_remove_link (DirListingCache *c, GList *link)
+{
+    cache_entry *e = link->data;
+    g_hash_table_remove(c->entries, e->key);
+    g_queue_delete_link(&c->lru, link);
+    c->bytes -= e->bytes;
+    key_destroy(e->key);
+    dir_listing_unref(e->listing);
+    g_free(e);
+}
+
+static void _cache_clear (DirListingCache *c)
+{
+    while (c->lru.head)
+    {
+        _cache_remove_link(c, c->lru.head);
+    }
+}
+
+void dir_listing_cache_destroy (DirListingCache *c)
+{
+    if (c)
+    {
+        _cache_clear(c);
+        g_hash_table_destroy(c->entries);
+        pthread_mutex_destroy(&c->lock);
+        g_free(c);
+    }
+}
+
+DirListing *dir_listing_cache_lookup (DirListingCache *c, tagdb_key_t key, guint64 *generation)
+{
+    DirListing *res = NULL;
+    pthread_mutex_lock(&c->lock);
+    GList *link = g_hash_table_lookup(c->entries, key);
+    if (link)
+    {
+        g_queue_unlink(&c->lru, link);
+        g_queue_push_head_link(&c->lru, link);
+        res = dir_listing_ref(((cache_entry*) link->data)->listing);
+    }
+    *generation = c->generation;
+    pthread_mutex_unlock(&c->lock);
+    return res;
+}
+
+void dir_listing_cache_insert (DirListingCache *c, tagdb_key_t key, DirListing *l, guint64 generation)
+{
+    gsize bytes = dir_listing_bytes(l);
+    if (bytes > c->max_bytes)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    if (generation == c->generation)
+    {
+        GList *old = g_hash_table_lookup(c->entries, key);
+        if (old)
+        {
+            _cache_remove_link(c, old);
+        }
+        while (c->bytes + bytes > c->max_bytes && c->lru.tail)
+        {
+            _cache_remove_link(c, c->lru.tail);
+        }
+
+        cache_entry *e = g_malloc(sizeof(cache_entry));
+        e->key = key_copy(key);
+        e->listing = dir_listing_ref(l);
+        e->bytes = bytes;
+        g_queue_push_head(&c->lru, e);
+        g_hash_table_insert(c->entries, e->key, c->lru.head);
+        c->bytes += bytes;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+void dir_listing_cache_invalidate (DirListingCache *c, key_elem_t tag_id)
+{
+    pthread_mutex_lock(&c->lock);
+    c->generation++;
+    if (tag_id == DIR_LISTING_ALL)
+    {
+        _cache_clear(c);
+    }
+    else
+    {
+        GList *it = c->lru.head;
+        while (it)
+        {
+            GList *next = it->next;
+            tagdb_key_t k = ((cache_entry*) it->data)->key;
+            if ((tag_id == DIR_LISTING_ROOT) ? key_is_empty(k) : key_contains(k, tag_id))
+            {
+                _cache_remove_link(c, it);
+            }
+            it = next;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+void dir_listing_cache_invalidate_key (DirListingCache *c, tagdb_key_t key)
+{
+    pthread_mutex_lock(&c->lock);
+    c->generation++;
+    GList *link = g_hash_table_lookup(c->entries, key);
+    if (link)
+    {
+        _cache_remove_link(c, link);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
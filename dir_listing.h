@@ -0,0 +1,95 @@
+#ifndef DIR_LISTING_H
+#define DIR_LISTING_H
+#include <glib.h>
+#include <pthread.h>
+#include "key.h"
+
+/* A snapshot of the names in a directory, for readdir.
+ *
+ * The names are packed end to end in one buffer, each preceded by the
+ * entry's inode number, with an array of their offsets. A listing costs
+ * the bytes of its names plus twelve bytes an entry rather than a list
+ * node and a string allocation for each. Once
+ * sorted, an entry's index is a stable cursor for the offset-based readdir
+ * protocol: entry i is passed to the filler with offset i + 1.
+ *
+ * Listings are reference counted so that one in the cache can be read by
+ * any number of open directories while it is replaced.
+ *
+ * A directory with too many files to list at once is listed without them,
+ * and readdir reads them from the TagDB a part at a time after the entries
+ * in the listing.
+ */
+
+typedef struct
+{
+    /* Each entry's guint64 inode number, unaligned, then its name */
+    GString *names;
+    /* guint32 offsets of each name in names */
+    GArray *offsets;
+    gint ref_count;
+    /* Whether the directory's files aren't in the listing */
+    gboolean files_left_out;
+} DirListing;
+
+DirListing *dir_listing_new (void);
+DirListing *dir_listing_ref (DirListing *l);
+void dir_listing_unref (DirListing *l);
+
+void dir_listing_add (DirListing *l, const char *name, guint64 ino);
+/* Sorts the names and removes duplicates */
+void dir_listing_sort (DirListing *l);
+/* Whether a sorted listing has name */
+gboolean dir_listing_has (DirListing *l, const char *name);
+/* Bytes used by the listing */
+gsize dir_listing_bytes (DirListing *l);
+
+#define dir_listing_size(_l) ((_l)->offsets->len)
+#define dir_listing_name(_l, _i) ((_l)->names->str + g_array_index((_l)->offsets, guint32, (_i)))
+guint64 dir_listing_ino (DirListing *l, guint i);
+
+/* A cache of listings by the key of the directory's path.
+ *
+ * Listings are invalidated by tag: a change involving a tag drops the
+ * listings whose keys contain it. When the listings take more than the
+ * cache's byte limit, the least recently used are dropped.
+ *
+ * A listing built from a TagDB which changed while it was being built
+ * would be stale, so lookups return a generation which inserts must pass
+ * back. An insert is ignored if anything was invalidated in between.
+ */
+
+/* Invalidates the listing of the root directory, whose key is empty */
+#define DIR_LISTING_ROOT UNTAGGED
+/* Invalidates every listing */
+#define DIR_LISTING_ALL ((key_elem_t) -1)
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    /* Keys to links in lru */
+    GHashTable *entries;
+    /* Cache entries, most recently used first */
+    GQueue lru;
+    gsize bytes;
+    gsize max_bytes;
+    guint64 generation;
+} DirListingCache;
+
+DirListingCache *dir_listing_cache_new (gsize max_bytes);
+void dir_listing_cache_destroy (DirListingCache *c);
+
+/* Returns a new reference to the listing for key or NULL. Sets generation
+ * for a subsequent dir_listing_cache_insert */
+DirListing *dir_listing_cache_lookup (DirListingCache *c, tagdb_key_t key, guint64 *generation);
+/* Caches a reference to l for key, unless the cache was invalidated since
+ * the lookup which returned generation */
+void dir_listing_cache_insert (DirListingCache *c, tagdb_key_t key, DirListing *l, guint64 generation);
+
+/* Drops the listings whose keys contain tag_id, or the root's or all of
+ * them for DIR_LISTING_ROOT and DIR_LISTING_ALL */
+void dir_listing_cache_invalidate (DirListingCache *c, key_elem_t tag_id);
+/* Drops the listing for key alone */
+void dir_listing_cache_invalidate_key (DirListingCache *c, tagdb_key_t key);
+
+#endif /* DIR_LISTING_H */
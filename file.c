@@ -1,4 +1,5 @@
 #include <glib.h>
+#include <string.h>
 #include "types.h"
 #include "abstract_file.h"
 #include "file.h"
@@ -33,6 +34,7 @@ void file_init (File *f, const char *name)
 {
     abstract_file_init(&f->base, name);
     f->tags = tag_table_new();
+    memset(&f->attrs, 0, sizeof(FileAttrs));
 }
 
 File *new_file (const char *name)
@@ -144,3 +146,55 @@ gboolean file_is_untagged (File *f)
         return (g_hash_table_size(f->tags) == 0);
     return FALSE;
 }
+
+#define NS_PER_S 1000000000LL
+#define TS_TO_NS(_ts) ((gint64) (_ts).tv_sec * NS_PER_S + (_ts).tv_nsec)
+#define NS_TO_TS(_ns, _ts) ((_ts).tv_sec = (_ns) / NS_PER_S, (_ts).tv_nsec = (_ns) % NS_PER_S)
+
+void file_set_attrs (File *f, const struct stat *st)
+{
+    if (!lock_timed_out(abstract_file_lock(f)))
+    {
+        f->attrs.valid = (st != NULL);
+        if (st)
+        {
+            f->attrs.size = st->st_size;
+            f->attrs.mode = st->st_mode;
+            f->attrs.uid = st->st_uid;
+            f->attrs.gid = st->st_gid;
+            f->attrs.atime = TS_TO_NS(st->st_atim);
+            f->attrs.mtime = TS_TO_NS(st->st_mtim);
+            f->attrs.ctime = TS_TO_NS(st->st_ctim);
+        }
+        abstract_file_unlock(f);
+    }
+}
+
+gboolean file_get_attrs (File *f, struct stat *st)
+{
+    FileAttrs a;
+    if (lock_timed_out(abstract_file_lock(f)))
+    {
+        return FALSE;
+    }
+    a = f->attrs;
+    abstract_file_unlock(f);
+
+    if (!a.valid)
+    {
+        return FALSE;
+    }
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = file_id(f);
+    st->st_mode = a.mode;
+    st->st_nlink = 1;
+    st->st_uid = a.uid;
+    st->st_gid = a.gid;
+    st->st_size = a.size;
+    st->st_blksize = 4096;
+    st->st_blocks = (a.size + 511) / 512;
+    NS_TO_TS(a.atime, st->st_atim);
+    NS_TO_TS(a.mtime, st->st_mtim);
+    NS_TO_TS(a.ctime, st->st_ctim);
+    return TRUE;
+}
@@ -1,12 +1,28 @@
 #ifndef FILE_H
 #define FILE_H
 #include <glib.h>
+#include <sys/stat.h>
 #include "key.h"
 #include "abstract_file.h"
 #include "types.h"
 
 typedef GHashTable TagTable;
 
+/* The attributes of a file's copy as they were last recorded, so that they
+   can be given without stat'ing the copy. Times are in nanoseconds since the
+   epoch. Nothing else is meaningful unless valid is set */
+typedef struct FileAttrs
+{
+    gboolean valid;
+    off_t size;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    gint64 atime;
+    gint64 mtime;
+    gint64 ctime;
+} FileAttrs;
+
 extern GHashTable *files_g;
 
 /* Representation of a file in the database. Contains the file name, unique id
@@ -18,6 +34,9 @@ typedef struct File
     /* File's tags
        A table of tags with the value for the tag. */
     TagTable *tags;
+
+    /* Attributes of the file's copy */
+    FileAttrs attrs;
 } File;
 
 #define file_tags(f) (f->tags)
@@ -53,6 +72,13 @@ void file_remove_tag (File *f, file_id_t tag_id);
 void file_add_tag (File *f, file_id_t tag_id, tagdb_value_t *v);
 tagdb_value_t *file_tag_value (File *f, file_id_t tag_id);
 
+/* Records the attributes in st as f's, or forgets f's if st is NULL */
+void file_set_attrs (File *f, const struct stat *st);
+/* Fills in st from f's recorded attributes. Returns FALSE, leaving st
+   as it was, if none are recorded */
+gboolean file_get_attrs (File *f, struct stat *st);
+#define file_has_attrs(_f) ((_f)->attrs.valid)
+
 gboolean file_equal (gconstpointer a, gconstpointer b);
 guint file_hash (gconstpointer file);
 void file_init (File *f, const char *name);
@@ -2,6 +2,8 @@
 #include <glib.h>
 #include <unistd.h>
 #include <assert.h>
+#include <semaphore.h>
+#include <pthread.h>
 #include "sql.h"
 #include "log.h"
 #include "util.h"
@@ -23,11 +25,55 @@ enum {INSERT,
     LOOKUP,
     LOOKUT,
     TAGUNL,
+    COLLID,
+    SUBTRE,
+    UNTAFT,
     NUMBER_OF_STMTS
 };
 
 #define STMT(_db,_i) ((_db)->stmts[(_i)])
 #define STMT_SEM(_db,_i) (&((_db)->stmt_semas[(_i)]))
+#define STMT_PROFILE(_db,_i) (&((_db)->stmt_profiles[(_i)]))
+#define STMT_ACQUIRE(_db,_i) sql_stmt_acquire(STMT_PROFILE(_db,_i), STMT_SEM(_db,_i))
+#define STMT_RELEASE(_db,_i) sql_stmt_release(STMT_PROFILE(_db,_i), STMT_SEM(_db,_i))
+#define STMT_ROW(_db,_i) sql_stmt_row(STMT_PROFILE(_db,_i))
+
+/* Statements for keys of up to this many tags are kept once they're made.
+ * Longer keys get one for the call */
+#define CACHED_KEY_LENGTH 8
+
+/* Labels for the statements for each key length in the profile output */
+static const char *key_stmt_names[CACHED_KEY_LENGTH + 1] = {
+    "",
+    "FILES1",
+    "FILES2",
+    "FILES3",
+    "FILES4",
+    "FILES5",
+    "FILES6",
+    "FILES7",
+    "FILES8"
+};
+
+/* Labels for the statements in the profile output */
+static const char *stmt_names[NUMBER_OF_STMTS] = {
+    "INSERT",
+    "REMOVE",
+    "REMNUL",
+    "GETFIL",
+    "GETUNT",
+    "TAGUNI",
+    "RMTAGU",
+    "RMDRWR",
+    "RALLTU",
+    "RTUDWR",
+    "LOOKUP",
+    "LOOKUT",
+    "TAGUNL",
+    "COLLID",
+    "SUBTRE",
+    "UNTAFT"
+};
 
 struct FileCabinet {
     /* An index on files. Usually provided to us by tagdb */
@@ -40,6 +86,20 @@ struct FileCabinet {
     sqlite3_stmt *stmts[NUMBER_OF_STMTS];
     /* Semaphores to protect prepared statements from being reset while they are executing */
     sem_t stmt_semas[NUMBER_OF_STMTS];
+    /* Execution statistics for the prepared statements */
+    sql_stmt_profile stmt_profiles[NUMBER_OF_STMTS];
+    /* Statements which list the files with all of the tags in a key, by
+     * the length of the key, with their semaphores and statistics. They're
+     * prepared the first time a key of their length is looked up */
+    sqlite3_stmt *key_stmts[CACHED_KEY_LENGTH + 1];
+    sem_t key_stmt_semas[CACHED_KEY_LENGTH + 1];
+    sql_stmt_profile key_stmt_profiles[CACHED_KEY_LENGTH + 1];
+    /* Names shared by more than one file in a drawer: tag ID -> (name ->
+     * GArray of file IDs). Names held by a single file aren't kept. A
+     * drawer's names are read from the database the first time they're
+     * asked for and kept up to date from then on */
+    GHashTable *collisions;
+    pthread_mutex_t collisions_lock;
 };
 
 FileCabinet *file_cabinet_new0 (sqlite3 *db, GHashTable *files)
@@ -47,6 +107,9 @@ FileCabinet *file_cabinet_new0 (sqlite3 *db, GHashTable *files)
     FileCabinet *res = calloc(1,sizeof(FileCabinet));
     res->sqlitedb = db;
     res->files = files;
+    res->collisions = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+            NULL, (GDestroyNotify) g_hash_table_destroy);
+    pthread_mutex_init(&res->collisions_lock, NULL);
     return file_cabinet_init(res);
 }
 
@@ -66,6 +129,10 @@ FileCabinet *file_cabinet_init (FileCabinet *res)
     {
         sem_init(&(res->stmt_semas[i]), 0, 1);
     }
+    for (int i = 0; i <= CACHED_KEY_LENGTH; i++)
+    {
+        sem_init(&(res->key_stmt_semas[i]), 0, 1);
+    }
 
     /* insert statement */
     sql_prepare(db, "insert into file_tag(file, tag) values(?,?)", STMT(res, INSERT));
@@ -82,6 +149,19 @@ FileCabinet *file_cabinet_init (FileCabinet *res)
             " where F.name=?"
             " and F.id not in (select file from file_tag)", STMT(res, LOOKUT));
     sql_prepare(db, "select distinct b.tag from file_tag a, file_tag b where a.tag=? and a.file=b.file and a.tag!=b.tag", STMT(res, TAGUNL));
+    sql_prepare(db, "select distinct F.name, F.id"
+            " from file_tag Z, file F"
+            " where Z.tag=?1 and Z.file=F.id"
+            " and F.name in (select F2.name from file_tag Z2, file F2"
+            "  where Z2.tag=?1 and Z2.file=F2.id"
+            "  group by F2.name having count(distinct F2.id) > 1)", STMT(res, COLLID));
+    /* files-with-tag-or-subtags statement */
+    sql_prepare(db, "select distinct Z.file from tag_closure C, file_tag Z"
+            " where C.ancestor=? and Z.tag=C.descendant", STMT(res, SUBTRE));
+    /* untagged-files-from-an-id statement */
+    sql_prepare(db, "select id from file"
+            " where id >= ?1 and id not in (select file from file_tag)"
+            " order by id limit ?2", STMT(res, UNTAFT));
     return res;
 }
 
@@ -94,6 +174,11 @@ void file_cabinet_destroy (FileCabinet *fc)
             sqlite3_finalize(STMT(fc,i));
             sem_destroy(&(fc->stmt_semas[i]));
         }
+        for (int i = 0; i <= CACHED_KEY_LENGTH; i++)
+        {
+            sqlite3_finalize(fc->key_stmts[i]);
+            sem_destroy(&(fc->key_stmt_semas[i]));
+        }
 
         if (fc->own_files && fc->files)
         {
@@ -104,6 +189,8 @@ void file_cabinet_destroy (FileCabinet *fc)
             g_hash_table_destroy(fc->files);
         }
 
+        g_hash_table_destroy(fc->collisions);
+        pthread_mutex_destroy(&fc->collisions_lock);
         free(fc);
     }
 }
@@ -119,7 +206,6 @@ File *_find_file(FileCabinet *fc, tagdb_key_t key, const char *name)
 {
     int stmt_code;
     sqlite3_stmt *stmt = NULL;
-    sem_t *stmt_sem;
 
     if (key_is_empty(key))
     {
@@ -131,8 +217,7 @@ File *_find_file(FileCabinet *fc, tagdb_key_t key, const char *name)
     }
 
     stmt = STMT(fc, stmt_code);
-    stmt_sem = STMT_SEM(fc, stmt_code);
-    sem_wait(stmt_sem);
+    STMT_ACQUIRE(fc, stmt_code);
     sqlite3_reset(stmt);
 
     if (stmt_code == LOOKUT)
@@ -148,35 +233,186 @@ File *_find_file(FileCabinet *fc, tagdb_key_t key, const char *name)
 
     while (sql_next_row(stmt) == SQLITE_ROW)
     {
+        STMT_ROW(fc, stmt_code);
         int id = sqlite3_column_int(stmt, 0);
         File *f = g_hash_table_lookup(fc->files, TO_P(id));
         if (f && file_has_tags(f, key))
         {
-            sem_post(stmt_sem);
+            STMT_RELEASE(fc, stmt_code);
             return f;
         }
     }
 
-    sem_post(stmt_sem);
+    STMT_RELEASE(fc, stmt_code);
     return NULL;
 }
 
+static void _free_id_array (gpointer a)
+{
+    g_array_free(a, TRUE);
+}
+
+static GHashTable *_new_drawer_names ()
+{
+    return g_hash_table_new_full(g_str_hash, g_str_equal, g_free, _free_id_array);
+}
+
+/* Returns the shared names of the drawer, reading them from the database if
+ * load is set and they haven't been yet. Returns NULL if they aren't loaded.
+ * Must be called with the collisions lock held */
+static GHashTable *_drawer_names (FileCabinet *fc, file_id_t key, gboolean load)
+{
+    GHashTable *res = g_hash_table_lookup(fc->collisions, TO_SP(key));
+    if (res || !load)
+    {
+        return res;
+    }
+
+    res = _new_drawer_names();
+    sqlite3_stmt *stmt = STMT(fc, COLLID);
+    STMT_ACQUIRE(fc, COLLID);
+    sqlite3_reset(stmt);
+    sqlite3_bind_int(stmt, 1, key);
+    while (sql_next_row(stmt) == SQLITE_ROW)
+    {
+        STMT_ROW(fc, COLLID);
+        const char *name = (const char*) sqlite3_column_text(stmt, 0);
+        file_id_t id = sqlite3_column_int64(stmt, 1);
+        GArray *ids = g_hash_table_lookup(res, name);
+        if (!ids)
+        {
+            ids = g_array_sized_new(FALSE, FALSE, sizeof(file_id_t), 2);
+            g_hash_table_insert(res, g_strdup(name), ids);
+        }
+        g_array_append_val(ids, id);
+    }
+    STMT_RELEASE(fc, COLLID);
+    g_hash_table_insert(fc->collisions, TO_SP(key), res);
+    return res;
+}
+
+/* Updates the shared names of a loaded drawer for f having been put in it
+ * under name */
+static void _collision_add (FileCabinet *fc, file_id_t key, File *f, const char *name)
+{
+    pthread_mutex_lock(&fc->collisions_lock);
+    GHashTable *names = _drawer_names(fc, key, FALSE);
+    if (names)
+    {
+        GArray *ids = g_hash_table_lookup(names, name);
+        if (ids)
+        {
+            file_id_t id = file_id(f);
+            gboolean have = FALSE;
+            for (guint i = 0; i < ids->len && !have; i++)
+            {
+                have = (g_array_index(ids, file_id_t, i) == id);
+            }
+            if (!have)
+            {
+                g_array_append_val(ids, id);
+            }
+        }
+        else
+        {
+            /* The name may have just become shared, and then we need the
+             * file which already had it */
+            ids = g_array_sized_new(FALSE, FALSE, sizeof(file_id_t), 2);
+            sqlite3_stmt *stmt = STMT(fc, LOOKUP);
+            STMT_ACQUIRE(fc, LOOKUP);
+            sqlite3_reset(stmt);
+            sqlite3_bind_int(stmt, 1, key);
+            sqlite3_bind_text(stmt, 2, name, -1, SQLITE_TRANSIENT);
+            while (sql_next_row(stmt) == SQLITE_ROW)
+            {
+                STMT_ROW(fc, LOOKUP);
+                file_id_t id = sqlite3_column_int64(stmt, 0);
+                g_array_append_val(ids, id);
+            }
+            STMT_RELEASE(fc, LOOKUP);
+
+            if (ids->len > 1)
+            {
+                g_hash_table_insert(names, g_strdup(name), ids);
+            }
+            else
+            {
+                g_array_free(ids, TRUE);
+            }
+        }
+    }
+    pthread_mutex_unlock(&fc->collisions_lock);
+}
+
+/* Updates the shared names of a loaded drawer for f having been taken out
+ * of it or no longer being called name */
+static void _collision_remove (FileCabinet *fc, file_id_t key, File *f, const char *name)
+{
+    pthread_mutex_lock(&fc->collisions_lock);
+    GHashTable *names = _drawer_names(fc, key, FALSE);
+    GArray *ids = names ? g_hash_table_lookup(names, name) : NULL;
+    if (ids)
+    {
+        for (guint i = 0; i < ids->len; i++)
+        {
+            if (g_array_index(ids, file_id_t, i) == file_id(f))
+            {
+                g_array_remove_index_fast(ids, i);
+                break;
+            }
+        }
+
+        if (ids->len < 2)
+        {
+            g_hash_table_remove(names, name);
+        }
+    }
+    pthread_mutex_unlock(&fc->collisions_lock);
+}
+
+GArray *file_cabinet_name_collisions (FileCabinet *fc, file_id_t slot_id, const char *name)
+{
+    GArray *res = NULL;
+    pthread_mutex_lock(&fc->collisions_lock);
+    GArray *ids = g_hash_table_lookup(_drawer_names(fc, slot_id, TRUE), name);
+    if (ids)
+    {
+        res = g_array_sized_new(FALSE, FALSE, sizeof(file_id_t), ids->len);
+        g_array_append_vals(res, ids->data, ids->len);
+    }
+    pthread_mutex_unlock(&fc->collisions_lock);
+    return res;
+}
+
+void file_cabinet_rename_file (FileCabinet *fc, File *f, const char *old_name)
+{
+    HL(file_tags(f), it, k, v)
+    {
+        _collision_remove(fc, TO_S(k), f, old_name);
+        _collision_add(fc, TO_S(k), f, file_name(f));
+    } HL_END;
+}
+
 void _sqlite_rm_drawer_stmt(FileCabinet *fc, file_id_t key);
 void file_cabinet_remove_drawer (FileCabinet *fc, file_id_t slot_id)
 {
     _sqlite_rm_drawer_stmt(fc, slot_id);
+    pthread_mutex_lock(&fc->collisions_lock);
+    g_hash_table_remove(fc->collisions, TO_SP(slot_id));
+    pthread_mutex_unlock(&fc->collisions_lock);
 }
 
 int file_cabinet_drawer_size (FileCabinet *fc, file_id_t key)
 {
     sqlite3_stmt *stmt = STMT(fc, GETFIL);
-    sem_wait(STMT_SEM(fc, GETFIL));
+    STMT_ACQUIRE(fc, GETFIL);
     sqlite3_reset(stmt);
     sqlite3_bind_int(stmt, 1, key);
     int sum = 0;
     int status;
     while ((status = sqlite3_step(stmt)) == SQLITE_ROW)
     {
+        STMT_ROW(fc, GETFIL);
         sum++;
     }
 
@@ -185,14 +421,13 @@ int file_cabinet_drawer_size (FileCabinet *fc, file_id_t key)
         const char* msg = sqlite3_errmsg(fc->sqlitedb);
         error("We didn't finish the count SQLite statemnt: %s(%d)", msg, status);
     }
-    sem_post(STMT_SEM(fc, GETFIL));
+    STMT_RELEASE(fc, GETFIL);
     return sum;
 }
 
 GList *_sqlite_getfile_stmt(FileCabinet *fc, file_id_t key)
 {
     sqlite3_stmt *stmt;
-    sem_t *stmt_sem;
     int status;
     int stmt_code;
     if (key)
@@ -206,8 +441,7 @@ GList *_sqlite_getfile_stmt(FileCabinet *fc, file_id_t key)
         stmt_code = GETUNT;
     }
 
-    stmt_sem = STMT_SEM(fc, stmt_code);
-    sem_wait(stmt_sem);
+    STMT_ACQUIRE(fc, stmt_code);
     sqlite3_reset(stmt);
 
     if (key)
@@ -219,6 +453,7 @@ GList *_sqlite_getfile_stmt(FileCabinet *fc, file_id_t key)
 
     while ((status = sqlite3_step(stmt)) == SQLITE_ROW)
     {
+        STMT_ROW(fc, stmt_code);
         int id = sqlite3_column_int(stmt, 0);
         /* get the actual file */
         File *f = g_hash_table_lookup(fc->files, TO_P(id));
@@ -233,7 +468,36 @@ GList *_sqlite_getfile_stmt(FileCabinet *fc, file_id_t key)
         const char* msg = sqlite3_errmsg(fc->sqlitedb);
         error("We didn't finish the getfile SQLite statemnt: %s(%d)", msg, status);
     }
-    sem_post(stmt_sem);
+    STMT_RELEASE(fc, stmt_code);
+    return res;
+}
+
+GList *file_cabinet_get_subtree_files (FileCabinet *fc, file_id_t slot_id)
+{
+    sqlite3_stmt *stmt = STMT(fc, SUBTRE);
+    int status;
+    STMT_ACQUIRE(fc, SUBTRE);
+    sqlite3_reset(stmt);
+    sqlite3_bind_int(stmt, 1, slot_id);
+
+    GList *res = NULL;
+    while ((status = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        STMT_ROW(fc, SUBTRE);
+        int id = sqlite3_column_int(stmt, 0);
+        File *f = g_hash_table_lookup(fc->files, TO_P(id));
+        if (f)
+        {
+            res = g_list_prepend(res, f);
+        }
+    }
+
+    if (status != SQLITE_DONE)
+    {
+        const char* msg = sqlite3_errmsg(fc->sqlitedb);
+        error("We didn't finish the subtree SQLite statement: %s(%d)", msg, status);
+    }
+    STMT_RELEASE(fc, SUBTRE);
     return res;
 }
 
@@ -241,7 +505,6 @@ void _sqlite_rm_stmt(FileCabinet *fc, File *f, file_id_t key)
 {
     int stmt_code;
     sqlite3_stmt *stmt = NULL;
-    sem_t *stmt_sem;
 
     if (key)
     {
@@ -253,8 +516,7 @@ void _sqlite_rm_stmt(FileCabinet *fc, File *f, file_id_t key)
     }
 
     stmt = STMT(fc, stmt_code);
-    stmt_sem = STMT_SEM(fc, stmt_code);
-    sem_wait(stmt_sem);
+    STMT_ACQUIRE(fc, stmt_code);
     sqlite3_reset(stmt);
     sqlite3_bind_int(stmt, 1, file_id(f));
 
@@ -265,7 +527,7 @@ void _sqlite_rm_stmt(FileCabinet *fc, File *f, file_id_t key)
 
     sql_step(stmt);
 
-    sem_post(stmt_sem);
+    STMT_RELEASE(fc, stmt_code);
 }
 
 void _sqlite_rm_drawer_stmt(FileCabinet *fc, file_id_t key)
@@ -273,27 +535,158 @@ void _sqlite_rm_drawer_stmt(FileCabinet *fc, file_id_t key)
     if (key)
     {
         sqlite3_stmt *stmt = STMT(fc, RMDRWR);
-        sem_wait(STMT_SEM(fc, RMDRWR));
+        STMT_ACQUIRE(fc, RMDRWR);
         sqlite3_reset(stmt);
         sqlite3_bind_int(stmt, 1, key);
         sql_step(stmt);
-        sem_post(STMT_SEM(fc, RMDRWR));
+        STMT_RELEASE(fc, RMDRWR);
+    }
+}
+
+/* A statement for the files with all of n tags. The first tag's drawer is
+ * read through its index and each of the others is checked by the primary
+ * key of file_tag, so nothing is copied out of SQLite but the result. Only
+ * the files from the ID bound to n + 1 on are listed, at most the number
+ * bound to n + 2 of them, so a large drawer can be read a part at a time */
+static sqlite3_stmt *_prepare_key_stmt (FileCabinet *fc, guint n)
+{
+    GString *cmd = g_string_new("select Z0.file from file_tag Z0");
+    for (guint i = 1; i < n; i++)
+    {
+        g_string_append_printf(cmd, ", file_tag Z%u", i);
     }
+    g_string_append(cmd, " where Z0.tag = ?1");
+    for (guint i = 1; i < n; i++)
+    {
+        g_string_append_printf(cmd, " and Z%u.file = Z0.file and Z%u.tag = ?%u", i, i, i + 1);
+    }
+    /* The index on tags has them in order already */
+    g_string_append_printf(cmd, " and Z0.file >= ?%u order by Z0.file limit ?%u", n + 1, n + 2);
+
+    sqlite3_stmt *res = NULL;
+    sql_prepare(fc->sqlitedb, cmd->str, res);
+    g_string_free(cmd, TRUE);
+    return res;
+}
+
+GList *file_cabinet_get_files_with_tags (FileCabinet *fc, tagdb_key_t key)
+{
+    return file_cabinet_get_files_with_tags_from(fc, key, 0, -1);
+}
+
+/* Returns up to limit untagged files with IDs from from on, in order */
+static GList *_get_untagged_files_from (FileCabinet *fc, file_id_t from, int limit)
+{
+    sqlite3_stmt *stmt = STMT(fc, UNTAFT);
+    int status;
+    STMT_ACQUIRE(fc, UNTAFT);
+    sqlite3_reset(stmt);
+    sqlite3_bind_int64(stmt, 1, from);
+    sqlite3_bind_int(stmt, 2, limit);
+
+    GList *res = NULL;
+    while ((status = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        STMT_ROW(fc, UNTAFT);
+        int id = sqlite3_column_int(stmt, 0);
+        File *f = g_hash_table_lookup(fc->files, TO_P(id));
+        if (f)
+        {
+            res = g_list_prepend(res, f);
+        }
+    }
+
+    if (status != SQLITE_DONE)
+    {
+        const char* msg = sqlite3_errmsg(fc->sqlitedb);
+        error("We didn't finish the untagged-files-from SQLite statement: %s(%d)", msg, status);
+    }
+    STMT_RELEASE(fc, UNTAFT);
+    return g_list_reverse(res);
+}
+
+GList *file_cabinet_get_files_with_tags_from (FileCabinet *fc, tagdb_key_t key, file_id_t from, int limit)
+{
+    guint n = key_length(key);
+    if (n == 0)
+    {
+        return _get_untagged_files_from(fc, from, limit);
+    }
+
+    sqlite3_stmt *stmt;
+    gboolean cached = (n <= CACHED_KEY_LENGTH);
+    if (cached)
+    {
+        sql_stmt_acquire(&fc->key_stmt_profiles[n], &fc->key_stmt_semas[n]);
+        if (!fc->key_stmts[n])
+        {
+            fc->key_stmts[n] = _prepare_key_stmt(fc, n);
+        }
+        stmt = fc->key_stmts[n];
+    }
+    else
+    {
+        stmt = _prepare_key_stmt(fc, n);
+    }
+
+    GList *res = NULL;
+    if (stmt)
+    {
+        sqlite3_reset(stmt);
+        KL(key, i)
+        {
+            sqlite3_bind_int(stmt, i + 1, key_ref(key, i));
+        } KL_END;
+        sqlite3_bind_int64(stmt, n + 1, from);
+        sqlite3_bind_int(stmt, n + 2, limit);
+
+        int status;
+        while ((status = sqlite3_step(stmt)) == SQLITE_ROW)
+        {
+            if (cached)
+            {
+                sql_stmt_row(&fc->key_stmt_profiles[n]);
+            }
+            int id = sqlite3_column_int(stmt, 0);
+            File *f = g_hash_table_lookup(fc->files, TO_P(id));
+            if (f)
+            {
+                res = g_list_prepend(res, f);
+            }
+        }
+
+        if (status != SQLITE_DONE)
+        {
+            const char* msg = sqlite3_errmsg(fc->sqlitedb);
+            error("We didn't finish the files-with-tags SQLite statement: %s(%d)", msg, status);
+        }
+    }
+
+    if (cached)
+    {
+        sql_stmt_release(&fc->key_stmt_profiles[n], &fc->key_stmt_semas[n]);
+    }
+    else
+    {
+        sqlite3_finalize(stmt);
+    }
+    return g_list_reverse(res);
 }
 
 GList *_sqlite_tag_union_list_stmt(FileCabinet *fc, file_id_t key)
 {
     sqlite3_stmt *stmt = STMT(fc, TAGUNL);
-    sem_wait(STMT_SEM(fc,TAGUNL));
+    STMT_ACQUIRE(fc, TAGUNL);
     sqlite3_reset(stmt);
     sqlite3_bind_int(stmt, 1, key);
     GList *res = NULL;
     while (sql_next_row(stmt) == SQLITE_ROW)
     {
+        STMT_ROW(fc, TAGUNL);
         file_id_t id = sqlite3_column_int64(stmt, 0);
         res = g_list_prepend(res, TO_SP(id));
     }
-    sem_post(STMT_SEM(fc, TAGUNL));
+    STMT_RELEASE(fc, TAGUNL);
     return res;
 }
 
@@ -303,18 +696,22 @@ void _sqlite_ins_stmt (FileCabinet *fc, File *f, file_id_t key)
     if (key)
     {
         stmt = STMT(fc, INSERT);
-        sem_wait(STMT_SEM(fc, INSERT));
+        STMT_ACQUIRE(fc, INSERT);
         sqlite3_reset(stmt);
         sqlite3_bind_int(stmt, 1, file_id(f));
         sqlite3_bind_int(stmt, 2, key);
         sql_step(stmt);
-        sem_post(STMT_SEM(fc, INSERT));
+        STMT_RELEASE(fc, INSERT);
     }
 }
 
 void file_cabinet_remove (FileCabinet *fc, file_id_t key, File *f)
 {
     _sqlite_rm_stmt(fc,f,key);
+    if (key)
+    {
+        _collision_remove(fc, key, f, file_name(f));
+    }
     /* NOTE: Although we always want to insert a file into fc->files on
      * insert, we never want to delete the file since it could remain in
      * any of the "drawers"
@@ -359,6 +756,10 @@ void file_cabinet_insert (FileCabinet *fc, file_id_t key, File *f)
         g_hash_table_insert(fc->files, TO_SP(file_id(f)), f);
     }
     _sqlite_ins_stmt(fc,f,key);
+    if (key)
+    {
+        _collision_add(fc, key, f, file_name(f));
+    }
 }
 
 void file_cabinet_insert_v (FileCabinet *fc, const tagdb_key_t key, File *f)
@@ -380,6 +781,52 @@ File *file_cabinet_lookup_file (FileCabinet *fc, tagdb_key_t key, const char *na
     return _find_file(fc, key, name);
 }
 
+GArray *file_cabinet_untagged_name_collisions (FileCabinet *fc, const char *name)
+{
+    GArray *res = g_array_sized_new(FALSE, FALSE, sizeof(file_id_t), 2);
+    sqlite3_stmt *stmt = STMT(fc, LOOKUT);
+    STMT_ACQUIRE(fc, LOOKUT);
+    sqlite3_reset(stmt);
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_TRANSIENT);
+    while (sql_next_row(stmt) == SQLITE_ROW)
+    {
+        STMT_ROW(fc, LOOKUT);
+        file_id_t id = sqlite3_column_int64(stmt, 0);
+        g_array_append_val(res, id);
+    }
+    STMT_RELEASE(fc, LOOKUT);
+
+    if (res->len < 2)
+    {
+        g_array_free(res, TRUE);
+        res = NULL;
+    }
+    return res;
+}
+
+void file_cabinet_print_stmt_profiles (FileCabinet *fc, GString *out)
+{
+    sql_stmt_profiles_print(out, "file_cabinet", stmt_names, fc->stmt_profiles, NUMBER_OF_STMTS);
+    sql_stmt_profiles_print(out, "file_cabinet", key_stmt_names, fc->key_stmt_profiles, CACHED_KEY_LENGTH + 1);
+}
+
+int file_cabinet_full_scans (FileCabinet *fc, GString *out)
+{
+    /* The statements for keys are otherwise only prepared once a key of
+     * their length is looked up */
+    for (int n = 1; n <= CACHED_KEY_LENGTH; n++)
+    {
+        sem_wait(&fc->key_stmt_semas[n]);
+        if (!fc->key_stmts[n])
+        {
+            fc->key_stmts[n] = _prepare_key_stmt(fc, n);
+        }
+        sem_post(&fc->key_stmt_semas[n]);
+    }
+    return sql_stmts_full_scans(out, "file_cabinet", stmt_names, fc->stmts, NUMBER_OF_STMTS)
+        + sql_stmts_full_scans(out, "file_cabinet", key_stmt_names, fc->key_stmts, CACHED_KEY_LENGTH + 1);
+}
+
 GList *file_cabinet_get_drawer_tags (FileCabinet *fc, file_id_t slot_id)
 {
     return _sqlite_tag_union_list_stmt(fc, slot_id);
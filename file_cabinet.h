@@ -31,6 +31,17 @@ void file_cabinet_delete_file(FileCabinet *fc, File *f);
 /* Returns the keyed file slot as a GList */
 GList *file_cabinet_get_drawer_l (FileCabinet *fc, file_id_t slot_id);
 GList *file_cabinet_get_drawer_tags (FileCabinet *fc, file_id_t slot_id);
+/* Returns the files with all of the tags in key, in the order of their
+ * IDs, or the untagged files if key is empty. The files are found with a
+ * single query, kept for each length of key up to a limit */
+GList *file_cabinet_get_files_with_tags (FileCabinet *fc, tagdb_key_t key);
+/* file_cabinet_get_files_with_tags for the files with IDs from from on,
+ * and no more than limit of them, or all of them if it's negative. Reads a
+ * part of a large listing at a time */
+GList *file_cabinet_get_files_with_tags_from (FileCabinet *fc, tagdb_key_t key, file_id_t from, int limit);
+/* Returns the files in the slot or in the slot of any of its subtags, at
+ * any depth, as found in the tag_closure table */
+GList *file_cabinet_get_subtree_files (FileCabinet *fc, file_id_t slot_id);
 /* Returns files without any tags */
 GList *file_cabinet_get_untagged_files (FileCabinet *fc);
 
@@ -43,4 +54,20 @@ gulong file_cabinet_size (FileCabinet *fc);
 
 File *file_cabinet_lookup_file (FileCabinet *fc, tagdb_key_t tag_id, const char *name);
 
+/* Returns the IDs of the files in the slot named name if there is more than
+ * one, or NULL if the name is unique or unused. Free with g_array_free */
+GArray *file_cabinet_name_collisions (FileCabinet *fc, file_id_t slot_id, const char *name);
+/* file_cabinet_name_collisions for the untagged files */
+GArray *file_cabinet_untagged_name_collisions (FileCabinet *fc, const char *name);
+
+/* Updates the cabinet for f having been renamed from old_name */
+void file_cabinet_rename_file (FileCabinet *fc, File *f, const char *old_name);
+
+/* Appends the execution statistics of the prepared statements to out */
+void file_cabinet_print_stmt_profiles (FileCabinet *fc, GString *out);
+/* Appends the full scans in the statements' query plans to out and returns
+ * how many there are. Prepares the statements for keys which haven't been
+ * used yet, so they're checked too */
+int file_cabinet_full_scans (FileCabinet *fc, GString *out);
+
 #endif /* FILE_CABINET_H */
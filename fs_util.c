@@ -1,5 +1,11 @@
-#include <fuse.h>
+/* For preadv and pwritev */
+#define _GNU_SOURCE
+#include "params.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include "file_log.h"
 #include "log.h"
 
@@ -8,18 +14,142 @@
 int file_info_read (struct fuse_file_info *f_info, char *buffer, size_t size, off_t offset)
 {
     /* This also works for the file search since we've opened the file */
-    log_fi(f_info);
-
     return pread(f_info->fh, buffer, size, offset);
 }
 
 int file_info_write (struct fuse_file_info *f_info, const char *buf, size_t size, off_t offset)
 {
-    log_fi(f_info);
-
     return pwrite(f_info->fh, buf, size, offset);
 }
 
+int file_info_readv (struct fuse_file_info *f_info, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    return preadv(f_info->fh, iov, iovcnt, offset);
+}
+
+int file_info_writev (struct fuse_file_info *f_info, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    return pwritev(f_info->fh, iov, iovcnt, offset);
+}
+
+int file_info_read_buf (struct fuse_file_info *f_info, struct fuse_bufvec **bufp, size_t size, off_t offset)
+{
+    struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec));
+    if (!bufv)
+    {
+        return -ENOMEM;
+    }
+    *bufv = FUSE_BUFVEC_INIT(size);
+    /* FUSE reads from the file itself, splicing it into the reply if it
+     * can. A short file makes a short read as with pread */
+    bufv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    bufv->buf[0].fd = f_info->fh;
+    bufv->buf[0].pos = offset;
+    *bufp = bufv;
+    return 0;
+}
+
+int file_info_write_buf (struct fuse_file_info *f_info, struct fuse_bufvec *buf, off_t offset)
+{
+    /* Memory buffers all go to the file in one call */
+    if (buf->idx == 0 && buf->off == 0 && buf->count <= IOV_MAX)
+    {
+        struct iovec iov[buf->count];
+        size_t i;
+        for (i = 0; i < buf->count && !(buf->buf[i].flags & FUSE_BUF_IS_FD); i++)
+        {
+            iov[i].iov_base = buf->buf[i].mem;
+            iov[i].iov_len = buf->buf[i].size;
+        }
+        if (i == buf->count)
+        {
+            int res = file_info_writev(f_info, iov, buf->count, offset);
+            return (res < 0) ? -errno : res;
+        }
+    }
+
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+    dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    dst.buf[0].fd = f_info->fh;
+    dst.buf[0].pos = offset;
+    return fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+}
+
+void bufvec_free (struct fuse_bufvec *buf)
+{
+    if (buf)
+    {
+        for (size_t i = 0; i < buf->count; i++)
+        {
+            if (!(buf->buf[i].flags & FUSE_BUF_IS_FD))
+            {
+                free(buf->buf[i].mem);
+            }
+        }
+        free(buf);
+    }
+}
+
+int read_buf_with_read (struct fuse_operations *ops, const char *path,
+        struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *f_info)
+{
+    if (!ops->read)
+    {
+        return -ENOSYS;
+    }
+
+    struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec));
+    char *mem = malloc(size);
+    if (!bufv || !mem)
+    {
+        free(bufv);
+        free(mem);
+        return -ENOMEM;
+    }
+
+    int res = ops->read(path, mem, size, offset, f_info);
+    if (res < 0)
+    {
+        free(bufv);
+        free(mem);
+        return res;
+    }
+    *bufv = FUSE_BUFVEC_INIT(res);
+    bufv->buf[0].mem = mem;
+    *bufp = bufv;
+    return 0;
+}
+
+int write_buf_with_write (struct fuse_operations *ops, const char *path,
+        struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *f_info)
+{
+    if (!ops->write)
+    {
+        return -ENOSYS;
+    }
+
+    size_t size = fuse_buf_size(buf);
+    /* Memory which comes in a single buffer can be passed straight on */
+    if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD))
+    {
+        return ops->write(path, buf->buf[0].mem, size, offset, f_info);
+    }
+
+    struct fuse_bufvec tmp = FUSE_BUFVEC_INIT(size);
+    tmp.buf[0].mem = malloc(size);
+    if (!tmp.buf[0].mem)
+    {
+        return -ENOMEM;
+    }
+    int res = fuse_buf_copy(&tmp, buf, 0);
+    if (res > 0)
+    {
+        res = ops->write(path, tmp.buf[0].mem, res, offset, f_info);
+    }
+    free(tmp.buf[0].mem);
+    return res;
+}
+
 int file_info_fsync (struct fuse_file_info *f_info, int datasync)
 {
     int retstat = 0;
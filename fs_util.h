@@ -1,7 +1,26 @@
 #ifndef FS_UTIL_H
 #define FS_UTIL_H
+#include <sys/uio.h>
 int file_info_read (struct fuse_file_info *f_info, char *buffer, size_t size, off_t offset);
 int file_info_write (struct fuse_file_info *f_info, const char *buf, size_t size, off_t offset);
+/* Scatter and gather forms of read and write, for callers which have the
+ * data in more than one buffer */
+int file_info_readv (struct fuse_file_info *f_info, const struct iovec *iov, int iovcnt, off_t offset);
+int file_info_writev (struct fuse_file_info *f_info, const struct iovec *iov, int iovcnt, off_t offset);
+/* Reads and writes which hand FUSE the file descriptor rather than copying
+ * through a buffer, so that it can splice the data between the file and
+ * the device. The bufvec from file_info_read_buf is freed by FUSE.
+ * file_info_write_buf returns the number of bytes written */
+int file_info_read_buf (struct fuse_file_info *f_info, struct fuse_bufvec **bufp, size_t size, off_t offset);
+int file_info_write_buf (struct fuse_file_info *f_info, struct fuse_bufvec *buf, off_t offset);
+/* Frees a bufvec and any memory buffers in it as FUSE does */
+void bufvec_free (struct fuse_bufvec *buf);
+/* read_buf and write_buf in terms of the read and write of ops, for
+ * operations which don't have their own */
+int read_buf_with_read (struct fuse_operations *ops, const char *path,
+        struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *f_info);
+int write_buf_with_write (struct fuse_operations *ops, const char *path,
+        struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *f_info);
 int file_info_truncate (struct fuse_file_info *f_info, off_t size);
 int file_info_fsync (struct fuse_file_info *f_info, int datasync);
 #endif
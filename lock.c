@@ -1,49 +1,143 @@
+/* needed for syscall(2) */
+#define _GNU_SOURCE
 #include <time.h>
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "log.h"
 #include "lock.h"
 
-int lock_acquire (lock_t* l, int timeout)
+/* Number of times to retry an acquire before sleeping on the futex */
+#define LOCK_SPIN_COUNT 100
+
+#ifdef TAGFS_LOCK_DEBUG
+#define lock_debug(...) debug(__VA_ARGS__)
+#define lock_warn(...) warn(__VA_ARGS__)
+#else
+#define lock_debug(...)
+#define lock_warn(...)
+#endif
+
+static int _cmpxchg (int *p, int expected, int desired)
+{
+    __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    return expected;
+}
+
+static int _futex_wait (int *p, int val, const struct timespec *rel)
+{
+    return syscall(SYS_futex, p, FUTEX_WAIT_PRIVATE, val, rel, NULL, 0);
+}
+
+static int _futex_wake (int *p, int n)
+{
+    return syscall(SYS_futex, p, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+static void _timespec_sub (struct timespec *res, const struct timespec *a, const struct timespec *b)
+{
+    res->tv_sec = a->tv_sec - b->tv_sec;
+    res->tv_nsec = a->tv_nsec - b->tv_nsec;
+    if (res->tv_nsec < 0)
+    {
+        res->tv_sec--;
+        res->tv_nsec += 1000000000L;
+    }
+}
+
+void lock_init (lock_t *l)
+{
+    l->state = 0;
+}
+
+void lock_destroy (lock_t *l)
+{
+#ifdef TAGFS_LOCK_DEBUG
+    if (l->state == 2)
+    {
+        warn("lock_destroy: destroying lock %p with waiters", l);
+    }
+#endif
+}
+
+static int lock_acquire_slow (lock_t *l, int timeout, int c)
 {
-    int status = 0;
-    debug("lock_acquire:attempting lock on %p", l);
-    struct timespec ts;
-    ts.tv_sec = timeout;
-    if (clock_gettime(CLOCK_REALTIME, &ts) == -1)
+    struct timespec deadline;
+    struct timespec now;
+    struct timespec rel;
+
+    for (int i = 0; i < LOCK_SPIN_COUNT; i++)
+    {
+        if (c == 0 && (c = _cmpxchg(&l->state, 0, 1)) == 0)
+        {
+            return 0;
+        }
+#if defined(__i386__) || defined(__x86_64__)
+        __builtin_ia32_pause();
+#endif
+        c = __atomic_load_n(&l->state, __ATOMIC_RELAXED);
+    }
+
+    if (clock_gettime(CLOCK_MONOTONIC, &deadline) == -1)
     {
         char buf[64];
         strerror_r(errno, buf, 64);
         error("lock_acquire:clock_gettime: %s", buf);
         return -1;
     }
+    deadline.tv_sec += timeout;
+
+    /* Mark the lock as contended before sleeping so that the holder knows
+     * to wake us on release */
+    if (c != 2)
+    {
+        c = __atomic_exchange_n(&l->state, 2, __ATOMIC_ACQUIRE);
+    }
 
-    while ((status = sem_timedwait(l, &ts)) == -1 && errno == EINTR)
-        continue;
-    if (status == -1)
+    while (c != 0)
     {
-        if (errno == ETIMEDOUT)
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        _timespec_sub(&rel, &deadline, &now);
+        if (rel.tv_sec < 0)
         {
-            warn("lock_acquire:timed out on %p", l);
-            errno = ETIMEDOUT; // ensuring that the errno is set appropriately
+            lock_warn("lock_acquire:timed out on %p", l);
+            errno = ETIMEDOUT;
             return -1;
         }
-        else if (errno == EINVAL)
+        if (_futex_wait(&l->state, 2, &rel) == -1 &&
+                errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT)
         {
-            error("lock_acquire: Invalid lock or time specification");
-            errno = EINVAL; // ensuring that the errno is set appropriately
+            error("lock_acquire: futex wait failed on %p (%d)", l, errno);
             return -1;
         }
+        c = __atomic_exchange_n(&l->state, 2, __ATOMIC_ACQUIRE);
     }
     return 0;
 }
 
-int lock_release (lock_t* l)
+int lock_acquire (lock_t* l, int timeout)
 {
-    debug("lock_release:releasing lock on %p", l);
-    int val = -1;
-    sem_getvalue(l, &val);
-    assert(val == 0);
-    return sem_post(l);
+    lock_debug("lock_acquire:attempting lock on %p", l);
+    int c = _cmpxchg(&l->state, 0, 1);
+    if (c == 0)
+    {
+        return 0;
+    }
+    return lock_acquire_slow(l, timeout, c);
 }
 
+int lock_release (lock_t* l)
+{
+    lock_debug("lock_release:releasing lock on %p", l);
+#ifdef TAGFS_LOCK_DEBUG
+    assert(__atomic_load_n(&l->state, __ATOMIC_RELAXED) != 0);
+#endif
+    if (__atomic_fetch_sub(&l->state, 1, __ATOMIC_RELEASE) != 1)
+    {
+        __atomic_store_n(&l->state, 0, __ATOMIC_RELEASE);
+        _futex_wake(&l->state, 1);
+    }
+    return 0;
+}
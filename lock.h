@@ -1,11 +1,29 @@
 #ifndef LOCK_H
 #define LOCK_H
 #include <errno.h>
-#include <semaphore.h>
-typedef sem_t lock_t;
-/* Acquires the lock with a time-limit */
+
+/* A futex-based mutex.
+ *
+ * state is 0 when unlocked, 1 when locked and 2 when locked with
+ * (possible) waiters. Acquiring and releasing an uncontended lock is a
+ * single atomic instruction with no system calls. A contended acquire
+ * spins briefly before parking on the futex.
+ *
+ * Unlike a pthread mutex, a lock may be released by a thread other than
+ * the one that acquired it and may be destroyed while held.
+ */
+typedef struct
+{
+    int state;
+} lock_t;
+
+#define LOCK_INITIALIZER {0}
+
+void lock_init(lock_t*);
+void lock_destroy(lock_t*);
+/* Acquires the lock with a time-limit in seconds. Returns -1 and sets errno
+ * to ETIMEDOUT if the lock couldn't be acquired in that time */
 int lock_acquire(lock_t*, int timeout);
 int lock_release(lock_t*);
 #define lock_timed_out(__status) ((__status) == -1 && (errno == ETIMEDOUT))
 #endif /* LOCK_H */
-
@@ -10,21 +10,118 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
-#include <sys/file.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "log.h"
 
-#define SHOULD_LOG(_ll) (logging_on && _ll >= g_log_filtering_level)
+/* Messages are formatted by the calling thread into a ring buffer owned by
+ * that thread and written to the log file by a background drain thread. Each
+ * ring has exactly one producer (its thread) and one consumer (the drain
+ * thread), so neither side takes a lock.
+ */
+
+/* Bytes per thread ring. Must be a power of two */
+#define LOG_RING_SIZE (1 << 16)
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+/* Longest single message. Longer messages are truncated */
+#define LOG_LINE_MAX 2048
+/* How long the drain thread sleeps when there's nothing to write */
+#define LOG_DRAIN_INTERVAL_NS 50000000L
+
+#define SHOULD_LOG(_ll) (g_logging_on && _ll >= g_log_filtering_level)
+
+typedef struct log_ring
+{
+    char data[LOG_RING_SIZE];
+    /* Bytes published by the producer. Only the owning thread writes it */
+    size_t head;
+    /* Bytes written out. Only the drain thread writes it */
+    size_t tail;
+    /* Bytes written past head, but held back by lock_log */
+    size_t pending;
+    /* The head as of the drain in progress. Private to the drain thread */
+    size_t drain_head;
+    /* Whether a thread owns the ring. When its thread exits, a ring is
+     * handed to the next thread to log, along with anything not yet
+     * written out */
+    int in_use;
+    struct log_ring *next;
+} log_ring;
 
 static FILE *log_file = NULL;
-static int logging_on = FALSE;
+int g_logging_on = FALSE;
 int g_log_filtering_level = 0;
 
+/* All of the rings, pushed on the front as threads first log. They're
+ * never freed, since a thread may be writing to its ring at any time, but
+ * a thread's ring is handed on once it exits, so there are only as many as
+ * there have been threads logging at once */
+static log_ring *rings = NULL;
+static __thread log_ring *thread_ring = NULL;
+static __thread int thread_batch_depth = 0;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_t drain_thread;
+static int drain_running = FALSE;
+static int drain_stop = FALSE;
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+
 /* Space is left over for additional names to be added at
  * run-time by users. This hasn't been implemented
  */
 const char _level_names[10][10] = {"DEBUG", "INFO", "WARN", "ERROR"};
 
+static void *_drain_main (void *data);
+static void _start_drain (void);
+static void _stop_drain (void);
+static void _ring_publish (log_ring *r);
+
+/* fuse_main forks to daemonize and only the forking thread survives in the
+ * child, so the drain thread is started again there. The mutex is held over
+ * the fork so that the child doesn't get a copy locked by the old drain
+ * thread, and the condition is made anew since the child's copy may still
+ * count the old drain thread as a waiter. */
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+static void _atfork_prepare (void)
+{
+    pthread_mutex_lock(&drain_mutex);
+}
+
+static void _atfork_parent (void)
+{
+    pthread_mutex_unlock(&drain_mutex);
+}
+
+static void _atfork_child (void)
+{
+    pthread_mutex_unlock(&drain_mutex);
+    pthread_cond_init(&drain_cond, NULL);
+    /* The other threads' rings have no owners any more */
+    for (log_ring *r = rings; r; r = r->next)
+    {
+        if (r != thread_ring)
+        {
+            r->pending = 0;
+            r->in_use = FALSE;
+        }
+    }
+    if (drain_running)
+    {
+        drain_running = FALSE;
+        _start_drain();
+    }
+}
+
+static void _register_atfork (void)
+{
+    pthread_atfork(_atfork_prepare, _atfork_parent, _atfork_child);
+}
+
 void log_open(const char *name, int log_filter)
 {
     log_open0(fopen(name, "w"), log_filter);
@@ -37,9 +134,12 @@ void log_open0(FILE *f, int log_filter)
         perror("logfile");
         exit(EXIT_FAILURE);
     }
+    pthread_once(&atfork_once, _register_atfork);
+    /* Re-opening writes out anything for the old file, but leaves it open */
+    _stop_drain();
     log_file = f;
-    setvbuf(log_file, NULL, _IOLBF, 0); // set to line buffering
-    logging_on = 1;
+    _start_drain();
+    g_logging_on = 1;
     g_log_filtering_level = log_filter;
     log_msg("============LOG_START===========\n");
 }
@@ -47,13 +147,213 @@ void log_open0(FILE *f, int log_filter)
 void log_close()
 {
     log_msg("=============LOG_END============\n");
-    if (logging_on)
+    _stop_drain();
+    if (g_logging_on)
     {
         fclose(log_file);
     }
-    logging_on = 0;
+    g_logging_on = 0;
+    /* The rings are left alone, since other threads may still be writing
+     * to them. They're reused by the next log_open */
+}
+
+/* Hands the exiting thread's ring back */
+static void _release_ring (void *data)
+{
+    log_ring *r = data;
+    _ring_publish(r);
+    __atomic_store_n(&r->in_use, FALSE, __ATOMIC_RELEASE);
+    thread_ring = NULL;
+}
+
+static void _make_ring_key (void)
+{
+    pthread_key_create(&ring_key, _release_ring);
+}
+
+static log_ring *_get_thread_ring (void)
+{
+    if (!thread_ring)
+    {
+        log_ring *r;
+        pthread_once(&ring_key_once, _make_ring_key);
+        for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+        {
+            int expected = FALSE;
+            if (__atomic_compare_exchange_n(&r->in_use, &expected, TRUE, 0,
+                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+
+        if (!r)
+        {
+            r = g_malloc0(sizeof(log_ring));
+            r->in_use = TRUE;
+            r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+            while (!__atomic_compare_exchange_n(&rings, &r->next, r, 0,
+                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                continue;
+        }
+        thread_ring = r;
+        pthread_setspecific(ring_key, r);
+    }
+    return thread_ring;
 }
 
+guint log_ring_count (void)
+{
+    guint n = 0;
+    for (log_ring *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+    {
+        n++;
+    }
+    return n;
+}
+
+static void _ring_publish (log_ring *r)
+{
+    __atomic_store_n(&r->head, r->head + r->pending, __ATOMIC_RELEASE);
+    r->pending = 0;
+}
+
+static void _ring_write (log_ring *r, const char *s, size_t len)
+{
+    if (len > LOG_RING_SIZE)
+    {
+        len = LOG_RING_SIZE;
+    }
+
+    size_t head = r->head + r->pending;
+    while (head + len - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > LOG_RING_SIZE)
+    {
+        if (!drain_running)
+        {
+            return;
+        }
+        /* A held back batch that fills the ring has to go out early */
+        if (r->pending)
+        {
+            _ring_publish(r);
+        }
+        pthread_cond_signal(&drain_cond);
+        sched_yield();
+    }
+
+    size_t start = head & LOG_RING_MASK;
+    size_t first = MIN(len, LOG_RING_SIZE - start);
+    memcpy(r->data + start, s, first);
+    memcpy(r->data, s + first, len - first);
+    r->pending += len;
+
+    if (!thread_batch_depth)
+    {
+        _ring_publish(r);
+    }
+
+    if (r->head - r->tail > LOG_RING_SIZE / 2)
+    {
+        pthread_cond_signal(&drain_cond);
+    }
+}
+
+/* Writes out everything published so far. Only called by the drain thread,
+ * or once the drain thread has stopped */
+static size_t _drain_all (void)
+{
+    size_t total = 0;
+    log_ring *first = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    for (log_ring *r = first; r != NULL; r = r->next)
+    {
+        size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        size_t n = head - r->tail;
+        r->drain_head = head;
+        if (n)
+        {
+            size_t start = r->tail & LOG_RING_MASK;
+            size_t first_part = MIN(n, LOG_RING_SIZE - start);
+            fwrite(r->data + start, 1, first_part, log_file);
+            fwrite(r->data, 1, n - first_part, log_file);
+            total += n;
+        }
+    }
+
+    if (total)
+    {
+        fflush(log_file);
+        /* The tails are only moved after the flush so that log_flush doesn't
+         * return before the data is in the file */
+        for (log_ring *r = first; r != NULL; r = r->next)
+        {
+            __atomic_store_n(&r->tail, r->drain_head, __ATOMIC_RELEASE);
+        }
+    }
+    return total;
+}
+
+static void *_drain_main (void *data)
+{
+    while (!__atomic_load_n(&drain_stop, __ATOMIC_ACQUIRE))
+    {
+        if (!_drain_all())
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += LOG_DRAIN_INTERVAL_NS;
+            if (ts.tv_nsec >= 1000000000L)
+            {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_mutex_lock(&drain_mutex);
+            pthread_cond_timedwait(&drain_cond, &drain_mutex, &ts);
+            pthread_mutex_unlock(&drain_mutex);
+        }
+    }
+    _drain_all();
+    return NULL;
+}
+
+static void _start_drain (void)
+{
+    drain_stop = FALSE;
+    if (pthread_create(&drain_thread, NULL, _drain_main, NULL) != 0)
+    {
+        perror("log drain thread");
+        exit(EXIT_FAILURE);
+    }
+    drain_running = TRUE;
+}
+
+static void _stop_drain (void)
+{
+    if (drain_running)
+    {
+        __atomic_store_n(&drain_stop, TRUE, __ATOMIC_RELEASE);
+        pthread_cond_signal(&drain_cond);
+        pthread_join(drain_thread, NULL);
+        drain_running = FALSE;
+    }
+}
+
+void log_flush (void)
+{
+    if (!drain_running)
+    {
+        return;
+    }
+
+    for (log_ring *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next)
+    {
+        size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        while (drain_running && __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) < head)
+        {
+            pthread_cond_signal(&drain_cond);
+            sched_yield();
+        }
+    }
+}
 
 void log_msg0 (int log_level, const char *format, ...)
 {
@@ -62,16 +362,23 @@ void log_msg0 (int log_level, const char *format, ...)
     va_list ap;
     va_start(ap, format);
     vlog_msg0(log_level, format, ap);
+    va_end(ap);
 }
 
 void vlog_msg0 (int log_level, const char *format, va_list ap)
 {
     /* this is the only method that does any real
-     * writing to the log file
+     * writing to the log
      */
     if (!SHOULD_LOG(log_level))
         return;
-    vfprintf(log_file, format, ap);
+    char line[LOG_LINE_MAX];
+    int n = vsnprintf(line, LOG_LINE_MAX, format, ap);
+    if (n < 0)
+        return;
+    if (n >= LOG_LINE_MAX)
+        n = LOG_LINE_MAX - 1;
+    _ring_write(_get_thread_ring(), line, n);
 }
 
 void log_msg1 (int log_level, const char *file, int line_number, const char *format, ...)
@@ -82,34 +389,38 @@ void log_msg1 (int log_level, const char *file, int line_number, const char *for
      */
     if (!SHOULD_LOG(log_level))
         return;
+    char line[LOG_LINE_MAX];
+    int n = snprintf(line, LOG_LINE_MAX, "%s:%s:%d:", _level_names[log_level], file, line_number);
+    if (n < 0 || n >= LOG_LINE_MAX - 1)
+        return;
     va_list ap;
     va_start(ap, format);
-    lock_log();
-    log_msg0(log_level, "%s:%s:%d:", _level_names[log_level], file, line_number);
-    vlog_msg0(log_level, format, ap);
-    log_msg0(log_level, "\n");
-    unlock_log();
-#endif
-}
-
-void _lock_log (int operation)
-{
-    if (logging_on)
+    int m = vsnprintf(line + n, LOG_LINE_MAX - n - 1, format, ap);
+    va_end(ap);
+    if (m < 0)
+        return;
+    n = MIN(n + m, LOG_LINE_MAX - 2);
+    line[n++] = '\n';
+    _ring_write(_get_thread_ring(), line, n);
+    if (log_level >= ERROR)
     {
-        int fd = fileno(log_file);
-        if (fd > 0)
-            flock(fd, operation);
+        /* Errors are likely to precede a crash */
+        log_flush();
     }
+#endif
 }
 
 void lock_log ()
 {
-    _lock_log(LOCK_EX);
+    thread_batch_depth++;
 }
 
 void unlock_log ()
 {
-    _lock_log(LOCK_UN);
+    if (thread_batch_depth > 0 && --thread_batch_depth == 0 && thread_ring)
+    {
+        _ring_publish(thread_ring);
+    }
 }
 
 int log_error (const char *str)
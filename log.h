@@ -18,6 +18,19 @@ typedef enum {
     LOG_MAX
 } log_level_t;
 
+/* Messages below this level are removed at compile time, arguments and all.
+ * Uses the numeric values of log_level_t since the preprocessor can't see the
+ * enum: 0 = DEBUG, 1 = INFO, 2 = WARN, 3 = ERROR
+ */
+#ifndef TAGFS_MIN_LOG_LEVEL
+#define TAGFS_MIN_LOG_LEVEL 0
+#endif
+
+/* TRUE if a message at the given level would be written. Checked before the
+ * arguments to a log call are evaluated
+ */
+#define log_enabled(LEVEL) (g_logging_on && (LEVEL) >= g_log_filtering_level)
+
 /* Used to log at the current level (always shows up)
  * should be used sparingly. debug,info,warn, or error
  * should be prefered
@@ -31,17 +44,49 @@ typedef enum {
 #ifdef NO_LOGGING
 #define delio(LEVEL,...)
 #else
-#define delio(LEVEL,...) log_msg1((LEVEL), __FILE__, __LINE__, __VA_ARGS__)
+#define delio(LEVEL,...) \
+    do { \
+        if (log_enabled(LEVEL)) \
+            log_msg1((LEVEL), __FILE__, __LINE__, __VA_ARGS__); \
+    } while (0)
 #endif
 
+/* A log call compiled out. The arguments are still checked, and count as
+ * used, but the call is dropped */
+#define log_discarded(LEVEL,...) \
+    do { \
+        if (0) \
+            log_msg1((LEVEL), __FILE__, __LINE__, __VA_ARGS__); \
+    } while (0)
+
+#if TAGFS_MIN_LOG_LEVEL > 0
+#define debug(...) log_discarded(DEBUG, __VA_ARGS__)
+#else
 #define debug(...) delio(DEBUG, __VA_ARGS__)
+#endif
+
+#if TAGFS_MIN_LOG_LEVEL > 1
+#define info(...) log_discarded(INFO, __VA_ARGS__)
+#else
 #define info(...) delio(INFO, __VA_ARGS__)
+#endif
+
+#if TAGFS_MIN_LOG_LEVEL > 2
+#define warn(...) log_discarded(WARN, __VA_ARGS__)
+#else
 #define warn(...) delio(WARN, __VA_ARGS__)
+#endif
+
 #define error(...) delio(ERROR, __VA_ARGS__)
 
 void log_open(const char *name, int log_filter);
 void log_open0(FILE *f, int log_filter);
 void log_close();
+/* Blocks until everything logged so far has been written to the log file */
+void log_flush (void);
+/* The number of per-thread rings. Rings are reused once their threads
+ * exit, so this is the most threads which have logged at once */
+guint log_ring_count (void);
 void log_hash (GHashTable *hsh);
 
 void log_msg0(int level, const char *format, ...);
@@ -50,11 +95,14 @@ void log_msg1 (int log_level, const char *file, int line_number, const char *for
 int log_error (const char *str);
 void log_hash (GHashTable *hsh);
 void log_list (GList *l);
+/* Messages logged by this thread between lock_log and unlock_log are written
+ * out together */
 void lock_log (void);
 void unlock_log (void);
 void set_log_filter (int filter_level);
 const char *log_level_name(int i);
 
-int g_log_filtering_level;
+extern int g_log_filtering_level;
+extern int g_logging_on;
 
 #endif /* _LOG_H_ */
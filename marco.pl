@@ -45,6 +45,8 @@ my %oper_headers =
     , open => "int %s_open (const char *%s, struct fuse_file_info *%s)"
     , read => "int %s_read (const char *%s, __DNP__ char *%s, size_t %s, off_t %s, struct fuse_file_info *%s)"
     , write => "int %s_write (const char *%s, __DNP__ const char *%s, size_t %s, off_t %s, struct fuse_file_info *%s)"
+    , read_buf => "int %s_read_buf (const char *%s, struct fuse_bufvec **%s, size_t %s, off_t %s, struct fuse_file_info *%s)"
+    , write_buf => "int %s_write_buf (const char *%s, struct fuse_bufvec *%s, off_t %s, struct fuse_file_info *%s)"
     , statfs => "int %s_statfs (const char *%s, struct statvfs *%s)"
     , flush => "int %s_flush (const char *%s, struct fuse_file_info *%s)"
     , release => "int %s_release (const char *%s, struct fuse_file_info *%s)"
@@ -57,6 +59,7 @@ my %oper_headers =
     , readdir => "int %s_readdir (const char *%s, void *%s, fuse_fill_dir_t %s, off_t %s, struct fuse_file_info *%s)"
     , releasedir => "int %s_releasedir (const char *%s, struct fuse_file_info *%s)"
     , fsyncdir => "int %s_fsyncdir (const char *%s, int %s, struct fuse_file_info *%s)"
+    , init => " void *%s_init (struct fuse_conn_info *%s)"
     , destroy => " void %s_destroy (void *%s)"
     , access => "int %s_access (const char *%s, int %s)"
     , create => "int %s_create (const char *%s, mode_t %s, struct fuse_file_info *%s)"
@@ -148,19 +151,66 @@ sub make_tagfs_op
     my $arg_str0 = join(" ", @arg_list);
     my $arg_str1 = join(", ", @arg_list);
     my $path_name = $arg_list[0];
+    # The buffer-based reads and writes are counted and traced as the plain
+    # ones, which are what FUSE calls when they're missing
+    my %stats_ops = (read_buf => "read", write_buf => "write");
+    my $stats_name = "OP_" . uc($stats_ops{$op_name} || $op_name);
+    # Arguments recorded in the operation trace as path2, size and offset,
+    # or an expression for them
+    my %trace_arg_indices = (
+        read => [undef, 2, 3],
+        write => [undef, 2, 3],
+        read_buf => [undef, 2, 3],
+        write_buf => [undef, "fuse_buf_size(a1)", 2],
+        rename => [1, undef, undef],
+        link => [1, undef, undef],
+        symlink => [1, undef, undef],
+        mknod => [undef, 1, undef],
+        mkdir => [undef, 1, undef],
+        chmod => [undef, 1, undef],
+        create => [undef, 1, undef],
+        truncate => [undef, undef, 1],
+        ftruncate => [undef, undef, 1],
+        readdir => [undef, undef, 3],
+    );
+    my @trace_defaults = ("NULL", "0", "0");
+    my @trace_args = map {
+        my $i = $trace_arg_indices{$op_name} ? $trace_arg_indices{$op_name}->[$_] : undef;
+        !defined($i) ? $trace_defaults[$_] : ($i =~ /^\d+$/) ? $arg_list[$i] : $i;
+    } (0 .. 2);
+    my $trace_arg_str = join(", ", @trace_args);
+    # What to do when the sub-file system doesn't have the operation
+    my %fallbacks = (
+        read_buf => "read_buf_with_read(ops, $arg_str1)",
+        write_buf => "write_buf_with_write(ops, $arg_str1)",
+    );
+    my $fallback = $fallbacks{$op_name} || "-ENOSYS";
 <<HERE;
 %(op $op_name $arg_str0)
 {
     %(log)
+    int res;
+    guint64 start = monotonic_time_ns();
     struct fuse_operations *ops = subfs_get_opstruct($path_name);
-    if (ops)
+    if (ops && ops->$op_name)
     {
-        return ops->$op_name($arg_str1);
+        res = ops->$op_name($arg_str1);
+    }
+    else if (ops)
+    {
+        res = $fallback;
     }
     else
     {
-        return -1;
+        res = -1;
+    }
+    guint64 elapsed = monotonic_time_ns() - start;
+    op_stats_record($stats_name, elapsed, res);
+    if (op_trace_recording)
+    {
+        op_trace_record($stats_name, $path_name, $trace_arg_str, start, elapsed, res);
     }
+    return res;
 }
 HERE
 }
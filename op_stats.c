@@ -0,0 +1,237 @@
+#include <pthread.h>
+#include <string.h>
+#include "op_stats.h"
+
+const char *op_stats_names[OP_COUNT] = {
+    "getattr",
+    "readlink",
+    "getdir",
+    "mknod",
+    "mkdir",
+    "unlink",
+    "rmdir",
+    "symlink",
+    "rename",
+    "link",
+    "chmod",
+    "chown",
+    "truncate",
+    "utime",
+    "open",
+    "read",
+    "write",
+    "statfs",
+    "flush",
+    "release",
+    "fsync",
+    "setxattr",
+    "getxattr",
+    "listxattr",
+    "removexattr",
+    "opendir",
+    "readdir",
+    "releasedir",
+    "fsyncdir",
+    "destroy",
+    "access",
+    "create",
+    "ftruncate",
+    "fgetattr",
+    "lock",
+    "utimens"
+};
+
+int op_stats_op_from_name (const char *name)
+{
+    for (int i = 0; i < OP_COUNT; i++)
+    {
+        if (g_strcmp0(op_stats_names[i], name) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* One thread's counters. Only the owning thread writes to them. When the
+ * thread exits, the counters are kept (so nothing recorded is lost) and
+ * handed to the next new thread */
+typedef struct op_stats_counters
+{
+    op_stats_summary ops[OP_COUNT];
+    int in_use;
+    struct op_stats_counters *next;
+} op_stats_counters;
+
+static op_stats_counters *all_counters = NULL;
+static __thread op_stats_counters *thread_counters = NULL;
+static pthread_key_t counters_key;
+static pthread_once_t counters_key_once = PTHREAD_ONCE_INIT;
+
+static void _release_counters (void *c)
+{
+    __atomic_store_n(&((op_stats_counters*) c)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void _make_counters_key (void)
+{
+    pthread_key_create(&counters_key, _release_counters);
+}
+
+static op_stats_counters *_claim_counters (void)
+{
+    op_stats_counters *c;
+    pthread_once(&counters_key_once, _make_counters_key);
+
+    for (c = __atomic_load_n(&all_counters, __ATOMIC_ACQUIRE); c; c = c->next)
+    {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&c->in_use, &expected, 1, 0,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    if (!c)
+    {
+        c = g_malloc0(sizeof(op_stats_counters));
+        c->in_use = 1;
+        c->next = __atomic_load_n(&all_counters, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&all_counters, &c->next, c, 0,
+                    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    pthread_setspecific(counters_key, c);
+    return c;
+}
+
+int op_stats_bucket (guint64 ns)
+{
+    if (ns < OP_STATS_SUB_BUCKETS)
+    {
+        return ns;
+    }
+
+    int e = 63 - __builtin_clzll(ns);
+    if (e >= OP_STATS_MAX_EXPONENT)
+    {
+        return OP_STATS_BUCKETS - 1;
+    }
+    int sub = (ns >> (e - OP_STATS_SUB_BUCKET_BITS)) & (OP_STATS_SUB_BUCKETS - 1);
+    return (e - OP_STATS_SUB_BUCKET_BITS + 1) * OP_STATS_SUB_BUCKETS + sub;
+}
+
+guint64 op_stats_bucket_lower_bound (int bucket)
+{
+    if (bucket < OP_STATS_SUB_BUCKETS)
+    {
+        return bucket;
+    }
+
+    int e = bucket / OP_STATS_SUB_BUCKETS - 1 + OP_STATS_SUB_BUCKET_BITS;
+    int sub = bucket % OP_STATS_SUB_BUCKETS;
+    return (guint64) (OP_STATS_SUB_BUCKETS + sub) << (e - OP_STATS_SUB_BUCKET_BITS);
+}
+
+/* The counters are read by other threads while we write them. Each has a
+ * single writer, so a relaxed load and store is enough to keep readers from
+ * seeing torn values */
+#define bump(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+void op_stats_record (op_stats_op op, guint64 elapsed_ns, int result)
+{
+    if (!thread_counters)
+    {
+        thread_counters = _claim_counters();
+    }
+
+    op_stats_summary *s = &thread_counters->ops[op];
+    bump(s->calls, 1);
+    if (result < 0)
+    {
+        bump(s->errors, 1);
+    }
+    bump(s->total_ns, elapsed_ns);
+    if (elapsed_ns > s->max_ns)
+    {
+        __atomic_store_n(&s->max_ns, elapsed_ns, __ATOMIC_RELAXED);
+    }
+    bump(s->histogram[op_stats_bucket(elapsed_ns)], 1);
+}
+
+#define load(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+void op_stats_collect (op_stats_op op, op_stats_summary *summary)
+{
+    memset(summary, 0, sizeof(op_stats_summary));
+    for (op_stats_counters *c = __atomic_load_n(&all_counters, __ATOMIC_ACQUIRE);
+            c; c = c->next)
+    {
+        op_stats_summary *s = &c->ops[op];
+        summary->calls += load(s->calls);
+        summary->errors += load(s->errors);
+        summary->total_ns += load(s->total_ns);
+        summary->max_ns = MAX(summary->max_ns, load(s->max_ns));
+        for (int i = 0; i < OP_STATS_BUCKETS; i++)
+        {
+            summary->histogram[i] += load(s->histogram[i]);
+        }
+    }
+}
+
+guint64 op_stats_percentile (op_stats_summary *summary, double p)
+{
+    guint64 count = 0;
+    for (int i = 0; i < OP_STATS_BUCKETS; i++)
+    {
+        count += summary->histogram[i];
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    /* rank of the call we're after, counting from 1 */
+    guint64 rank = (guint64) (p * count + 0.5);
+    rank = CLAMP(rank, 1, count);
+
+    guint64 seen = 0;
+    for (int i = 0; i < OP_STATS_BUCKETS; i++)
+    {
+        seen += summary->histogram[i];
+        if (seen >= rank)
+        {
+            if (i == OP_STATS_BUCKETS - 1)
+            {
+                return summary->max_ns;
+            }
+            return MIN(op_stats_bucket_lower_bound(i + 1) - 1, summary->max_ns);
+        }
+    }
+    return summary->max_ns;
+}
+
+void op_stats_print (GString *out)
+{
+    op_stats_summary s;
+    g_string_append_printf(out, "%-12s %10s %8s %10s %10s %10s %10s %10s\n",
+            "op", "calls", "errors", "mean_ns", "p50_ns", "p90_ns", "p99_ns", "max_ns");
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        op_stats_collect(op, &s);
+        if (s.calls == 0)
+        {
+            continue;
+        }
+        g_string_append_printf(out,
+                "%-12s %10" G_GUINT64_FORMAT " %8" G_GUINT64_FORMAT
+                " %10" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT
+                " %10" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT
+                " %10" G_GUINT64_FORMAT "\n",
+                op_stats_names[op], s.calls, s.errors, s.total_ns / s.calls,
+                op_stats_percentile(&s, 0.5),
+                op_stats_percentile(&s, 0.9),
+                op_stats_percentile(&s, 0.99),
+                s.max_ns);
+    }
+}
@@ -0,0 +1,103 @@
+#ifndef OP_STATS_H
+#define OP_STATS_H
+#include <glib.h>
+
+/* Per-operation call counts, error counts and latency histograms for the
+ * FUSE operations.
+ *
+ * Each thread records into its own counters, so recording is a handful of
+ * non-atomic increments with no shared cache lines. Readers sum over all of
+ * the threads' counters, so a snapshot may be slightly behind but never
+ * blocks the threads recording.
+ *
+ * Latencies go into log-linear buckets: each power of two is split into
+ * OP_STATS_SUB_BUCKETS linear sub-buckets, which bounds the relative error
+ * of a reported percentile to 1/OP_STATS_SUB_BUCKETS.
+ */
+
+/* The operation names in the same order as oper_headers in marco.pl, which
+ * generates references to these as OP_<NAME> */
+typedef enum
+{
+    OP_GETATTR,
+    OP_READLINK,
+    OP_GETDIR,
+    OP_MKNOD,
+    OP_MKDIR,
+    OP_UNLINK,
+    OP_RMDIR,
+    OP_SYMLINK,
+    OP_RENAME,
+    OP_LINK,
+    OP_CHMOD,
+    OP_CHOWN,
+    OP_TRUNCATE,
+    OP_UTIME,
+    OP_OPEN,
+    OP_READ,
+    OP_WRITE,
+    OP_STATFS,
+    OP_FLUSH,
+    OP_RELEASE,
+    OP_FSYNC,
+    OP_SETXATTR,
+    OP_GETXATTR,
+    OP_LISTXATTR,
+    OP_REMOVEXATTR,
+    OP_OPENDIR,
+    OP_READDIR,
+    OP_RELEASEDIR,
+    OP_FSYNCDIR,
+    OP_DESTROY,
+    OP_ACCESS,
+    OP_CREATE,
+    OP_FTRUNCATE,
+    OP_FGETATTR,
+    OP_LOCK,
+    OP_UTIMENS,
+    OP_COUNT
+} op_stats_op;
+
+#define OP_STATS_SUB_BUCKET_BITS 2
+#define OP_STATS_SUB_BUCKETS (1 << OP_STATS_SUB_BUCKET_BITS)
+/* Latencies at or above 2^OP_STATS_MAX_EXPONENT ns (about 18 minutes) all
+ * land in the last bucket */
+#define OP_STATS_MAX_EXPONENT 40
+#define OP_STATS_BUCKETS ((OP_STATS_MAX_EXPONENT - OP_STATS_SUB_BUCKET_BITS + 1) * OP_STATS_SUB_BUCKETS)
+
+typedef struct
+{
+    guint64 calls;
+    /* Calls which returned a negative value */
+    guint64 errors;
+    guint64 total_ns;
+    guint64 max_ns;
+    guint64 histogram[OP_STATS_BUCKETS];
+} op_stats_summary;
+
+extern const char *op_stats_names[OP_COUNT];
+
+/* Returns the operation with the given name or -1 if there isn't one */
+int op_stats_op_from_name (const char *name);
+
+/* Records one call of op which took elapsed_ns and returned result */
+void op_stats_record (op_stats_op op, guint64 elapsed_ns, int result);
+
+/* Sums the counters of all threads for op into summary */
+void op_stats_collect (op_stats_op op, op_stats_summary *summary);
+
+/* Returns the latency in ns below which a fraction p (0 <= p <= 1) of the
+ * calls in summary fall. The value is the upper bound of the bucket holding
+ * that call, capped at the summary's maximum */
+guint64 op_stats_percentile (op_stats_summary *summary, double p);
+
+/* Index of the histogram bucket for a latency, and the smallest latency
+ * that falls in a bucket */
+int op_stats_bucket (guint64 ns);
+guint64 op_stats_bucket_lower_bound (int bucket);
+
+/* Appends a table of the operations that have been called, one per line,
+ * to out */
+void op_stats_print (GString *out);
+
+#endif /* OP_STATS_H */
@@ -0,0 +1,478 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "log.h"
+#include "util.h"
+#include "op_trace.h"
+
+#define OP_TRACE_FIELDS 9
+
+/* A record in a binary trace is this header followed by path_len bytes of
+ * path and path2_len bytes of path2, with no terminators or padding */
+typedef struct
+{
+    guint64 time_ns;
+    guint64 latency_ns;
+    guint64 size;
+    gint64 offset;
+    gint32 result;
+    guint32 thread;
+    guint16 op;
+    guint16 path_len;
+    guint16 path2_len;
+    guint16 padding;
+} op_trace_record_header;
+
+/* Bytes per thread ring. Must be a power of two */
+#define TRACE_RING_SIZE (1 << 18)
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+/* How long the writer sleeps when there's nothing to write */
+#define TRACE_DRAIN_INTERVAL_NS 100000000L
+
+typedef struct trace_ring
+{
+    char data[TRACE_RING_SIZE];
+    /* Bytes published by the owning thread */
+    size_t head;
+    /* Bytes written out by the writer thread */
+    size_t tail;
+    /* Records that didn't fit. Only the owning thread writes it */
+    guint64 dropped;
+    guint32 thread;
+    /* Whether a thread owns the ring. An exiting thread's ring is handed
+     * to the next thread to record */
+    int in_use;
+    struct trace_ring *next;
+} trace_ring;
+
+int op_trace_recording = FALSE;
+static FILE *trace_file = NULL;
+static guint64 trace_start_ns = 0;
+static trace_ring *trace_rings = NULL;
+static guint32 next_thread_number = 0;
+/* Incremented when the rings are freed so that threads know to make new
+ * ones */
+static int trace_ring_generation = 0;
+static __thread trace_ring *thread_trace_ring = NULL;
+static __thread int thread_trace_ring_generation = -1;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_t writer_thread;
+static int writer_running = FALSE;
+static int writer_stop = FALSE;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+static void _start_writer (void);
+
+/* As for the log, the writer thread has to be started again in the child
+ * when fuse_main forks to daemonize */
+static void _atfork_prepare (void)
+{
+    pthread_mutex_lock(&writer_mutex);
+}
+
+static void _atfork_parent (void)
+{
+    pthread_mutex_unlock(&writer_mutex);
+}
+
+static void _atfork_child (void)
+{
+    pthread_mutex_unlock(&writer_mutex);
+    pthread_cond_init(&writer_cond, NULL);
+    /* The other threads' rings have no owners any more */
+    for (trace_ring *r = trace_rings; r; r = r->next)
+    {
+        if (r != thread_trace_ring)
+        {
+            r->in_use = FALSE;
+        }
+    }
+    if (writer_running)
+    {
+        writer_running = FALSE;
+        _start_writer();
+    }
+}
+
+static void _register_atfork (void)
+{
+    pthread_atfork(_atfork_prepare, _atfork_parent, _atfork_child);
+}
+
+/* Hands the exiting thread's ring back, unless the rings have been freed
+ * since it was made */
+static void _release_ring (void *data)
+{
+    trace_ring *r = data;
+    if (r == thread_trace_ring
+            && thread_trace_ring_generation == __atomic_load_n(&trace_ring_generation, __ATOMIC_ACQUIRE))
+    {
+        __atomic_store_n(&r->in_use, FALSE, __ATOMIC_RELEASE);
+    }
+    thread_trace_ring = NULL;
+    thread_trace_ring_generation = -1;
+}
+
+static void _make_ring_key (void)
+{
+    pthread_key_create(&ring_key, _release_ring);
+}
+
+static trace_ring *_get_thread_ring (void)
+{
+    int generation = __atomic_load_n(&trace_ring_generation, __ATOMIC_ACQUIRE);
+    if (thread_trace_ring_generation != generation)
+    {
+        trace_ring *r;
+        pthread_once(&ring_key_once, _make_ring_key);
+        for (r = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); r; r = r->next)
+        {
+            int expected = FALSE;
+            if (__atomic_compare_exchange_n(&r->in_use, &expected, TRUE, 0,
+                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+
+        if (!r)
+        {
+            r = g_malloc0(sizeof(trace_ring));
+            r->in_use = TRUE;
+            r->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+            while (!__atomic_compare_exchange_n(&trace_rings, &r->next, r, 0,
+                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                continue;
+        }
+        /* Records from a reused ring still tell the threads apart */
+        r->thread = __atomic_fetch_add(&next_thread_number, 1, __ATOMIC_RELAXED);
+        thread_trace_ring = r;
+        thread_trace_ring_generation = generation;
+        pthread_setspecific(ring_key, r);
+    }
+    return thread_trace_ring;
+}
+
+static void _ring_copy (trace_ring *r, size_t pos, const void *src, size_t len)
+{
+    size_t start = pos & TRACE_RING_MASK;
+    size_t first = MIN(len, TRACE_RING_SIZE - start);
+    memcpy(r->data + start, src, first);
+    memcpy(r->data, (const char*) src + first, len - first);
+}
+
+void op_trace_record (op_stats_op op, const char *path, const char *path2,
+        guint64 size, gint64 offset, guint64 start_ns, guint64 latency_ns, int result)
+{
+    trace_ring *r = _get_thread_ring();
+    op_trace_record_header h;
+    size_t path_len = path ? MIN(strlen(path), G_MAXUINT16) : 0;
+    size_t path2_len = path2 ? MIN(strlen(path2), G_MAXUINT16) : 0;
+    size_t len = sizeof(h) + path_len + path2_len;
+
+    size_t head = r->head;
+    if (head + len - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > TRACE_RING_SIZE)
+    {
+        r->dropped++;
+        return;
+    }
+
+    h.time_ns = start_ns - trace_start_ns;
+    h.latency_ns = latency_ns;
+    h.size = size;
+    h.offset = offset;
+    h.result = result;
+    h.thread = r->thread;
+    h.op = op;
+    h.path_len = path_len;
+    h.path2_len = path2_len;
+    h.padding = 0;
+
+    _ring_copy(r, head, &h, sizeof(h));
+    _ring_copy(r, head + sizeof(h), path, path_len);
+    _ring_copy(r, head + sizeof(h) + path_len, path2, path2_len);
+    __atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+
+    if (r->head - r->tail > TRACE_RING_SIZE / 2)
+    {
+        pthread_cond_signal(&writer_cond);
+    }
+}
+
+/* Writes out everything recorded so far. Records are only published whole,
+ * so each ring's published bytes are a sequence of whole records */
+static size_t _write_all (void)
+{
+    size_t total = 0;
+    for (trace_ring *r = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next)
+    {
+        size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        size_t n = head - r->tail;
+        if (n)
+        {
+            size_t start = r->tail & TRACE_RING_MASK;
+            size_t first = MIN(n, TRACE_RING_SIZE - start);
+            fwrite(r->data + start, 1, first, trace_file);
+            fwrite(r->data, 1, n - first, trace_file);
+            /* The data is copied into the FILE's buffer, so the space can
+             * be reused right away */
+            __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+            total += n;
+        }
+    }
+    return total;
+}
+
+static void *_writer_main (void *data)
+{
+    while (!__atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE))
+    {
+        if (!_write_all())
+        {
+            fflush(trace_file);
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += TRACE_DRAIN_INTERVAL_NS;
+            if (ts.tv_nsec >= 1000000000L)
+            {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_mutex_lock(&writer_mutex);
+            pthread_cond_timedwait(&writer_cond, &writer_mutex, &ts);
+            pthread_mutex_unlock(&writer_mutex);
+        }
+    }
+    _write_all();
+    fflush(trace_file);
+    return NULL;
+}
+
+static void _start_writer (void)
+{
+    writer_stop = FALSE;
+    if (pthread_create(&writer_thread, NULL, _writer_main, NULL) != 0)
+    {
+        error("op_trace: couldn't start the trace writer thread");
+        return;
+    }
+    writer_running = TRUE;
+}
+
+int op_trace_record_open (const char *file_name)
+{
+    pthread_once(&atfork_once, _register_atfork);
+    if (op_trace_recording)
+    {
+        op_trace_record_close();
+    }
+
+    trace_file = fopen(file_name, "w");
+    if (!trace_file)
+    {
+        error("op_trace: couldn't open %s for the trace", file_name);
+        return -1;
+    }
+    fwrite(OP_TRACE_MAGIC, 1, strlen(OP_TRACE_MAGIC), trace_file);
+    trace_start_ns = monotonic_time_ns();
+    _start_writer();
+    if (!writer_running)
+    {
+        fclose(trace_file);
+        return -1;
+    }
+    op_trace_recording = TRUE;
+    return 0;
+}
+
+void op_trace_record_close (void)
+{
+    if (!op_trace_recording)
+    {
+        return;
+    }
+    op_trace_recording = FALSE;
+
+    __atomic_store_n(&writer_stop, TRUE, __ATOMIC_RELEASE);
+    pthread_cond_signal(&writer_cond);
+    pthread_join(writer_thread, NULL);
+    writer_running = FALSE;
+    fclose(trace_file);
+    trace_file = NULL;
+
+    guint64 dropped = 0;
+    trace_ring *r = __atomic_exchange_n(&trace_rings, NULL, __ATOMIC_ACQ_REL);
+    __atomic_add_fetch(&trace_ring_generation, 1, __ATOMIC_RELEASE);
+    while (r)
+    {
+        trace_ring *next = r->next;
+        dropped += r->dropped;
+        g_free(r);
+        r = next;
+    }
+    if (dropped)
+    {
+        warn("op_trace: dropped %" G_GUINT64_FORMAT " records that didn't fit in the buffers", dropped);
+    }
+}
+
+op_trace_entry *op_trace_entry_new (op_stats_op op, const char *path, const char *path2)
+{
+    op_trace_entry *res = g_malloc0(sizeof(op_trace_entry));
+    res->op = op;
+    res->path = g_strdup(path);
+    res->path2 = g_strdup(path2 ? path2 : "");
+    return res;
+}
+
+void op_trace_entry_clear (op_trace_entry *entry)
+{
+    g_free(entry->path);
+    g_free(entry->path2);
+    entry->path = NULL;
+    entry->path2 = NULL;
+}
+
+void op_trace_entry_free (op_trace_entry *entry)
+{
+    op_trace_entry_clear(entry);
+    g_free(entry);
+}
+
+gboolean op_trace_parse (const char *line, op_trace_entry *entry)
+{
+    memset(entry, 0, sizeof(op_trace_entry));
+    char **fields = g_strsplit(line, "\t", OP_TRACE_FIELDS);
+    gboolean res = FALSE;
+
+    if (g_strv_length(fields) != OP_TRACE_FIELDS)
+    {
+        goto OP_TRACE_PARSE_END;
+    }
+
+    int op = op_stats_op_from_name(fields[2]);
+    if (op < 0)
+    {
+        goto OP_TRACE_PARSE_END;
+    }
+
+    /* the last field may carry the line ending */
+    g_strchomp(fields[8]);
+
+    entry->time_ns = g_ascii_strtoull(fields[0], NULL, 10);
+    entry->thread = g_ascii_strtoull(fields[1], NULL, 10);
+    entry->op = op;
+    entry->result = g_ascii_strtoll(fields[3], NULL, 10);
+    entry->latency_ns = g_ascii_strtoull(fields[4], NULL, 10);
+    entry->path = g_strcompress(fields[5]);
+    entry->path2 = g_strcompress(fields[6]);
+    entry->size = g_ascii_strtoull(fields[7], NULL, 10);
+    entry->offset = g_ascii_strtoll(fields[8], NULL, 10);
+    res = TRUE;
+
+OP_TRACE_PARSE_END:
+    g_strfreev(fields);
+    return res;
+}
+
+void op_trace_format (GString *out, const op_trace_entry *entry)
+{
+    char *path = g_strescape(entry->path ? entry->path : "", NULL);
+    char *path2 = g_strescape(entry->path2 ? entry->path2 : "", NULL);
+    g_string_append_printf(out,
+            "%" G_GUINT64_FORMAT "\t%u\t%s\t%d\t%" G_GUINT64_FORMAT
+            "\t%s\t%s\t%" G_GUINT64_FORMAT "\t%" G_GINT64_FORMAT "\n",
+            entry->time_ns, entry->thread, op_stats_names[entry->op],
+            entry->result, entry->latency_ns, path, path2,
+            entry->size, entry->offset);
+    g_free(path);
+    g_free(path2);
+}
+
+static gint _compare_time (gconstpointer a, gconstpointer b)
+{
+    const op_trace_entry *x = *(op_trace_entry**) a;
+    const op_trace_entry *y = *(op_trace_entry**) b;
+    if (x->time_ns != y->time_ns)
+    {
+        return (x->time_ns < y->time_ns) ? -1 : 1;
+    }
+    return (x->thread < y->thread) ? -1 : (x->thread > y->thread);
+}
+
+static void _load_binary (GPtrArray *res, const char *contents, gsize length)
+{
+    gsize pos = strlen(OP_TRACE_MAGIC);
+    op_trace_record_header h;
+    while (pos + sizeof(h) <= length)
+    {
+        memcpy(&h, contents + pos, sizeof(h));
+        if (pos + sizeof(h) + h.path_len + h.path2_len > length || h.op >= OP_COUNT)
+        {
+            break;
+        }
+        pos += sizeof(h);
+
+        op_trace_entry *e = g_malloc0(sizeof(op_trace_entry));
+        e->time_ns = h.time_ns;
+        e->thread = h.thread;
+        e->op = h.op;
+        e->result = h.result;
+        e->latency_ns = h.latency_ns;
+        e->size = h.size;
+        e->offset = h.offset;
+        e->path = g_strndup(contents + pos, h.path_len);
+        pos += h.path_len;
+        e->path2 = g_strndup(contents + pos, h.path2_len);
+        pos += h.path2_len;
+        g_ptr_array_add(res, e);
+    }
+    g_ptr_array_sort(res, _compare_time);
+}
+
+GPtrArray *op_trace_load (const char *file_name, GError **err)
+{
+    char *contents = NULL;
+    gsize length = 0;
+    if (!g_file_get_contents(file_name, &contents, &length, err))
+    {
+        return NULL;
+    }
+
+    GPtrArray *res = g_ptr_array_new_with_free_func((GDestroyNotify) op_trace_entry_free);
+    if (g_str_has_prefix(contents, OP_TRACE_MAGIC))
+    {
+        _load_binary(res, contents, length);
+        g_free(contents);
+        return res;
+    }
+
+    char **lines = g_strsplit(contents, "\n", -1);
+    for (int i = 0; lines[i] != NULL; i++)
+    {
+        if (lines[i][0] == '#' || lines[i][0] == '\0')
+        {
+            continue;
+        }
+
+        op_trace_entry *entry = g_malloc(sizeof(op_trace_entry));
+        if (op_trace_parse(lines[i], entry))
+        {
+            g_ptr_array_add(res, entry);
+        }
+        else
+        {
+            warn("op_trace_load: skipping malformed line %d of %s", i + 1, file_name);
+            g_free(entry);
+        }
+    }
+    g_strfreev(lines);
+    g_free(contents);
+    return res;
+}
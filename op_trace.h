@@ -0,0 +1,84 @@
+#ifndef OP_TRACE_H
+#define OP_TRACE_H
+#include <glib.h>
+#include "op_stats.h"
+
+/* Traces of file system operations, for replaying against the operations
+ * without a mount.
+ *
+ * Traces recorded by a mounted file system are binary: OP_TRACE_MAGIC
+ * followed by records of fixed-size headers and the bytes of the paths.
+ * Records from different threads may be out of order in the file.
+ *
+ * Traces can also be written by hand or by tools as text, with one
+ * operation per line. Lines starting with '#' are comments. The fields are
+ * separated by tabs:
+ *
+ *   time_ns thread op result latency_ns path path2 size offset
+ *
+ * time_ns is when the call started relative to the start of the trace,
+ * thread identifies the calling thread, and result and latency_ns are what
+ * the call returned and how long it took. Synthetic traces may leave those
+ * four as 0. op is a name from op_stats_names. path2 is the target of a
+ * rename or symlink and is otherwise empty. size and offset are the
+ * arguments of read and write, and size holds the mode for mkdir and
+ * create. Paths are escaped as by g_strescape.
+ */
+
+typedef struct
+{
+    guint64 time_ns;
+    guint thread;
+    op_stats_op op;
+    int result;
+    guint64 latency_ns;
+    char *path;
+    char *path2;
+    guint64 size;
+    gint64 offset;
+} op_trace_entry;
+
+/* Parses line into entry. Returns FALSE if the line is malformed, in which
+ * case entry is left empty */
+gboolean op_trace_parse (const char *line, op_trace_entry *entry);
+/* Appends entry to out as a line of the trace, including the newline */
+void op_trace_format (GString *out, const op_trace_entry *entry);
+
+/* Reads all of the entries of a trace file, binary or text, into an array
+ * which frees them when it is freed. Binary traces are sorted by time.
+ * Returns NULL and sets err if the file can't be read. Malformed text lines
+ * are skipped with a warning. A truncated binary trace is read up to the
+ * last whole record */
+GPtrArray *op_trace_load (const char *file_name, GError **err);
+
+#define OP_TRACE_MAGIC "TAGFSTR1"
+
+/* Recording.
+ *
+ * Each thread appends records to a ring buffer of its own which a writer
+ * thread drains to the file, so recording takes no locks and doesn't wait
+ * for I/O. If a thread's ring fills up faster than it is drained, records
+ * are dropped rather than slowing the thread down. The number dropped is
+ * logged when recording stops.
+ */
+
+/* Non-zero while recording. Checked before calling op_trace_record */
+extern int op_trace_recording;
+
+/* Starts recording to file_name. Returns 0 on success and -1 if the file
+ * can't be opened */
+int op_trace_record_open (const char *file_name);
+/* Records a call which started at start_ns on the monotonic clock. path2,
+ * size and offset are as in op_trace_entry */
+void op_trace_record (op_stats_op op, const char *path, const char *path2,
+        guint64 size, gint64 offset, guint64 start_ns, guint64 latency_ns, int result);
+/* Writes out everything recorded and stops recording. Must not be called
+ * while operations may still be recorded */
+void op_trace_record_close (void);
+
+op_trace_entry *op_trace_entry_new (op_stats_op op, const char *path, const char *path2);
+void op_trace_entry_free (op_trace_entry *entry);
+/* Frees the members of entry but not entry itself */
+void op_trace_entry_clear (op_trace_entry *entry);
+
+#endif /* OP_TRACE_H */
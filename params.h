@@ -9,9 +9,18 @@
 #undef FUSE_USE_VERSION
 #endif
 
+#ifdef TAGFS_FAKE_FUSE
+#include "fake_fuse.h"
+#else
 #define __need_timespec
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
+/* fuse_get_context only works under the high-level API, so the low-level
+ * frontend (tagfs_ll.c) points this at a context of its own for the request
+ * that a thread is serving */
+extern __thread struct fuse_context *tagfs_ll_context;
+#define TAGFS_CONTEXT (tagfs_ll_context ? tagfs_ll_context : fuse_get_context())
+#endif /* TAGFS_FAKE_FUSE */
 
 #else
 #include <stdio.h>
@@ -20,12 +29,49 @@
 
 #include "tagfs.h"
 
-#define FSDATA ((struct tagfs_state *) fuse_get_context()->private_data)
+#ifndef TAGFS_CONTEXT
+#define TAGFS_CONTEXT fuse_get_context()
+#endif
+
+#define FSDATA ((struct tagfs_state *) TAGFS_CONTEXT->private_data)
 
 #define DB FSDATA->db
 #define STAGE FSDATA->stage
+#define LISTINGS FSDATA->listings
+#define ATTRS FSDATA->attrs
+#define COPIES FSDATA->copies
+#define DEDUP FSDATA->dedup
 #define SEARCHES FSDATA->search_results
 
+/* Bytes of directory listings to keep cached */
+#define LISTING_CACHE_BYTES (64 * 1024 * 1024)
+/* Most files a directory can have and still be listed whole when it's
+ * opened. A larger one's files are read this many at a time by readdir */
+#define LISTING_CHUNK_FILES 4096
+/* Number of files' attributes to keep cached */
+#define STAT_CACHE_ENTRIES 65536
+/* Number of handles on copies to keep open. Has to leave room under the
+ * limit on open files for the files which are open through the mount */
+#define COPIES_FD_CACHE_ENTRIES 256
+/* Default seconds for which the kernel may cache names and attributes. The
+ * high-level API has no way to tell the kernel that they've changed, so
+ * they're short, and names which don't exist aren't cached */
+#define DEFAULT_ENTRY_TIMEOUT 1.0
+#define DEFAULT_ATTR_TIMEOUT 1.0
+#define DEFAULT_NEGATIVE_TIMEOUT 0.0
+/* The low-level frontend invalidates what changes, so it can let the kernel
+ * keep things for much longer */
+#define LL_DEFAULT_ENTRY_TIMEOUT 3600.0
+#define LL_DEFAULT_ATTR_TIMEOUT 3600.0
+#define LL_DEFAULT_NEGATIVE_TIMEOUT 3600.0
+/* Names in a directory which the low-level frontend tells the kernel to
+ * cache as missing. Past that, missing names aren't cached */
+#define LL_MAX_NEGATIVE_ENTRIES 4096
+/* Mount options which let FUSE splice file data to and from the device
+ * rather than copying it through our buffers. The kernel falls back to
+ * copying when it can't */
+#define TAGFS_SPLICE_OPTIONS "splice_read,splice_write,splice_move"
+
 /* Default permissions for directories */
 #define DIR_PERMS 0755 | S_IFDIR
 
@@ -54,6 +100,10 @@
  * names . and .. are read as well. */
 #define INFO_FH LEADER "I"
 
+/* A read-only file in the root of the mount giving call counts, error counts
+ * and latency percentiles for each file system operation */
+#define STATS_FH LEADER "P"
+
 /* If any file begins with the leader, it will be read in as normal so long as
  * the leader does not contiune into one of the above handles */
 
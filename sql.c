@@ -3,46 +3,118 @@
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "log.h"
 #include "sql.h"
+#include "util.h"
 
 static int _get_version(sqlite3 *db);
 static int _set_version(sqlite3 *db);
 static int _set_version0(sqlite3 *db, int version);
-GTree *get_db_backups (sqlite3 *db);
-gboolean increment_database_name (gpointer key, gpointer val, gpointer data);
-gboolean unlink_func (gpointer key, gpointer val, gpointer data);
-int cp (const char *from, const char *to);
-
-char *upgrade_list [] =
-{
-    "alter table file_tag rename to file_tag_old;"
-    "create table file_tag(file integer, tag integer, value blob,"
-    " primary key (file,tag),"
-    " foreign key (file) references file(id),"
-    " foreign key (tag) references tag(id));"
-
-    "insert into file_tag"
-    " select file, tag, default_value from file_tag_old,tag"
-    " where tag=id;"
-
-    "insert into file_tag"
-    " select file, tag, NULL from file_tag_old,tag"
-    " where tag is NULL;"
-
-    "drop table file_tag_old;"
-    ,
-    "alter table file_tag rename to file_tag_old;"
-    "create table file_tag(file integer not null, tag integer not null, value blob,"
-    " primary key (file,tag),"
-    " foreign key (file) references file(id),"
-    " foreign key (tag) references tag(id));"
-
-    "insert into file_tag"
-    " select file, tag, value from file_tag_old where tag is not null;"
-
-    "drop table file_tag_old;",
-    "drop table tag_union;"
+
+/* A step of upgrade_list, taking the database from one version to the next.
+ *
+ * script is run in one transaction. A step which changes a table's schema
+ * has its script rename the table to copy_from and make the new one. Then
+ * copy moves the rows over, UPGRADE_BATCH_ROWS at a time, in a transaction
+ * for each batch. It's run with ?1 bound to the highest rowid in the batch,
+ * and the batch is deleted from copy_from after, so the new table reuses
+ * the pages of the old one rather than the file holding both. copy_from is
+ * dropped once it's empty. If the copy is interrupted, copy_from is still
+ * there the next time and the copy carries on from where it was.
+ */
+typedef struct
+{
+    const char *script;
+    const char *copy_from;
+    const char *copy;
+} upgrade_step;
+
+/* The closure of the tag hierarchy: a row for each tag and each of its
+ * descendants, with the number of subtag links between them, and one for
+ * each tag with itself at depth 0. The triggers keep it in step with the
+ * tag and subtag tables, so a subtree is the rows with its root as the
+ * ancestor. A move is a delete and an insert in subtag, which cut the
+ * moved subtree from the old ancestors and join it to the new ones */
+#define TAG_CLOSURE_SCHEMA \
+    "create table IF NOT EXISTS tag_closure(ancestor integer not null, descendant integer not null," \
+        " depth integer not null, primary key (ancestor, descendant));" \
+    "create index IF NOT EXISTS tag_closure_descendant on tag_closure(descendant, ancestor);" \
+    "create trigger IF NOT EXISTS tag_closure_tag_ins after insert on tag begin" \
+        " insert or ignore into tag_closure values(new.id, new.id, 0);" \
+    " end;" \
+    "create trigger IF NOT EXISTS tag_closure_tag_del after delete on tag begin" \
+        " delete from tag_closure where ancestor = old.id or descendant = old.id;" \
+    " end;" \
+    "create trigger IF NOT EXISTS tag_closure_subtag_ins after insert on subtag begin" \
+        " insert or ignore into tag_closure values(new.super, new.super, 0);" \
+        " insert or ignore into tag_closure values(new.sub, new.sub, 0);" \
+        " insert or replace into tag_closure" \
+        "  select a.ancestor, d.descendant, a.depth + d.depth + 1" \
+        "  from tag_closure a, tag_closure d" \
+        "  where a.descendant = new.super and d.ancestor = new.sub;" \
+    " end;" \
+    "create trigger IF NOT EXISTS tag_closure_subtag_del after delete on subtag begin" \
+        " delete from tag_closure" \
+        "  where descendant in (select descendant from tag_closure where ancestor = old.sub)" \
+        "  and ancestor in (select ancestor from tag_closure where descendant = old.super);" \
+    " end;"
+
+upgrade_step upgrade_list [] =
+{
+    {
+        "alter table file_tag rename to file_tag_old;"
+        "create table file_tag(file integer, tag integer, value blob,"
+        " primary key (file,tag),"
+        " foreign key (file) references file(id),"
+        " foreign key (tag) references tag(id));",
+        "file_tag_old",
+        "insert into file_tag"
+        " select file, tag, (select default_value from tag where id = file_tag_old.tag)"
+        " from file_tag_old"
+        " where rowid <= ?1 and (tag is NULL or tag in (select id from tag));"
+    },
+    {
+        "alter table file_tag rename to file_tag_old;"
+        "create table file_tag(file integer not null, tag integer not null, value blob,"
+        " primary key (file,tag),"
+        " foreign key (file) references file(id),"
+        " foreign key (tag) references tag(id));",
+        "file_tag_old",
+        "insert into file_tag"
+        " select file, tag, value from file_tag_old where rowid <= ?1 and tag is not null;"
+    },
+    { "drop table tag_union;" },
+    {
+        "alter table file add column size integer;"
+        "alter table file add column mode integer;"
+        "alter table file add column uid integer;"
+        "alter table file add column gid integer;"
+        "alter table file add column atime integer;"
+        "alter table file add column mtime integer;"
+        "alter table file add column ctime integer;"
+    },
+    {
+        "create table content(key text primary key, refs integer not null);"
+        "create table file_content(file integer primary key, key text not null);"
+    },
+    {
+        "create index IF NOT EXISTS file_tag_tag on file_tag(tag, file);"
+        "create index IF NOT EXISTS file_name on file(name);"
+        "create index IF NOT EXISTS tag_name on tag(name);"
+        "create index IF NOT EXISTS subtag_super on subtag(super);"
+    },
+    {
+        TAG_CLOSURE_SCHEMA
+        "insert or ignore into tag_closure select id, id, 0 from tag;"
+        "insert or ignore into tag_closure"
+        " with recursive c(ancestor, descendant, depth) as"
+        "  (select super, sub, 1 from subtag"
+        "   union all select c.ancestor, s.sub, c.depth + 1 from c, subtag s where s.super = c.descendant)"
+        " select * from c;"
+    }
 };
 
 char *tables =
@@ -55,13 +127,35 @@ char *tables =
     /* a table of tag names, ids, and default_values to set for files */
     "create table IF NOT EXISTS tag(id integer primary key, name varchar(255), default_value blob);"
 
-    /* a table of file names, ids */
-    "create table IF NOT EXISTS file(id integer primary key, name varchar(255));"
+    /* a table of file names, ids and the attributes of their copies, which
+     * are NULL when they aren't known. Times are in nanoseconds */
+    "create table IF NOT EXISTS file(id integer primary key, name varchar(255),"
+            " size integer, mode integer, uid integer, gid integer,"
+            " atime integer, mtime integer, ctime integer);"
+
+    /* the contents shared by the copies of files, with the number of
+     * copies which share each */
+    "create table IF NOT EXISTS content(key text primary key, refs integer not null);"
+
+    /* a table associating files to the contents their copies share */
+    "create table IF NOT EXISTS file_content(file integer primary key, key text not null);"
 
     /* a table associating tags to sub-tags. */
     "create table IF NOT EXISTS subtag(super integer, sub integer unique,"
         " foreign key (super) references tag(id),"
         " foreign key (sub) references tag(id));"
+
+    /* indexes for the lookups which don't go by a primary key. The primary
+     * key of file_tag serves those by file, and file_tag_tag those by tag.
+     * Both also serve the checks of the foreign keys when files and tags
+     * are deleted */
+    "create index IF NOT EXISTS file_tag_tag on file_tag(tag, file);"
+    "create index IF NOT EXISTS file_name on file(name);"
+    "create index IF NOT EXISTS tag_name on tag(name);"
+    "create index IF NOT EXISTS subtag_super on subtag(super);"
+
+    /* the ancestors and descendants of each tag */
+    TAG_CLOSURE_SCHEMA
 ;
 int _sql_exec(sqlite3 *db, char *cmd, const char *file, int line_number)
 {
@@ -105,6 +199,93 @@ int _sql_step (sqlite3_stmt *stmt, const char *file, int line_number)
     }
 }
 
+#define profile_add(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+void sql_stmt_acquire (sql_stmt_profile *p, sem_t *sem)
+{
+    guint64 start = monotonic_time_ns();
+    sem_wait(sem);
+    p->started = monotonic_time_ns();
+    profile_add(p->wait_ns, p->started - start);
+}
+
+void sql_stmt_release (sql_stmt_profile *p, sem_t *sem)
+{
+    guint64 elapsed = monotonic_time_ns() - p->started;
+    profile_add(p->executions, 1);
+    profile_add(p->total_ns, elapsed);
+    if (elapsed > p->max_ns)
+    {
+        __atomic_store_n(&p->max_ns, elapsed, __ATOMIC_RELAXED);
+    }
+    sem_post(sem);
+}
+
+void sql_stmt_profiles_print (GString *out, const char *label, const char **names,
+        sql_stmt_profile *profiles, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        sql_stmt_profile *p = &profiles[i];
+        guint64 executions = __atomic_load_n(&p->executions, __ATOMIC_RELAXED);
+        if (executions == 0)
+        {
+            continue;
+        }
+        guint64 total_ns = __atomic_load_n(&p->total_ns, __ATOMIC_RELAXED);
+        g_string_append_printf(out,
+                "%-12s %-8s %10" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT
+                " %12" G_GUINT64_FORMAT " %12" G_GUINT64_FORMAT
+                " %10" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT "\n",
+                label, names[i], executions,
+                __atomic_load_n(&p->rows, __ATOMIC_RELAXED),
+                __atomic_load_n(&p->wait_ns, __ATOMIC_RELAXED),
+                total_ns,
+                total_ns / executions,
+                __atomic_load_n(&p->max_ns, __ATOMIC_RELAXED));
+    }
+}
+
+/* Whether a line of a query plan reads every row of a table or index */
+static gboolean _is_full_scan (const char *detail)
+{
+    return strncmp(detail, "SCAN ", strlen("SCAN ")) == 0
+        && !strstr(detail, "CONSTANT ROW");
+}
+
+int sql_stmts_full_scans (GString *out, const char *label, const char **names,
+        sqlite3_stmt **stmts, int n)
+{
+    int res = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (!stmts[i])
+        {
+            continue;
+        }
+        sqlite3_stmt *plan = NULL;
+        char *cmd = g_strdup_printf("explain query plan %s", sqlite3_sql(stmts[i]));
+        if (sql_prepare(sqlite3_db_handle(stmts[i]), cmd, plan) == SQLITE_OK)
+        {
+            while (sql_next_row(plan) == SQLITE_ROW)
+            {
+                const char *detail = (const char*) sqlite3_column_text(plan, 3);
+                if (detail && _is_full_scan(detail))
+                {
+                    res++;
+                    if (out)
+                    {
+                        g_string_append_printf(out, "%-12s %-8s %s\n", label, names[i], detail);
+                    }
+                }
+            }
+        }
+        sqlite3_finalize(plan);
+        g_free(cmd);
+    }
+    return res;
+}
+
 void sql_begin_transaction(sqlite3 *db)
 {
     sql_exec(db, "begin transaction");
@@ -115,6 +296,131 @@ void sql_commit(sqlite3 *db)
     sql_exec(db, "commit");
 }
 
+static gboolean _table_exists (sqlite3 *db, const char *name)
+{
+    sqlite3_stmt *stmt = NULL;
+    gboolean res = FALSE;
+    if (sql_prepare(db, "select 1 from sqlite_master where type = 'table' and name = ?", stmt) == SQLITE_OK)
+    {
+        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+        res = (sql_next_row(stmt) == SQLITE_ROW);
+    }
+    sqlite3_finalize(stmt);
+    return res;
+}
+
+/* Moves the rows of step->copy_from with step->copy a batch at a time */
+static int _upgrade_copy (sqlite3 *db, const upgrade_step *step)
+{
+    sqlite3_stmt *last = NULL;
+    sqlite3_stmt *copy = NULL;
+    sqlite3_stmt *delete = NULL;
+    char *last_cmd = g_strdup_printf("select max(rowid) from"
+            " (select rowid from %s order by rowid limit %d)",
+            step->copy_from, UPGRADE_BATCH_ROWS);
+    char *delete_cmd = g_strdup_printf("delete from %s where rowid <= ?1", step->copy_from);
+    sqlite3_int64 moved = 0;
+
+    int res = sql_prepare(db, last_cmd, last);
+    if (res == SQLITE_OK)
+    {
+        res = sql_prepare(db, step->copy, copy);
+    }
+    if (res == SQLITE_OK)
+    {
+        res = sql_prepare(db, delete_cmd, delete);
+    }
+
+    while (res == SQLITE_OK)
+    {
+        sqlite3_reset(last);
+        if (sql_next_row(last) != SQLITE_ROW || sqlite3_column_type(last, 0) == SQLITE_NULL)
+        {
+            break;
+        }
+        sqlite3_int64 bound = sqlite3_column_int64(last, 0);
+        sqlite3_reset(last);
+
+        sql_begin_transaction(db);
+        sqlite3_reset(copy);
+        sqlite3_bind_int64(copy, 1, bound);
+        sqlite3_reset(delete);
+        sqlite3_bind_int64(delete, 1, bound);
+        int status = sql_step(copy);
+        /* Taken before the delete, whose changes would replace it */
+        int copied = sqlite3_changes(db);
+        if (status == SQLITE_DONE)
+        {
+            status = sql_step(delete);
+        }
+        if (status != SQLITE_DONE)
+        {
+            res = sqlite3_errcode(db);
+            sql_exec(db, "rollback");
+        }
+        else
+        {
+            moved += copied;
+            sql_commit(db);
+            info("Upgrading the database: moved %lld rows from %s", (long long) moved, step->copy_from);
+        }
+    }
+
+    sqlite3_finalize(last);
+    sqlite3_finalize(copy);
+    sqlite3_finalize(delete);
+    g_free(last_cmd);
+    g_free(delete_cmd);
+    return res;
+}
+
+/* Takes the database to version with step */
+static int _upgrade (sqlite3 *db, const upgrade_step *step, int version)
+{
+    int res = SQLITE_OK;
+    if (step->copy_from && _table_exists(db, step->copy_from))
+    {
+        info("Resuming the upgrade of the database to version %d", version);
+    }
+    else
+    {
+        sql_begin_transaction(db);
+        res = sql_exec(db, (char*) step->script);
+        if (res != SQLITE_OK)
+        {
+            sql_exec(db, "rollback");
+            return res;
+        }
+        if (!step->copy_from)
+        {
+            _set_version0(db, version);
+        }
+        sql_commit(db);
+    }
+
+    if (step->copy_from)
+    {
+        res = _upgrade_copy(db, step);
+        if (res == SQLITE_OK)
+        {
+            char *drop_cmd = g_strdup_printf("drop table %s", step->copy_from);
+            sql_begin_transaction(db);
+            res = sql_exec(db, drop_cmd);
+            if (res == SQLITE_OK)
+            {
+                _set_version0(db, version);
+                sql_commit(db);
+            }
+            else
+            {
+                sql_exec(db, "rollback");
+            }
+            g_free(drop_cmd);
+        }
+    }
+    return res;
+}
+
 /* Returns -1 if there's a failure.
  * Returns 0 if the database was empty (version = 0)
  * Returns 1 if the database successfully updated to the current
@@ -144,16 +450,13 @@ int try_upgrade_db0 (sqlite3 *db, int target_version)
 
         for (int i = database_version; i < target_version; i++)
         {
-            sql_begin_transaction(db);
-            int res = sql_exec(db, upgrade_list[i - 1]);
-            sql_commit(db);
+            int res = _upgrade(db, &upgrade_list[i - 1], i + 1);
             if (res != SQLITE_OK)
             {
                 error("Error upgrading the database. SQLite error code: %d", res);
                 return -1;
             }
         }
-        _set_version0(db, target_version);
     }
     else if (database_version == target_version)
     {
@@ -168,146 +471,232 @@ int try_upgrade_db0 (sqlite3 *db, int target_version)
     return 1;
 }
 
-struct
+/* The number of a backup's name, or -1 if name isn't one of base's backups */
+static int _backup_number (const char *name, const char *base)
 {
-    const char *dirname;
-    const char *base;
-    int backups_renamed;
-} FILE_NAME_DATA;
+    size_t base_len = strlen(base);
+    if (strncmp(name, base, base_len) != 0
+            || strncmp(name + base_len, BKP_PART, strlen(BKP_PART)) != 0)
+    {
+        return -1;
+    }
+    const char *number_part = name + base_len + strlen(BKP_PART);
+    if (!*number_part || strspn(number_part, "0123456789") != strlen(number_part))
+    {
+        return -1;
+    }
+    return atoi(number_part);
+}
 
-int _name_cmp (const void *a, const void *b, gpointer _UNUSED_)
+/* A backup's place among the others */
+typedef struct
+{
+    struct timespec mtime;
+    int number;
+} BackupOrder;
+
+/* Backups are ordered by when they were made rather than by number, since
+ * before numbers went up with each backup the newest was always numbered
+ * 0 and the older ones renumbered. Numbers only break ties */
+static int _backup_cmp (const void *a, const void *b, gpointer _UNUSED_)
 {
-    return -(strcmp((char *)a, (char *)b));
+    const BackupOrder *x = a;
+    const BackupOrder *y = b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec)
+    {
+        return (x->mtime.tv_sec < y->mtime.tv_sec) ? -1 : 1;
+    }
+    if (x->mtime.tv_nsec != y->mtime.tv_nsec)
+    {
+        return (x->mtime.tv_nsec < y->mtime.tv_nsec) ? -1 : 1;
+    }
+    return x->number - y->number;
 }
 
-int database_backup (sqlite3 *db)
+/* The backups of db, from their BackupOrders to their paths, oldest first.
+ * Sets *highest, if it's given, to the highest number among them or -1 */
+static GTree *_get_db_backups (sqlite3 *db, int *highest)
 {
-    int res = 0;
     const char *db_name = sqlite3_db_filename(db, "main");
     char *db_directory = g_path_get_dirname(db_name);
-    debug("directory_name = %s", db_directory);
     char *db_base = g_path_get_basename(db_name);
-    int backed_up_count = 0;
-
-    GTree *database_names = get_db_backups(db);
-    backed_up_count = g_tree_nnodes(database_names);
-    FILE_NAME_DATA.dirname = db_directory;
-    FILE_NAME_DATA.base = db_base;
-    FILE_NAME_DATA.backups_renamed = 0;
+    GTree *res = g_tree_new_full(_backup_cmp, NULL, g_free, g_free);
+    int max = -1;
 
-    if (backed_up_count > 0)
+    DIR *d = opendir(db_directory);
+    struct dirent *de = NULL;
+    while (d && (de = readdir(d)) != NULL)
     {
-        g_tree_foreach(database_names, increment_database_name, NULL);
+        int n = _backup_number(de->d_name, db_base);
+        struct stat st;
+        if (n >= 0 && fstatat(dirfd(d), de->d_name, &st, 0) == 0)
+        {
+            BackupOrder *order = g_malloc(sizeof(BackupOrder));
+            order->mtime = st.st_mtim;
+            order->number = n;
+            g_tree_insert(res, order, g_build_filename(db_directory, de->d_name, NULL));
+            max = MAX(max, n);
+        }
     }
-
-    if (backed_up_count != FILE_NAME_DATA.backups_renamed)
+    if (d)
     {
-        res = -1;
+        closedir(d);
+    }
+    if (highest)
+    {
+        *highest = max;
     }
-
-    g_tree_destroy(database_names);
-    g_free(db_base);
     g_free(db_directory);
+    g_free(db_base);
     return res;
 }
 
-gboolean increment_database_name (gpointer key, gpointer val, gpointer data)
+struct expire_data
 {
-    static char src[PATH_MAX];
-    static char dest[PATH_MAX];
-    const char *base = FILE_NAME_DATA.base;
-    char *orig_name = key;
-    char *past_the_base = orig_name + strlen(base);
-    char *number_part = past_the_base + strlen(BKP_PART);
-    int n = 0;
-    gboolean on_active_db = FALSE;
+    /* The number of backups still to remove */
+    int excess;
+};
 
-    if (*past_the_base != 0)
+static gboolean _expire_backup (gpointer key, gpointer val, gpointer data)
+{
+    struct expire_data *ed = data;
+    if (ed->excess <= 0)
     {
-        n = atoi(number_part) + 1;
+        return TRUE;
     }
-    else
+    if (unlink(val) != 0)
     {
-        on_active_db = TRUE;
+        warn("Couldn't remove the old backup %s", (char*) val);
     }
+    ed->excess--;
+    return FALSE;
+}
 
-    sprintf(src, "%s/%s", FILE_NAME_DATA.dirname, orig_name);
-    sprintf(dest, "%s/%s%s%03d", FILE_NAME_DATA.dirname, base, BKP_PART, n);
-    if (n >= 1000)
-    {
-        warn("Possibly overwriting %s: More than 1000 backups are not supported.", src);
-    }
-    else
+/* Copies db's main database to the file dest with the backup API, a batch
+ * of pages at a time */
+static int _backup_to (sqlite3 *db, const char *dest)
+{
+    sqlite3 *dest_db;
+    int res = sqlite3_open_v2(dest, &dest_db, SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE, NULL);
+    if (res == SQLITE_OK)
     {
-        if (on_active_db)
-        {
-            if (cp(src, dest))
-            {
-                error("Couldn't copy %s to %s", src, dest);
-                return TRUE;
-            }
-        }
-        else
+        sqlite3_backup *b = sqlite3_backup_init(dest_db, "main", db, "main");
+        if (b)
         {
-            if (rename(src, dest))
+            do
             {
-                error("Couldn't rename %s to %s", src, dest);
-                return TRUE;
-            }
+                res = sqlite3_backup_step(b, DATABASE_BACKUP_PAGES);
+                /* Something is writing to the database, so it's given a
+                 * moment to finish */
+                if (res == SQLITE_BUSY || res == SQLITE_LOCKED)
+                {
+                    sqlite3_sleep(DATABASE_BACKUP_WAIT_MS);
+                }
+            } while (res == SQLITE_OK || res == SQLITE_BUSY || res == SQLITE_LOCKED);
+            sqlite3_backup_finish(b);
         }
-        FILE_NAME_DATA.backups_renamed++;
+        res = sqlite3_errcode(dest_db);
     }
-    return FALSE;
+    sqlite3_close(dest_db);
+    return res;
 }
 
-gboolean database_clear_backups (sqlite3 *db)
-{
-    GTree *names = get_db_backups(db);
-    g_tree_foreach(names, unlink_func, db);
-    g_tree_destroy(names);
-    return TRUE;
-}
+/* Backups are made under a temporary name, so a partial one is never
+ * taken for a backup, and one at a time */
+static pthread_mutex_t backup_lock = PTHREAD_MUTEX_INITIALIZER;
 
-gboolean unlink_func (gpointer key, gpointer val, gpointer data)
+int database_backup0 (sqlite3 *db, guint keep)
 {
-    char src[PATH_MAX];
-    char *orig_name = key;
-    sqlite3 *db = data;
-
+    int res = 0;
     const char *db_name = sqlite3_db_filename(db, "main");
-    const char *db_directory = g_path_get_dirname(db_name);
+    char *tmp_name = g_strdup_printf("%s%s.new", db_name, BKP_PART);
 
-    sprintf(src, "%s/%s", db_directory, orig_name);
-    unlink(src);
-    g_free((gpointer)db_directory);
-    return FALSE;
+    pthread_mutex_lock(&backup_lock);
+    int highest;
+    GTree *backups = _get_db_backups(db, &highest);
+    char *dest = g_strdup_printf("%s%s%03d", db_name, BKP_PART, highest + 1);
+
+    unlink(tmp_name);
+    int status = _backup_to(db, tmp_name);
+    if (status != SQLITE_OK)
+    {
+        error("Couldn't back up the database to %s. SQLite error code: %d", tmp_name, status);
+        unlink(tmp_name);
+        res = -1;
+    }
+    else if (rename(tmp_name, dest) != 0)
+    {
+        error("Couldn't rename %s to %s", tmp_name, dest);
+        unlink(tmp_name);
+        res = -1;
+    }
+    else
+    {
+        debug("Backed up the database to %s", dest);
+        if (keep > 0)
+        {
+            struct expire_data ed = { g_tree_nnodes(backups) + 1 - (int) keep };
+            g_tree_foreach(backups, _expire_backup, &ed);
+        }
+    }
+    pthread_mutex_unlock(&backup_lock);
+
+    g_tree_destroy(backups);
+    g_free(dest);
+    g_free(tmp_name);
+    return res;
 }
 
-GTree *get_db_backups (sqlite3 *db)
+int database_backup (sqlite3 *db)
 {
-    const char *db_name = sqlite3_db_filename(db, "main");
-    const char *db_directory = g_path_get_dirname(db_name);
-    const char *db_base = g_path_get_basename(db_name);
-    debug("directory_name = %s", db_directory);
+    return database_backup0(db, DATABASE_BACKUPS_KEPT);
+}
 
-    DIR *d = opendir(db_directory);
+static void *_backup_thread (void *data)
+{
+    DatabaseBackup *b = data;
+    b->res = database_backup0(b->db, b->keep);
+    return NULL;
+}
 
-    struct dirent *de = NULL;
-    GTree *database_names = g_tree_new_full(_name_cmp, NULL, g_free, NULL);
+DatabaseBackup *database_backup_start (sqlite3 *db, guint keep)
+{
+    DatabaseBackup *res = g_malloc0(sizeof(DatabaseBackup));
+    res->db = db;
+    res->keep = keep;
+    if (pthread_create(&res->thread, NULL, _backup_thread, res) != 0)
+    {
+        error("Couldn't start the thread for the backup");
+        g_free(res);
+        return NULL;
+    }
+    return res;
+}
 
-    while ((de = readdir(d)) != NULL)
+int database_backup_finish (DatabaseBackup *b)
+{
+    int res = 0;
+    if (b)
     {
-        char *dirent_name = de->d_name;
-        debug("dirent_name = %s", dirent_name);
-        if (strstr(dirent_name, db_base) == dirent_name)
-        {
-            g_tree_insert(database_names, g_strdup(dirent_name), NULL);
-        }
+        pthread_join(b->thread, NULL);
+        res = b->res;
+        g_free(b);
     }
-    closedir(d);
-    g_free((gpointer)db_directory);
-    g_free((gpointer)db_base);
-    return database_names;
+    return res;
+}
+
+static gboolean _unlink_backup (gpointer key, gpointer val, gpointer data)
+{
+    unlink(val);
+    return FALSE;
+}
+
+gboolean database_clear_backups (sqlite3 *db)
+{
+    GTree *backups = _get_db_backups(db, NULL);
+    g_tree_foreach(backups, _unlink_backup, NULL);
+    g_tree_destroy(backups);
+    return TRUE;
 }
 
 gboolean database_init(sqlite3 *db)
@@ -406,66 +795,6 @@ static int _set_version(sqlite3 *db)
     return res;
 }
 
-/* Copied from http://stackoverflow.com/a/2180788/638671 . Thanks to user 'caf'. */
-int cp (const char *from, const char *to)
-{
-    int fd_to, fd_from;
-    char buf[4096];
-    ssize_t nread;
-    int saved_errno;
-
-    fd_from = open(from, O_RDONLY);
-    if (fd_from < 0)
-        return -1;
-
-    fd_to = open(to, O_WRONLY | O_CREAT | O_EXCL, 0666);
-    if (fd_to < 0)
-        goto out_error;
-
-    while (nread = read(fd_from, buf, sizeof buf), nread > 0)
-    {
-        char *out_ptr = buf;
-        ssize_t nwritten;
-
-        do {
-            nwritten = write(fd_to, out_ptr, nread);
-
-            if (nwritten >= 0)
-            {
-                nread -= nwritten;
-                out_ptr += nwritten;
-            }
-            else if (errno != EINTR)
-            {
-                goto out_error;
-            }
-        } while (nread > 0);
-    }
-
-    if (nread == 0)
-    {
-        if (close(fd_to) < 0)
-        {
-            fd_to = -1;
-            goto out_error;
-        }
-        close(fd_from);
-
-        /* Success! */
-        return 0;
-    }
-
-  out_error:
-    saved_errno = errno;
-
-    close(fd_from);
-    if (fd_to >= 0)
-        close(fd_to);
-
-    errno = saved_errno;
-    return -1;
-}
-
 int _sql_prepare (sqlite3 *db, const char *command, sqlite3_stmt **stmtp, const char *file, int line_number)
 {
     int res = sqlite3_prepare_v2(db, command, -1, stmtp, NULL);
@@ -2,6 +2,8 @@
 #define _SQL_H_
 #include <glib.h>
 #include <sqlite3.h>
+#include <semaphore.h>
+#include <pthread.h>
 
 int _sql_exec(sqlite3 *db, char *cmd, const char *file, int line_number);
 int _sql_next_row(sqlite3_stmt *stmt, const char *file, int line_number);
@@ -12,14 +14,76 @@ int _sql_step (sqlite3_stmt *stmt, const char *file, int line_number);
 #define sql_next_row(__stmt) _sql_next_row(__stmt, __FILE__, __LINE__)
 #define sql_prepare(__db, __cmd, __stmt) _sql_prepare(__db, __cmd, &(__stmt), __FILE__, __LINE__)
 #define sql_step(__stmt) _sql_step(__stmt,__FILE__, __LINE__)
+/* Execution statistics for a prepared statement which is guarded by a
+ * semaphore. An execution is the time between sql_stmt_acquire and
+ * sql_stmt_release, so it includes binding and consuming the rows as well
+ * as sqlite3_step. The fields are only written while the semaphore is
+ * held.
+ */
+typedef struct
+{
+    guint64 executions;
+    guint64 rows;
+    /* Time spent in sql_stmt_acquire waiting for the semaphore */
+    guint64 wait_ns;
+    guint64 total_ns;
+    guint64 max_ns;
+    /* When the current execution started */
+    guint64 started;
+} sql_stmt_profile;
+
+void sql_stmt_acquire (sql_stmt_profile *p, sem_t *sem);
+void sql_stmt_release (sql_stmt_profile *p, sem_t *sem);
+/* Counts a row returned by the statement */
+#define sql_stmt_row(__p) __atomic_store_n(&(__p)->rows, (__p)->rows + 1, __ATOMIC_RELAXED)
+/* Appends a line for each executed statement to out. names are labels for
+ * the n statements in profiles */
+void sql_stmt_profiles_print (GString *out, const char *label, const char **names,
+        sql_stmt_profile *profiles, int n);
+
+/* Counts the full scans of tables and indexes in the query plans of the
+ * n statements in stmts, which may have NULLs. Each is appended to out,
+ * unless it's NULL, with the statement's label from names */
+int sql_stmts_full_scans (GString *out, const char *label, const char **names,
+        sqlite3_stmt **stmts, int n);
+
 void sql_begin_transaction(sqlite3 *db);
 void sql_commit(sqlite3 *db);
 sqlite3* sql_init (const char *db_fname);
 
 /* Returns TRUE if the database was successfully initialized, and FALSE otherwise */
 gboolean database_init(sqlite3 *db);
+
+/* Backs up the database to a new file named for it with BKP_PART and a
+ * number one more than the highest backup's, then removes the oldest
+ * backups, by modification time, so that no more than keep are left, or
+ * none if keep is 0.
+ *
+ * The backup is made with SQLite's backup API, DATABASE_BACKUP_PAGES pages
+ * at a time, and db is free for other threads between the batches, so it
+ * can be taken while the file system is in use. Returns 0 or -1 */
+int database_backup0 (sqlite3 *db, guint keep);
+/* database_backup0 keeping DATABASE_BACKUPS_KEPT. Done before upgrades */
 int database_backup (sqlite3 *db);
+
+/* A backup being taken in the background */
+typedef struct
+{
+    pthread_t thread;
+    sqlite3 *db;
+    guint keep;
+    int res;
+} DatabaseBackup;
+
+/* Starts database_backup0 in a thread. Returns NULL if it couldn't */
+DatabaseBackup *database_backup_start (sqlite3 *db, guint keep);
+/* Waits for b, which may be NULL, to finish and frees it. Returns what
+ * database_backup0 did */
+int database_backup_finish (DatabaseBackup *b);
 gboolean database_clear_backups (sqlite3 *db);
+/* Upgrades db to target_version. The version is set after each step, and
+ * tables are copied a batch at a time, so an upgrade which is interrupted
+ * carries on from where it was the next time */
 int try_upgrade_db0 (sqlite3 *db, int target_version);
 
 /* This is the database migration level. ANY change to the database migration scripts between published commits
@@ -27,12 +91,19 @@ int try_upgrade_db0 (sqlite3 *db, int target_version);
  * tables because it's being managed differently, even if the schema remains the same, the DB_VERSION must be
  * incremented.
  */
-#define DB_VERSION 4
+#define DB_VERSION 8
 /* The string version of DB_VERSION */
 #define xstr(s) str(s)
 #define str(s) #s
 #define DB_VERSION_S xstr(DB_VERSION)
 
 #define BKP_PART ".bkp"
+/* Pages copied in each step of a backup */
+#define DATABASE_BACKUP_PAGES 64
+/* Milliseconds a backup waits for a writer to finish */
+#define DATABASE_BACKUP_WAIT_MS 10
+#define DATABASE_BACKUPS_KEPT 10
+/* Rows moved in each transaction when an upgrade copies a table */
+#define UPGRADE_BATCH_ROWS 10000
 
 #endif /* _SQL_H_ */
@@ -0,0 +1,97 @@
+#include <string.h>
+#include "util.h"
+#include "stat_cache.h"
+
+StatCache *stat_cache_new (guint max_entries)
+{
+    StatCache *res = g_malloc0(sizeof(StatCache));
+    pthread_mutex_init(&res->lock, NULL);
+    res->stats = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    res->writers = g_hash_table_new(g_direct_hash, g_direct_equal);
+    res->max_entries = max_entries;
+    return res;
+}
+
+void stat_cache_destroy (StatCache *c)
+{
+    if (c)
+    {
+        g_hash_table_destroy(c->stats);
+        g_hash_table_destroy(c->writers);
+        pthread_mutex_destroy(&c->lock);
+        g_free(c);
+    }
+}
+
+gboolean stat_cache_lookup (StatCache *c, guint64 id, struct stat *st, guint64 *generation)
+{
+    pthread_mutex_lock(&c->lock);
+    struct stat *cached = g_hash_table_lookup(c->stats, TO_SP(id));
+    if (cached)
+    {
+        memcpy(st, cached, sizeof(struct stat));
+    }
+    *generation = c->generation;
+    pthread_mutex_unlock(&c->lock);
+    return cached != NULL;
+}
+
+gboolean stat_cache_insert (StatCache *c, guint64 id, const struct stat *st, guint64 generation)
+{
+    struct stat *copy = g_memdup(st, sizeof(struct stat));
+    gboolean inserted = FALSE;
+
+    pthread_mutex_lock(&c->lock);
+    if (generation == c->generation && !g_hash_table_lookup(c->writers, TO_SP(id)))
+    {
+        if (g_hash_table_size(c->stats) >= c->max_entries)
+        {
+            g_hash_table_remove_all(c->stats);
+        }
+        g_hash_table_insert(c->stats, TO_SP(id), copy);
+        copy = NULL;
+        inserted = TRUE;
+    }
+    pthread_mutex_unlock(&c->lock);
+    g_free(copy);
+    return inserted;
+}
+
+/* Must be called with the lock held */
+static void _invalidate (StatCache *c, guint64 id)
+{
+    c->generation++;
+    g_hash_table_remove(c->stats, TO_SP(id));
+}
+
+void stat_cache_invalidate (StatCache *c, guint64 id)
+{
+    pthread_mutex_lock(&c->lock);
+    _invalidate(c, id);
+    pthread_mutex_unlock(&c->lock);
+}
+
+void stat_cache_begin_write (StatCache *c, guint64 id)
+{
+    pthread_mutex_lock(&c->lock);
+    gulong n = TO_S(g_hash_table_lookup(c->writers, TO_SP(id)));
+    g_hash_table_insert(c->writers, TO_SP(id), TO_SP(n + 1));
+    _invalidate(c, id);
+    pthread_mutex_unlock(&c->lock);
+}
+
+void stat_cache_end_write (StatCache *c, guint64 id)
+{
+    pthread_mutex_lock(&c->lock);
+    gulong n = TO_S(g_hash_table_lookup(c->writers, TO_SP(id)));
+    if (n > 1)
+    {
+        g_hash_table_insert(c->writers, TO_SP(id), TO_SP(n - 1));
+    }
+    else
+    {
+        g_hash_table_remove(c->writers, TO_SP(id));
+    }
+    _invalidate(c, id);
+    pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,43 @@
+#ifndef STAT_CACHE_H
+#define STAT_CACHE_H
+#include <glib.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* The attributes of the files' copies by file ID, so that getattr and
+ * readdir don't lstat a copy each time they're asked about it.
+ *
+ * Operations which change a copy invalidate its entry, and nothing is
+ * cached for a file while it is open for writing. As for DirListingCache,
+ * lookups return a generation which inserts pass back, so that attributes
+ * read while a file was being changed aren't cached. When the cache is
+ * full it is emptied.
+ */
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    /* File IDs to struct stats */
+    GHashTable *stats;
+    /* File IDs to the number of times they're open for writing */
+    GHashTable *writers;
+    guint max_entries;
+    guint64 generation;
+} StatCache;
+
+StatCache *stat_cache_new (guint max_entries);
+void stat_cache_destroy (StatCache *c);
+
+/* Copies the attributes for id to st and returns TRUE if they're cached.
+ * Otherwise sets generation for a subsequent stat_cache_insert */
+gboolean stat_cache_lookup (StatCache *c, guint64 id, struct stat *st, guint64 *generation);
+/* Returns FALSE if the attributes weren't cached because id was changed or
+ * is open for writing */
+gboolean stat_cache_insert (StatCache *c, guint64 id, const struct stat *st, guint64 generation);
+void stat_cache_invalidate (StatCache *c, guint64 id);
+
+/* Bracket the time that a file is open for writing */
+void stat_cache_begin_write (StatCache *c, guint64 id);
+void stat_cache_end_write (StatCache *c, guint64 id);
+
+#endif /* STAT_CACHE_H */
@@ -0,0 +1,11 @@
+#ifndef STATS_FS_H
+#define STATS_FS_H
+#include <glib.h>
+#include "subfs.h"
+
+/* Serves the STATS_FH virtual file in the root of the mount. Each open takes
+ * a snapshot of the per-operation and per-SQL-statement statistics which is
+ * read back by later reads on that handle */
+extern subfs_component stats_fs_subfs;
+
+#endif /* STATS_FS_H */
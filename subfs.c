@@ -1,5 +1,6 @@
 #include "subfs.h"
 #include "tagdb_fs.h"
+#include "stats_fs.h"
 #include "search_fs.h"
 
 static int next_component_id = 0;
@@ -11,6 +12,8 @@ static void subfs_register_component (subfs_component *comp);
 void subfs_init (void)
 {
     subfs_comps = g_malloc0_n(sizeof(subfs_component*), 20);
+    /* tagdb_fs handles every path, so it has to come last */
+    subfs_register_component(&stats_fs_subfs);
     subfs_register_component(&tagdb_fs_subfs);
 }
 
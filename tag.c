@@ -54,9 +54,38 @@ Tag *new_tag (const char *name, int type, tagdb_value_t *def)
     else
         t->default_value = copy_value(default_value(type));
     t->children_by_name = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, NULL);
+    t->descendants = g_hash_table_new(g_direct_hash, g_direct_equal);
     return t;
 }
 
+/* Adds sub and its descendants to the descendants of t and of each tag
+ * above it */
+static void _closure_add (Tag *t, Tag *sub)
+{
+    for (Tag *a = t; a; a = tag_parent(a))
+    {
+        g_hash_table_insert(a->descendants, sub, sub);
+        HL (sub->descendants, it, d, v)
+        {
+            g_hash_table_insert(a->descendants, d, d);
+        } HL_END;
+    }
+}
+
+/* Takes sub and its descendants out of the descendants of t and of each
+ * tag above it */
+static void _closure_remove (Tag *t, Tag *sub)
+{
+    for (Tag *a = t; a; a = tag_parent(a))
+    {
+        g_hash_table_remove(a->descendants, sub);
+        HL (sub->descendants, it, d, v)
+        {
+            g_hash_table_remove(a->descendants, d);
+        } HL_END;
+    }
+}
+
 void tag_set_subtag0 (Tag *t, Tag *child);
 gboolean tag_set_subtag (Tag *t, Tag *child)
 {
@@ -92,9 +121,11 @@ void tag_set_subtag0 (Tag *t, Tag *child)
         if (current_parent)
         {
             g_hash_table_remove(current_parent->children_by_name, tag_name(child));
+            _closure_remove(current_parent, child);
         }
         tag_parent(child) = t;
         g_hash_table_insert(t->children_by_name, (gpointer) tag_name(child), child);
+        _closure_add(t, child);
     }
 }
 
@@ -139,6 +170,7 @@ void tag_remove_subtag_s0 (Tag *t, Tag *child)
     if (t == tag_parent(child))
     {
         g_hash_table_remove(t->children_by_name, tag_name(child));
+        _closure_remove(t, child);
         tag_parent(child) = NULL;
     }
     else
@@ -340,6 +372,11 @@ unsigned long tag_number_of_children(Tag *t)
     return g_hash_table_size(t->children_by_name);
 }
 
+gboolean tag_is_under (Tag *t, Tag *ancestor)
+{
+    return t == ancestor || g_hash_table_lookup_extended(ancestor->descendants, t, NULL, NULL);
+}
+
 void tag_set_name (Tag *t, const char *name)
 {
     Tag *parent = tag_parent(t);
@@ -490,6 +527,11 @@ void tag_destroy0 (Tag *t)
         assert(me == t);
 
         g_hash_table_remove(parent->children_by_name, tag_name(t));
+        /* Only t leaves the tags above it. Its children stay below them */
+        for (Tag *a = parent; a; a = tag_parent(a))
+        {
+            g_hash_table_remove(a->descendants, t);
+        }
         tag_parent(t) = NULL;
     }
 
@@ -516,5 +558,6 @@ void tag_destroy0 (Tag *t)
     abstract_file_destroy(&t->base);
     result_destroy(t->default_value);
     g_hash_table_destroy(t->children_by_name);
+    g_hash_table_destroy(t->descendants);
     g_free(t);
 }
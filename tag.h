@@ -27,6 +27,9 @@ typedef struct Tag
     struct Tag *parent;
     /* A map to child ids from tag names */
     GHashTable *children_by_name;
+    /* The tags below this one at any depth, as a set. Kept up as subtags
+     * are set and removed, like the tag_closure table */
+    GHashTable *descendants;
 } Tag;
 
 /* TagPathInfo is a list for which each entry is populated with the name of
@@ -121,6 +124,9 @@ char *tag_to_string (Tag *t, buffer_t buffer);
 char *tag_to_string1 (Tag *t, char *buffer, size_t buffer_size);
 void tag_set_name (Tag *t, const char *name);
 unsigned long tag_number_of_children(Tag *t);
+/* Whether t is ancestor or below it at any depth. A lookup in the
+ * descendants of ancestor, so it doesn't depend on how deep t is */
+gboolean tag_is_under (Tag *t, Tag *ancestor);
 #define tag_name(_t) abstract_file_get_name((AbstractFile*) _t)
 #define tag_id(_t) (((AbstractFile*)_t)->id)
 #define tag_parent(__t) (((Tag*)__t)->parent)
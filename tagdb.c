@@ -30,9 +30,32 @@ enum { NEWTAG ,
     REMSUB ,
     REMSUP ,
     REMSTA ,
+    SETATR ,
     NUMBER_OF_STMTS };
 #define STMT(_db,_i) ((_db)->sql_stmts[(_i)])
 #define STMT_SEM(_db,_i) (&((_db)->stmt_semas[(_i)]))
+#define STMT_PROFILE(_db,_i) (&((_db)->stmt_profiles[(_i)]))
+#define STMT_ACQUIRE(_db,_i) sql_stmt_acquire(STMT_PROFILE(_db,_i), STMT_SEM(_db,_i))
+#define STMT_RELEASE(_db,_i) sql_stmt_release(STMT_PROFILE(_db,_i), STMT_SEM(_db,_i))
+
+/* Labels for the statements in the profile output */
+static const char *stmt_names[NUMBER_OF_STMTS] = {
+    "NEWTAG",
+    "NEWFIL",
+    "RENFIL",
+    "RENTAG",
+    "DELFIL",
+    "DELTAG",
+    "STAGID",
+    "STAGNM",
+    "SFILID",
+    "SFILNM",
+    "SUBTAG",
+    "REMSUB",
+    "REMSUP",
+    "REMSTA",
+    "SETATR"
+};
 void _sqlite_newtag_stmt(TagDB *db, Tag *t);
 void _sqlite_newfile_stmt(TagDB *db, File *t);
 void _sqlite_rename_file_stmt(TagDB *db, File *f, const char *new_name);
@@ -43,6 +66,7 @@ void _sqlite_subtag_ins_stmt(TagDB *db, Tag *super, Tag *sub);
 void _sqlite_subtag_rem_sub(TagDB *db, Tag *sub);
 void _sqlite_subtag_rem_sup(TagDB *db, Tag *sup);
 void _sqlite_subtag_del_stmt(TagDB *db, Tag *super, Tag *sub);
+void _sqlite_set_attrs_stmt(TagDB *db, File *f);
 
 file_id_t tag_name_to_id (TagDB *db, const char *tag_name);
 /* retrieves a root tag by its name using the tag_codes table */
@@ -76,10 +100,79 @@ GList *tagdb_all_tags (TagDB *db)
     return g_hash_table_get_values(db->tags);
 }
 
+typedef struct
+{
+    tagdb_change_listener fn;
+    gpointer data;
+} change_listener;
+
+void tagdb_add_change_listener (TagDB *db, tagdb_change_listener fn, gpointer data)
+{
+    change_listener *l = g_malloc(sizeof(change_listener));
+    l->fn = fn;
+    l->data = data;
+    db->change_listeners = g_list_append(db->change_listeners, l);
+}
+
+static void _tagdb_changed (TagDB *db, file_id_t tag_id)
+{
+    LL(db->change_listeners, it)
+    {
+        change_listener *l = it->data;
+        l->fn(tag_id, l->data);
+    } LL_END;
+}
+
+/* Notifies the listeners of each of the tags of f, or of the root if it
+ * has none */
+static void _tagdb_file_changed (TagDB *db, File *f)
+{
+    if (!db->change_listeners)
+    {
+        return;
+    }
+
+    if (g_hash_table_size(file_tags(f)) == 0)
+    {
+        _tagdb_changed(db, UNTAGGED);
+    }
+    else
+    {
+        HL(file_tags(f), it, k, v)
+        {
+            _tagdb_changed(db, TO_S(k));
+        } HL_END;
+    }
+}
+
 void set_file_name (TagDB *db, File *f, const char *new_name)
 {
+    char *old_name = g_strdup(file_name(f));
     set_name(f, new_name);
     _sqlite_rename_file_stmt(db, f, new_name);
+    file_cabinet_rename_file(db->files, f, old_name);
+    g_free(old_name);
+    _tagdb_file_changed(db, f);
+}
+
+void tagdb_file_set_attrs (TagDB *db, File *f, const struct stat *st)
+{
+    file_set_attrs(f, st);
+    _sqlite_set_attrs_stmt(db, f);
+}
+
+gboolean tagdb_path_is_under (TagDB *db, const char *tag_path, Tag *t)
+{
+    /* The part of the path that isn't there yet would be made under the
+     * last tag on it that is */
+    char *s = g_strdup(tag_path);
+    Tag *last = lookup_tag(db, s);
+    while (!last && tag_path_split_right1(s))
+    {
+        last = lookup_tag(db, s);
+    }
+    g_free(s);
+    return last && tag_is_under(last, t);
 }
 
 void set_tag_name (TagDB *db, Tag *t, const char *new_name)
@@ -90,6 +183,12 @@ void set_tag_name (TagDB *db, Tag *t, const char *new_name)
     {
         return;
     }
+    /* Nor move a tag below itself */
+    if (tagdb_path_is_under(db, new_name, t))
+    {
+        warn("set_tag_name: %s is below the tag being renamed", new_name);
+        return;
+    }
 
     if (!tag_parent(t))
     {
@@ -115,6 +214,7 @@ void set_tag_name (TagDB *db, Tag *t, const char *new_name)
         g_hash_table_insert(db->tag_codes, (gpointer) tag_name(t), TO_SP(tag_id(t)));
     }
     _sqlite_rename_tag_stmt(db, t, tag_path_base_name);
+    _tagdb_changed(db, TAGDB_ALL_TAGS);
 
     g_free(s);
 }
@@ -122,6 +222,7 @@ void set_tag_name (TagDB *db, Tag *t, const char *new_name)
 void remove_file (TagDB *db, File *f)
 {
     file_cabinet_remove_all(db->files, f);
+    _tagdb_file_changed(db, f);
 }
 
 TagBucket *tag_bucket_new ()
@@ -240,6 +341,20 @@ void tagdb_end_transaction (TagDB *db)
     sql_commit(db->sqldb);
 }
 
+void tagdb_print_stmt_profiles (TagDB *db, GString *out)
+{
+    g_string_append_printf(out, "%-12s %-8s %10s %10s %12s %12s %10s %10s\n",
+            "owner", "stmt", "executions", "rows", "wait_ns", "total_ns", "mean_ns", "max_ns");
+    sql_stmt_profiles_print(out, "tagdb", stmt_names, db->stmt_profiles, NUMBER_OF_STMTS);
+    file_cabinet_print_stmt_profiles(db->files, out);
+}
+
+int tagdb_full_scans (TagDB *db, GString *out)
+{
+    return sql_stmts_full_scans(out, "tagdb", stmt_names, db->sql_stmts, NUMBER_OF_STMTS)
+        + file_cabinet_full_scans(db->files, out);
+}
+
 void insert_tag (TagDB *db, Tag *t)
 {
     Tag *preexisting_tag = retrieve_root_tag_by_name(db, tag_name(t));
@@ -265,6 +380,8 @@ void insert_tag (TagDB *db, Tag *t)
     }
     tag_bucket_insert(db, t);
     _sqlite_newtag_stmt(db, t);
+    /* A new tag has no files yet, so it only shows up in the root */
+    _tagdb_changed(db, UNTAGGED);
 }
 
 void tagdb_tag_set_subtag (TagDB *db, Tag *sup, Tag *sub)
@@ -274,6 +391,12 @@ void tagdb_tag_set_subtag (TagDB *db, Tag *sup, Tag *sub)
         return;
     }
 
+    if (tag_is_under(sup, sub))
+    {
+        warn("tagdb_tag_set_subtag: %s is below %s already", tag_name(sup), tag_name(sub));
+        return;
+    }
+
     if (!tag_parent(sub))
     {
         /* If the subtag is a root tag, then we have to clear its root status */
@@ -313,6 +436,7 @@ void delete_file (TagDB *db, File *f)
      */
     file_cabinet_remove_all(db->files, f);
     _sqlite_delete_file_stmt(db, f);
+    _tagdb_file_changed(db, f);
     /* file_cabinet_delete_file deletes the file
      * data, so it has to be last
      */
@@ -335,6 +459,7 @@ void insert_file (TagDB *db, File *f)
 
     file_cabinet_insert_v(db->files, key, f);
     key_destroy(key);
+    _tagdb_file_changed(db, f);
 }
 
 File *retrieve_file (TagDB *db, file_id_t id)
@@ -348,6 +473,11 @@ GList *tagdb_tag_files(TagDB *db, Tag *t)
 
 }
 
+GList *tagdb_tag_subtree_files (TagDB *db, Tag *t)
+{
+    return file_cabinet_get_subtree_files(db->files, tag_id(t));
+}
+
 File *tagdb_lookup_file (TagDB *db, tagdb_key_t keys, const char *name)
 {
     if (!keys)
@@ -357,6 +487,16 @@ File *tagdb_lookup_file (TagDB *db, tagdb_key_t keys, const char *name)
     return file_cabinet_lookup_file(db->files, keys, name);
 }
 
+GArray *tagdb_file_name_collisions (TagDB *db, file_id_t tag_id, const char *name)
+{
+    return file_cabinet_name_collisions(db->files, tag_id, name);
+}
+
+GArray *tagdb_untagged_name_collisions (TagDB *db, const char *name)
+{
+    return file_cabinet_untagged_name_collisions(db->files, name);
+}
+
 Tag *retrieve_tag (TagDB *db, file_id_t id)
 {
     return (Tag*) g_hash_table_lookup(db->tags, TO_SP(id));
@@ -425,6 +565,18 @@ int delete_tag0 (TagDB *db, Tag *t)
         }LL_END;
         _sqlite_subtag_rem_sup(db, t);
     }
+    else
+    {
+        /* The children are moved up to the parent in tag_destroy, so
+         * their subtag rows, and the closure with them, follow here */
+        Tag *parent = tag_parent(t);
+        _sqlite_subtag_del_stmt(db, parent, t);
+        _sqlite_subtag_rem_sup(db, t);
+        LL(children, it)
+        {
+            _sqlite_subtag_ins_stmt(db, parent, it->data);
+        }LL_END;
+    }
 
     _sqlite_delete_tag_stmt(db, t);
 
@@ -437,6 +589,7 @@ int delete_tag0 (TagDB *db, Tag *t)
     }
 
     g_list_free(children);
+    _tagdb_changed(db, TAGDB_ALL_TAGS);
 
     return res;
 }
@@ -508,8 +661,10 @@ Tag *lookup_tag (TagDB *db, const char *tag_name)
 
 void remove_tag_from_file (TagDB *db, File *f, file_id_t tag_id)
 {
+    _tagdb_file_changed(db, f);
     file_remove_tag(f, tag_id);
     file_cabinet_remove(db->files, tag_id, f);
+    _tagdb_file_changed(db, f);
 }
 
 void add_tag_to_file (TagDB *db, File *f, file_id_t tag_id, tagdb_value_t *v)
@@ -534,8 +689,10 @@ void add_tag_to_file (TagDB *db, File *f, file_id_t tag_id, tagdb_value_t *v)
     {
         v = copy_value(v);
     }
+    _tagdb_file_changed(db, f);
     file_add_tag(f, tag_id, v);
     file_cabinet_insert (db->files, tag_id, f);
+    _tagdb_file_changed(db, f);
 }
 
 void tagdb_save (TagDB *db, const char *db_fname)
@@ -585,6 +742,7 @@ void tagdb_destroy (TagDB *db)
      */
     g_hash_table_destroy(db->tags);
     g_hash_table_destroy(db->tag_codes);
+    g_list_free_full(db->change_listeners, g_free);
     g_free(db);
 }
 
@@ -593,7 +751,7 @@ void _sqlite_newtag_stmt(TagDB *db, Tag *t)
     /* This function is idempotent with respect to the data */
 
     sqlite3_stmt *stmt = STMT(db, NEWTAG);
-    sem_wait(STMT_SEM(db, NEWTAG));
+    STMT_ACQUIRE(db, NEWTAG);
     sqlite3_reset(stmt);
     sqlite3_bind_int(stmt, 1, tag_id(t));
     /* XXX: Tag name is transient because tags may be destroyed
@@ -602,13 +760,13 @@ void _sqlite_newtag_stmt(TagDB *db, Tag *t)
      */
     sqlite3_bind_text(stmt, 2, tag_name(t), -1, SQLITE_TRANSIENT);
     sqlite3_step(stmt);
-    sem_post(STMT_SEM(db, NEWTAG));
+    STMT_RELEASE(db, NEWTAG);
 }
 
 void _sqlite_newfile_stmt(TagDB *db, File *t)
 {
     sqlite3_stmt *stmt = STMT(db, NEWFIL);
-    sem_wait(STMT_SEM(db, NEWFIL));
+    STMT_ACQUIRE(db, NEWFIL);
     sqlite3_reset(stmt);
     sqlite3_bind_int(stmt, 1, file_id(t));
     /* XXX: Tag name is transient because tags may be destroyed
@@ -617,91 +775,119 @@ void _sqlite_newfile_stmt(TagDB *db, File *t)
      */
     sqlite3_bind_text(stmt, 2, file_name(t), -1, SQLITE_TRANSIENT);
     sqlite3_step(stmt);
-    sem_post(STMT_SEM(db, NEWFIL));
+    STMT_RELEASE(db, NEWFIL);
 }
 
 void _sqlite_delete_file_stmt(TagDB *db, File *f)
 {
     sqlite3_stmt *stmt = STMT(db, DELFIL);
-    sem_wait(STMT_SEM(db, DELFIL));
+    STMT_ACQUIRE(db, DELFIL);
     sqlite3_reset(stmt);
     sqlite3_bind_int(stmt, 1, file_id(f));
     sqlite3_step(stmt);
-    sem_post(STMT_SEM(db, DELFIL));
+    STMT_RELEASE(db, DELFIL);
 }
 
 void _sqlite_delete_tag_stmt(TagDB *db, Tag *t)
 {
     sqlite3_stmt *stmt = STMT(db, DELTAG);
-    sem_wait(STMT_SEM(db, DELTAG));
+    STMT_ACQUIRE(db, DELTAG);
     sqlite3_reset(stmt);
     sqlite3_bind_int(stmt, 1, tag_id(t));
     sqlite3_step(stmt);
-    sem_post(STMT_SEM(db, DELTAG));
+    STMT_RELEASE(db, DELTAG);
 }
 
 void _sqlite_rename_file_stmt(TagDB *db, File *f, const char *new_name)
 {
     sqlite3_stmt *stmt = STMT(db, RENFIL);
-    sem_wait(STMT_SEM(db, RENFIL));
+    STMT_ACQUIRE(db, RENFIL);
     sqlite3_reset(stmt);
     sqlite3_bind_text(stmt, 1, new_name, -1, SQLITE_TRANSIENT);
     sqlite3_bind_int(stmt, 2, file_id(f));
     sqlite3_step(stmt);
-    sem_post(STMT_SEM(db, RENFIL));
+    STMT_RELEASE(db, RENFIL);
 }
 
 void _sqlite_rename_tag_stmt(TagDB *db, Tag *t, const char *new_name)
 {
     sqlite3_stmt *stmt = STMT(db, RENTAG);
-    sem_wait(STMT_SEM(db, RENTAG));
+    STMT_ACQUIRE(db, RENTAG);
     sqlite3_reset(stmt);
     sqlite3_bind_text(stmt, 1, new_name, -1, SQLITE_TRANSIENT);
     sqlite3_bind_int(stmt, 2, tag_id(t));
     sqlite3_step(stmt);
-    sem_post(STMT_SEM(db, RENTAG));
+    STMT_RELEASE(db, RENTAG);
 }
 
 void _sqlite_subtag_ins_stmt(TagDB *db, Tag *super, Tag *sub)
 {
     sqlite3_stmt *stmt = STMT(db, SUBTAG);
-    sem_wait(STMT_SEM(db, SUBTAG));
+    STMT_ACQUIRE(db, SUBTAG);
     sqlite3_reset(stmt);
     sqlite3_bind_int(stmt, 1, tag_id(super));
     sqlite3_bind_int(stmt, 2, tag_id(sub));
     sqlite3_step(stmt);
-    sem_post(STMT_SEM(db, SUBTAG));
+    STMT_RELEASE(db, SUBTAG);
 }
 
 void _sqlite_subtag_rem_sub(TagDB *db, Tag *sub)
 {
     sqlite3_stmt *stmt = STMT(db, REMSUB);
-    sem_wait(STMT_SEM(db, REMSUB));
+    STMT_ACQUIRE(db, REMSUB);
     sqlite3_reset(stmt);
     sqlite3_bind_int(stmt, 1, tag_id(sub));
     sqlite3_step(stmt);
-    sem_post(STMT_SEM(db, REMSUB));
+    STMT_RELEASE(db, REMSUB);
 }
 
 void _sqlite_subtag_rem_sup(TagDB *db, Tag *sup)
 {
     sqlite3_stmt *stmt = STMT(db, REMSUP);
-    sem_wait(STMT_SEM(db, REMSUP));
+    STMT_ACQUIRE(db, REMSUP);
     sqlite3_reset(stmt);
     sqlite3_bind_int(stmt, 1, tag_id(sup));
     sqlite3_step(stmt);
-    sem_post(STMT_SEM(db, REMSUP));
+    STMT_RELEASE(db, REMSUP);
 }
 
 void _sqlite_subtag_del_stmt (TagDB *db, Tag *super, Tag *sub)
 {
     sqlite3_stmt *stmt = STMT(db, REMSTA);
-    sem_wait(STMT_SEM(db, REMSTA));
+    STMT_ACQUIRE(db, REMSTA);
     sqlite3_reset(stmt);
     sqlite3_bind_int(stmt, 1, tag_id(super));
     sqlite3_bind_int(stmt, 2, tag_id(sub));
     sqlite3_step(stmt);
-    sem_post(STMT_SEM(db, REMSTA));
+    STMT_RELEASE(db, REMSTA);
+}
+
+void _sqlite_set_attrs_stmt (TagDB *db, File *f)
+{
+    FileAttrs *a = &f->attrs;
+    sqlite3_stmt *stmt = STMT(db, SETATR);
+    STMT_ACQUIRE(db, SETATR);
+    sqlite3_reset(stmt);
+    if (a->valid)
+    {
+        sqlite3_bind_int64(stmt, 1, a->size);
+        sqlite3_bind_int(stmt, 2, a->mode);
+        sqlite3_bind_int64(stmt, 3, a->uid);
+        sqlite3_bind_int64(stmt, 4, a->gid);
+        sqlite3_bind_int64(stmt, 5, a->atime);
+        sqlite3_bind_int64(stmt, 6, a->mtime);
+        sqlite3_bind_int64(stmt, 7, a->ctime);
+    }
+    else
+    {
+        for (int i = 1; i <= 7; i++)
+        {
+            sqlite3_bind_null(stmt, i);
+        }
+    }
+    sqlite3_bind_int64(stmt, 8, file_id(f));
+    sqlite3_step(stmt);
+    STMT_RELEASE(db, SETATR);
 }
 
 TagDB *tagdb_new (const char *db_fname)
@@ -767,6 +953,9 @@ TagDB *tagdb_new1 (sqlite3 *sqldb, int flags)
     sql_prepare(db->sqldb, "update or ignore file set name = ? where id = ?", STMT(db,RENFIL));
     /* rename tag statement */
     sql_prepare(db->sqldb, "update or ignore tag set name = ? where id = ?", STMT(db,RENTAG));
+    /* record file attributes statement */
+    sql_prepare(db->sqldb, "update file set size = ?, mode = ?, uid = ?, gid = ?,"
+            " atime = ?, mtime = ?, ctime = ? where id = ?", STMT(db,SETATR));
 
     /* lookup tag by id statement */
     sql_prepare(db->sqldb, "select name from tag where id = ?", STMT(db,STAGID));
@@ -802,7 +991,8 @@ void _tagdb_init_files(TagDB *db)
 {
     /* Reads in the files from the sql database */
     sqlite3_stmt *stmt;
-    sql_prepare(db->sqldb, "select distinct * from file", stmt);
+    sql_prepare(db->sqldb, "select distinct id, name, size, mode, uid, gid,"
+            " atime, mtime, ctime from file", stmt);
     sqlite3_reset(stmt);
     while (sql_next_row(stmt) == SQLITE_ROW)
     {
@@ -810,6 +1000,18 @@ void _tagdb_init_files(TagDB *db)
         const unsigned char* name = sqlite3_column_text(stmt, 1);
         File *f = new_file((const char*)name);
         file_id(f) = id;
+        /* The attributes are NULL until they're first recorded */
+        if (sqlite3_column_type(stmt, 3) != SQLITE_NULL)
+        {
+            f->attrs.valid = TRUE;
+            f->attrs.size = sqlite3_column_int64(stmt, 2);
+            f->attrs.mode = sqlite3_column_int(stmt, 3);
+            f->attrs.uid = sqlite3_column_int64(stmt, 4);
+            f->attrs.gid = sqlite3_column_int64(stmt, 5);
+            f->attrs.atime = sqlite3_column_int64(stmt, 6);
+            f->attrs.mtime = sqlite3_column_int64(stmt, 7);
+            f->attrs.ctime = sqlite3_column_int64(stmt, 8);
+        }
         if (db->file_max_id < id)
             db->file_max_id = id;
         g_hash_table_insert(db->files_by_id, TO_SP(file_id(f)), f);
@@ -1,6 +1,7 @@
 #ifndef TAGDB_H
 #define TAGDB_H
 #include <glib.h>
+#include <semaphore.h>
 #include "sql.h"
 #include "types.h"
 #include "file_cabinet.h"
@@ -14,6 +15,12 @@
 
 typedef GHashTable TagBucket;
 
+/* Called after a change to the TagDB which may change what is listed in
+ * the directories whose keys contain tag_id. UNTAGGED stands for the root
+ * directory and TAGDB_ALL_TAGS for every directory */
+typedef void (*tagdb_change_listener) (file_id_t tag_id, gpointer data);
+#define TAGDB_ALL_TAGS ((file_id_t) -1)
+
 typedef struct TagDB
 {
     /* The tables which store File objects and Tag objects each.
@@ -41,6 +48,10 @@ typedef struct TagDB
      */
     sem_t stmt_semas[16];
 
+    /* Execution statistics for the prepared statements
+     */
+    sql_stmt_profile stmt_profiles[16];
+
     /* The file name of the database.
      */
     char *sqlite_db_fname;
@@ -62,6 +73,9 @@ typedef struct TagDB
 
     /* Flag for mt locking */
     int locked;
+
+    /* The registered tagdb_change_listeners */
+    GList *change_listeners;
 } TagDB;
 
 /* tagdb_new and tagdb_new0 do database initialization as well.
@@ -82,7 +96,16 @@ void tagdb_destroy (TagDB *db);
    Sets the file id if it hasn't been set (i.e. equals 0) */
 void insert_file (TagDB *db, File *f);
 void set_file_name (TagDB *db, File *f, const char *new_name);
+/* Renames t to the tag path new_name, moving it under the tags on that
+ * path. Does nothing if the path names a tag already or would put t below
+ * itself */
 void set_tag_name (TagDB *db, Tag *t, const char *new_name);
+/* Whether the tag at tag_path, or the tags it would be made under, are t
+ * or below it */
+gboolean tagdb_path_is_under (TagDB *db, const char *tag_path, Tag *t);
+/* Records the attributes of f's copy in st, or forgets them if st is NULL,
+   both on f and in the database, so they're known on the next load */
+void tagdb_file_set_attrs (TagDB *db, File *f, const struct stat *st);
 
 void remove_tag_from_file (TagDB *db, File *f, file_id_t tag_id);
 /* Adds a tag to a file with the given value for the tag.
@@ -98,6 +121,12 @@ void remove_tag_from_file (TagDB *db, File *f, file_id_t tag_id);
 /* Retrieves a File from the TagDB which has the given tags and name */
 File *tagdb_lookup_file (TagDB *db, tagdb_key_t keys, const char *name);
 
+/* Returns the IDs of the files with the tag named name if there is more than
+ * one, or NULL otherwise. Free with g_array_free */
+GArray *tagdb_file_name_collisions (TagDB *db, file_id_t tag_id, const char *name);
+/* tagdb_file_name_collisions for the untagged files */
+GArray *tagdb_untagged_name_collisions (TagDB *db, const char *name);
+
 /* Retrieve file by id */
 File *retrieve_file (TagDB *db, file_id_t id);
 
@@ -133,6 +162,9 @@ File *tagdb_make_file(TagDB *db, const char *file_name);
 
 /* Returns the files associated to a tag */
 GList *tagdb_tag_files(TagDB *db, Tag *t);
+/* Returns the files associated to a tag or to any of its subtags */
+GList *tagdb_tag_subtree_files (TagDB *db, Tag *t);
+
 
 void tagdb_tag_set_subtag(TagDB *db, Tag *sup, Tag *sub);
 
@@ -141,8 +173,18 @@ GList *tagdb_tag_ids (TagDB *db);
 GList *tagdb_tags (TagDB *db);
 
 GList *tagdb_untagged_items (TagDB *db);
+
+/* Registers fn to be called with data on each change */
+void tagdb_add_change_listener (TagDB *db, tagdb_change_listener fn, gpointer data);
 GList *tagdb_all_files (TagDB *db);
 
+/* Appends the execution statistics of the TagDB's and its FileCabinet's
+ * prepared statements to out */
+void tagdb_print_stmt_profiles (TagDB *db, GString *out);
+/* Appends the full scans in the query plans of the TagDB's and its
+ * FileCabinet's statements to out and returns how many there are */
+int tagdb_full_scans (TagDB *db, GString *out);
+
 void tagdb_begin_transaction (TagDB *db);
 void tagdb_end_transaction (TagDB *db);
 
@@ -3,6 +3,7 @@
 #include <glib.h>
 #include "subfs.h"
 #include "tagdb.h"
+#include "dir_listing.h"
 
 /* Translates the path into a NULL-terminated
    vector of Tag IDs, the key format for
@@ -14,6 +15,14 @@ File *path_to_file (const char *path);
 /* Shortcut for realpath */
 char *get_file_copies_path (const char *path);
 
+/* getattr for a file found by its ID rather than a path. The ID is the
+ * st_ino which getattr gives for the file */
+int tagdb_fs_file_getattr (file_id_t id, struct stat *statbuf);
+
+/* Makes a cache for the directory listings which the TagDB keeps up to
+ * date */
+DirListingCache *tagdb_fs_listing_cache_new (TagDB *db, gsize max_bytes);
+
 extern subfs_component tagdb_fs_subfs;
 
 #endif /* TAGDB_FS_H */
@@ -5,6 +5,9 @@
 #include "tagdb.h"
 
 GList *get_files_list (TagDB *db, tagdb_key_t key);
+/* The files of get_files_list with IDs from from on, in order, and no more
+ * than limit of them */
+GList *get_files_list_from (TagDB *db, tagdb_key_t key, file_id_t from, int limit);
 GList *get_tags_list (TagDB *db, tagdb_key_t key);
 
 #endif /* TAGDB_UTIL_H */
@@ -5,16 +5,40 @@
 #include "tagdb.h"
 #include "stage.h"
 #include "search_fs.h"
+#include "dir_listing.h"
+#include "stat_cache.h"
+#include "copies.h"
+#include "dedup.h"
+#include "sql.h"
 
 struct tagfs_state
 {
     char *copiesdir;
+    /* The content of the files, in copiesdir */
+    Copies *copies;
+    /* Shares the copies of files with the same content, or NULL */
+    Dedup *dedup;
+    /* The backup of the database taken when mounted, or NULL */
+    DatabaseBackup *backup;
     char *log_file;
     TagDB *db;
     Stage *stage;
     /* The result from the last search performed
        a list of files */
     SearchList *search_results;
+    /* Cached directory listings for tagdb_fs */
+    DirListingCache *listings;
+    /* Cached attributes of the files' copies */
+    StatCache *attrs;
+    /* Whether the kernel may keep the data of files it has cached when
+     * they're opened again. Only safe when a file has a single inode */
+    gboolean keep_cache;
+    /* Files at least this many bytes, or with the tag named direct_io_tag,
+     * are opened with direct I/O so that reads and writes bypass the
+     * kernel's page cache and go straight to the copies. 0 and NULL turn
+     * those off */
+    off_t direct_io_size;
+    char *direct_io_tag;
 };
 
 gboolean tagfs_is_consistent ();
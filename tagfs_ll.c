@@ -0,0 +1,1103 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "params.h"
+#include <fuse_lowlevel.h>
+#include "util.h"
+#include "log.h"
+#include "key.h"
+#include "abstract_file.h"
+#include "op_stats.h"
+#include "op_trace.h"
+#include "subfs.h"
+#include "tagdb_fs.h"
+#include "fs_util.h"
+#include "tagfs_ll.h"
+
+__thread struct fuse_context *tagfs_ll_context = NULL;
+static __thread struct fuse_context thread_context;
+
+typedef struct ll_node ll_node;
+
+/* A name in a directory which the kernel has looked up */
+typedef struct
+{
+    ll_node *parent;
+    char *name;
+    ll_node *node;
+} ll_name;
+
+struct ll_node
+{
+    fuse_ino_t ino;
+    /* The path of a directory, or a path for a file which stays valid for
+     * as long as the file exists, whichever names it has */
+    char *path;
+    /* The ID of the TagDB file the node is for, or 0 if it's anything else */
+    file_id_t file;
+    /* The key of a TagDB directory, or NULL */
+    tagdb_key_t key;
+    /* Lookups which the kernel hasn't forgotten yet */
+    guint64 nlookup;
+    /* The ll_names which refer to this node */
+    GSList *names;
+    /* For directories: name -> ll_name for the entries looked up in them,
+     * and the names which we told the kernel don't exist */
+    GHashTable *children;
+    GHashTable *negatives;
+    /* Whether the directory is waiting for the notification thread */
+    gboolean queued;
+};
+
+/* An invalidation for the notification thread to send: an entry, or the
+ * inode itself if name is NULL */
+typedef struct
+{
+    fuse_ino_t ino;
+    char *name;
+} ll_notice;
+
+static struct
+{
+    struct fuse_operations *ops;
+    struct tagfs_state *data;
+    struct fuse_chan *ch;
+    double entry_timeout;
+    double attr_timeout;
+    double negative_timeout;
+    pthread_mutex_t lock;
+    /* fuse_ino_t -> ll_node */
+    GHashTable *nodes;
+    /* file_id_t -> ll_node, so a file has one inode under all of its names
+     * and the kernel's caches of it stay coherent */
+    GHashTable *files;
+    /* tag ID -> set of the directory nodes whose keys have the tag */
+    GHashTable *dirs_by_tag;
+    fuse_ino_t next_ino;
+    /* Inodes of directories whose entries need invalidating */
+    GArray *pending;
+    pthread_cond_t notify_cond;
+    pthread_t notify_thread;
+    gboolean stop;
+} ll;
+
+#define LL_CALL(_op, ...) (ll.ops->_op ? ll.ops->_op(__VA_ARGS__) : -ENOSYS)
+
+/* These must be called with the lock held */
+static ll_node *_node (fuse_ino_t ino)
+{
+    return g_hash_table_lookup(ll.nodes, &ino);
+}
+
+static ll_name *_child (ll_node *parent, const char *name)
+{
+    return parent->children ? g_hash_table_lookup(parent->children, name) : NULL;
+}
+
+static void _unbind (ll_name *nm)
+{
+    g_hash_table_remove(nm->parent->children, nm->name);
+    nm->node->names = g_slist_remove(nm->node->names, nm);
+    g_free(nm->name);
+    g_free(nm);
+}
+
+static void _bind (ll_node *parent, const char *name, ll_node *node)
+{
+    ll_name *nm = _child(parent, name);
+    if (nm && nm->node == node)
+    {
+        return;
+    }
+    if (nm)
+    {
+        _unbind(nm);
+    }
+
+    if (!parent->children)
+    {
+        parent->children = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+    nm = g_malloc(sizeof(ll_name));
+    nm->parent = parent;
+    nm->name = g_strdup(name);
+    nm->node = node;
+    g_hash_table_insert(parent->children, nm->name, nm);
+    node->names = g_slist_prepend(node->names, nm);
+
+    if (parent->negatives)
+    {
+        g_hash_table_remove(parent->negatives, name);
+    }
+}
+
+static GHashTable *_dirs_with_tag (key_elem_t tag, gboolean create)
+{
+    GHashTable *res = g_hash_table_lookup(ll.dirs_by_tag, TO_SP(tag));
+    if (!res && create)
+    {
+        res = g_hash_table_new(g_direct_hash, g_direct_equal);
+        g_hash_table_insert(ll.dirs_by_tag, TO_SP(tag), res);
+    }
+    return res;
+}
+
+/* Files in the root are the untagged ones */
+#define DIR_TAG_LOOP(key, tag) \
+    for (int _i = 0, _empty = key_is_empty(key); _empty ? _i == 0 : key_ref(key, _i) != 0; _i++) \
+    { \
+        key_elem_t tag = _empty ? UNTAGGED : key_ref(key, _i);
+#define DIR_TAG_LOOP_END }
+
+static void _index_dir (ll_node *n)
+{
+    DIR_TAG_LOOP(n->key, tag)
+    {
+        g_hash_table_insert(_dirs_with_tag(tag, TRUE), n, n);
+    } DIR_TAG_LOOP_END
+}
+
+static void _unindex_dir (ll_node *n)
+{
+    DIR_TAG_LOOP(n->key, tag)
+    {
+        GHashTable *dirs = _dirs_with_tag(tag, FALSE);
+        if (dirs)
+        {
+            g_hash_table_remove(dirs, n);
+        }
+    } DIR_TAG_LOOP_END
+}
+
+static ll_node *_node_new (const char *path)
+{
+    ll_node *n = g_malloc0(sizeof(ll_node));
+    n->ino = ll.next_ino++;
+    n->path = g_strdup(path);
+    g_hash_table_insert(ll.nodes, &n->ino, n);
+    return n;
+}
+
+static void _node_free (ll_node *n)
+{
+    while (n->names)
+    {
+        _unbind(n->names->data);
+    }
+    if (n->children)
+    {
+        GList *children = g_hash_table_get_values(n->children);
+        LL(children, it)
+        {
+            _unbind(it->data);
+        } LL_END;
+        g_list_free(children);
+        g_hash_table_destroy(n->children);
+    }
+    if (n->negatives)
+    {
+        g_hash_table_destroy(n->negatives);
+    }
+    if (n->file)
+    {
+        g_hash_table_remove(ll.files, TO_SP(n->file));
+    }
+    if (n->key)
+    {
+        _unindex_dir(n);
+        key_destroy(n->key);
+    }
+    g_hash_table_remove(ll.nodes, &n->ino);
+    g_free(n->path);
+    g_free(n);
+}
+
+/* Returns a copy of the path of the inode and the ID of its file, or NULL
+ * if there's no such inode */
+static char *_node_path (fuse_ino_t ino, file_id_t *file)
+{
+    char *res = NULL;
+    pthread_mutex_lock(&ll.lock);
+    ll_node *n = _node(ino);
+    if (n)
+    {
+        res = g_strdup(n->path);
+        if (file)
+        {
+            *file = n->file;
+        }
+    }
+    pthread_mutex_unlock(&ll.lock);
+    return res;
+}
+
+static char *_child_path (fuse_ino_t parent, const char *name)
+{
+    char *res = NULL;
+    pthread_mutex_lock(&ll.lock);
+    ll_node *n = _node(parent);
+    if (n)
+    {
+        res = (strcmp(n->path, "/") == 0) ?
+            g_strconcat("/", name, NULL) :
+            g_strconcat(n->path, "/", name, NULL);
+    }
+    pthread_mutex_unlock(&ll.lock);
+    return res;
+}
+
+/* Makes the caller of the request and our state what the operations see
+ * through TAGFS_CONTEXT */
+static void _begin (fuse_req_t req)
+{
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    thread_context.uid = ctx->uid;
+    thread_context.gid = ctx->gid;
+    thread_context.pid = ctx->pid;
+    thread_context.private_data = ll.data;
+    tagfs_ll_context = &thread_context;
+}
+
+static void _reply_status (fuse_req_t req, int res)
+{
+    fuse_reply_err(req, (res < 0) ? -res : 0);
+}
+
+static int _getattr (const char *path, file_id_t file, struct stat *st)
+{
+    memset(st, 0, sizeof(struct stat));
+    if (file)
+    {
+        /* Files don't need their path resolved again, but the call is
+         * recorded as the dispatcher would have */
+        guint64 start = monotonic_time_ns();
+        int res = tagdb_fs_file_getattr(file, st);
+        guint64 elapsed = monotonic_time_ns() - start;
+        op_stats_record(OP_GETATTR, elapsed, res);
+        if (op_trace_recording)
+        {
+            op_trace_record(OP_GETATTR, path, NULL, 0, 0, start, elapsed, res);
+        }
+        return res;
+    }
+    return LL_CALL(getattr, path, st);
+}
+
+/* Resolves name in parent and counts a lookup of the node for it. If
+ * negative is set, a name which doesn't exist gets an entry with inode 0,
+ * which the kernel caches as such */
+static int _lookup (fuse_ino_t parent, const char *name, struct fuse_entry_param *e,
+        gboolean negative)
+{
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    char *path = _child_path(parent, name);
+    if (!path)
+    {
+        return -ENOENT;
+    }
+
+    int res = _getattr(path, 0, &e->attr);
+    gboolean ours = (subfs_get_opstruct(path) == &tagdb_fs_subfs.operations);
+    file_id_t file = 0;
+    tagdb_key_t key = NULL;
+    if (res >= 0 && ours)
+    {
+        if (S_ISDIR(e->attr.st_mode))
+        {
+            key = path_extract_key(path);
+        }
+        else
+        {
+            file = e->attr.st_ino;
+        }
+    }
+
+    pthread_mutex_lock(&ll.lock);
+    ll_node *p = _node(parent);
+    if (!p)
+    {
+        res = -ENOENT;
+    }
+    else if (res == -ENOENT && negative && ll.negative_timeout > 0)
+    {
+        if (!p->negatives)
+        {
+            p->negatives = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        }
+        /* We have to remember the names to invalidate them, so past a point
+         * they just aren't cached */
+        if (g_hash_table_size(p->negatives) < LL_MAX_NEGATIVE_ENTRIES)
+        {
+            g_hash_table_insert(p->negatives, g_strdup(name), NULL);
+            e->entry_timeout = ll.negative_timeout;
+        }
+        res = 0;
+    }
+    else if (res >= 0)
+    {
+        ll_name *nm = _child(p, name);
+        ll_node *n = NULL;
+        if (file)
+        {
+            n = g_hash_table_lookup(ll.files, TO_SP(file));
+            if (!n)
+            {
+                char *file_path = g_strdup_printf("/%" G_GUINT64_FORMAT FIS "%s", (guint64) file, name);
+                n = _node_new(file_path);
+                g_free(file_path);
+                n->file = file;
+                g_hash_table_insert(ll.files, TO_SP(file), n);
+            }
+        }
+        else if (nm && !nm->node->file && (nm->node->key != NULL) == (key != NULL))
+        {
+            n = nm->node;
+            /* The tags in the path may have been deleted and made again */
+            if (key && !(key_length(key) == key_length(n->key) && key_equal(key, n->key)))
+            {
+                _unindex_dir(n);
+                key_destroy(n->key);
+                n->key = key;
+                key = NULL;
+                _index_dir(n);
+            }
+        }
+        else
+        {
+            n = _node_new(path);
+            n->key = key;
+            key = NULL;
+            if (n->key)
+            {
+                _index_dir(n);
+            }
+        }
+
+        _bind(p, name, n);
+        n->nlookup++;
+        e->ino = n->ino;
+        e->entry_timeout = ll.entry_timeout;
+        e->attr_timeout = ll.attr_timeout;
+    }
+    pthread_mutex_unlock(&ll.lock);
+
+    if (key)
+    {
+        key_destroy(key);
+    }
+    g_free(path);
+    return res;
+}
+
+static void _reply_entry (fuse_req_t req, fuse_ino_t parent, const char *name, int res)
+{
+    struct fuse_entry_param e;
+    if (res >= 0)
+    {
+        res = _lookup(parent, name, &e, FALSE);
+    }
+
+    if (res < 0)
+    {
+        _reply_status(req, res);
+    }
+    else
+    {
+        fuse_reply_entry(req, &e);
+    }
+}
+
+static void _unlinked (fuse_ino_t parent, const char *name)
+{
+    pthread_mutex_lock(&ll.lock);
+    ll_node *p = _node(parent);
+    ll_name *nm = p ? _child(p, name) : NULL;
+    if (nm)
+    {
+        _unbind(nm);
+    }
+    pthread_mutex_unlock(&ll.lock);
+}
+
+static void _renamed (fuse_ino_t parent, const char *name, fuse_ino_t newparent,
+        const char *newname, const char *path, const char *newpath)
+{
+    pthread_mutex_lock(&ll.lock);
+    ll_node *p = _node(parent);
+    ll_node *np = _node(newparent);
+    ll_name *nm = p ? _child(p, name) : NULL;
+    ll_node *n = nm ? nm->node : NULL;
+    if (nm)
+    {
+        _unbind(nm);
+    }
+    if (n && np)
+    {
+        _bind(np, newname, n);
+    }
+
+    /* The paths of directories move with them. Files' paths don't depend
+     * on their names, and tags keep their IDs when they're moved, so the
+     * keys stay the same */
+    if (!n || !n->file)
+    {
+        size_t len = strlen(path);
+        HL(ll.nodes, it, k, v)
+        {
+            ll_node *d = v;
+            if (!d->file && strncmp(d->path, path, len) == 0 &&
+                    (d->path[len] == '/' || d->path[len] == 0))
+            {
+                char *moved = g_strconcat(newpath, d->path + len, NULL);
+                g_free(d->path);
+                d->path = moved;
+            }
+        } HL_END;
+    }
+    pthread_mutex_unlock(&ll.lock);
+}
+
+/* Invalidation.
+ *
+ * The kernel may cache entries and attributes for as long as the timeouts
+ * allow, so when the TagDB changes what a directory holds we tell it to
+ * drop the entries it has for that directory. The kernel takes the
+ * directory's lock to do that, which an operation on the directory may be
+ * holding while it makes the change, so the notifications are sent from a
+ * thread of their own.
+ */
+
+static void _queue_dir (ll_node *d)
+{
+    if (!d->queued)
+    {
+        d->queued = TRUE;
+        g_array_append_val(ll.pending, d->ino);
+    }
+}
+
+static void _tag_changed (file_id_t tag_id, gpointer data)
+{
+    pthread_mutex_lock(&ll.lock);
+    if (tag_id == TAGDB_ALL_TAGS)
+    {
+        HL(ll.nodes, it, k, v)
+        {
+            ll_node *d = v;
+            if (d->key)
+            {
+                _queue_dir(d);
+            }
+        } HL_END;
+    }
+    else
+    {
+        GHashTable *dirs = _dirs_with_tag(tag_id, FALSE);
+        if (dirs)
+        {
+            HL(dirs, it, k, v)
+            {
+                _queue_dir(v);
+            } HL_END;
+        }
+    }
+
+    if (ll.pending->len > 0)
+    {
+        pthread_cond_signal(&ll.notify_cond);
+    }
+    pthread_mutex_unlock(&ll.lock);
+}
+
+static void _add_notice (GArray *notices, fuse_ino_t ino, const char *name)
+{
+    ll_notice n = { .ino = ino, .name = name ? g_strdup(name) : NULL };
+    g_array_append_val(notices, n);
+}
+
+static void *_notify_thread (void *arg)
+{
+    GArray *notices = g_array_new(FALSE, FALSE, sizeof(ll_notice));
+    pthread_mutex_lock(&ll.lock);
+    while (!ll.stop)
+    {
+        if (ll.pending->len == 0)
+        {
+            pthread_cond_wait(&ll.notify_cond, &ll.lock);
+            continue;
+        }
+
+        for (guint i = 0; i < ll.pending->len; i++)
+        {
+            ll_node *d = _node(g_array_index(ll.pending, fuse_ino_t, i));
+            if (!d)
+            {
+                continue;
+            }
+            d->queued = FALSE;
+            _add_notice(notices, d->ino, NULL);
+            if (d->children)
+            {
+                HL(d->children, it, k, v)
+                {
+                    _add_notice(notices, d->ino, k);
+                } HL_END;
+            }
+            if (d->negatives)
+            {
+                HL(d->negatives, it, k, v)
+                {
+                    _add_notice(notices, d->ino, k);
+                } HL_END;
+                g_hash_table_remove_all(d->negatives);
+            }
+        }
+        g_array_set_size(ll.pending, 0);
+        pthread_mutex_unlock(&ll.lock);
+
+        for (guint i = 0; i < notices->len; i++)
+        {
+            ll_notice *n = &g_array_index(notices, ll_notice, i);
+            /* These fail with ENOENT when the kernel doesn't have what we
+             * name cached, which is fine */
+            if (n->name)
+            {
+                fuse_lowlevel_notify_inval_entry(ll.ch, n->ino, n->name, strlen(n->name));
+                g_free(n->name);
+            }
+            else
+            {
+                fuse_lowlevel_notify_inval_inode(ll.ch, n->ino, 0, 0);
+            }
+        }
+        g_array_set_size(notices, 0);
+        pthread_mutex_lock(&ll.lock);
+    }
+    pthread_mutex_unlock(&ll.lock);
+    g_array_free(notices, TRUE);
+    return NULL;
+}
+
+static void ll_init (void *userdata, struct fuse_conn_info *conn)
+{
+    thread_context.private_data = ll.data;
+    tagfs_ll_context = &thread_context;
+    if (ll.ops->init)
+    {
+        ll.ops->init(conn);
+    }
+}
+
+static void ll_destroy (void *userdata)
+{
+    thread_context.private_data = ll.data;
+    tagfs_ll_context = &thread_context;
+    if (ll.ops->destroy)
+    {
+        ll.ops->destroy(ll.data);
+    }
+}
+
+static void ll_lookup (fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    _begin(req);
+    struct fuse_entry_param e;
+    int res = _lookup(parent, name, &e, TRUE);
+    if (res < 0)
+    {
+        _reply_status(req, res);
+    }
+    else
+    {
+        fuse_reply_entry(req, &e);
+    }
+}
+
+static void ll_forget (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    pthread_mutex_lock(&ll.lock);
+    ll_node *n = _node(ino);
+    if (n && ino != FUSE_ROOT_ID)
+    {
+        n->nlookup -= MIN(nlookup, n->nlookup);
+        if (n->nlookup == 0)
+        {
+            _node_free(n);
+        }
+    }
+    pthread_mutex_unlock(&ll.lock);
+    fuse_reply_none(req);
+}
+
+static void ll_getattr (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    _begin(req);
+    file_id_t file = 0;
+    char *path = _node_path(ino, &file);
+    if (!path)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    struct stat st;
+    int res = _getattr(path, file, &st);
+    g_free(path);
+    if (res < 0)
+    {
+        _reply_status(req, res);
+    }
+    else
+    {
+        fuse_reply_attr(req, &st, ll.attr_timeout);
+    }
+}
+
+static void ll_setattr (fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+        int to_set, struct fuse_file_info *fi)
+{
+    _begin(req);
+    file_id_t file = 0;
+    char *path = _node_path(ino, &file);
+    if (!path)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    int res = 0;
+    if (to_set & FUSE_SET_ATTR_MODE)
+    {
+        res = LL_CALL(chmod, path, attr->st_mode);
+    }
+    if (res >= 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)))
+    {
+        res = LL_CALL(chown, path,
+                (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1,
+                (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1);
+    }
+    if (res >= 0 && (to_set & FUSE_SET_ATTR_SIZE))
+    {
+        res = LL_CALL(truncate, path, attr->st_size);
+    }
+    if (res >= 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)))
+    {
+        struct timespec tv[2];
+        tv[0].tv_nsec = tv[1].tv_nsec = UTIME_OMIT;
+        if (to_set & FUSE_SET_ATTR_ATIME)
+        {
+            tv[0] = attr->st_atim;
+        }
+        if (to_set & FUSE_SET_ATTR_MTIME)
+        {
+            tv[1] = attr->st_mtim;
+        }
+#ifdef FUSE_SET_ATTR_ATIME_NOW
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+        {
+            tv[0].tv_nsec = UTIME_NOW;
+        }
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+        {
+            tv[1].tv_nsec = UTIME_NOW;
+        }
+#endif
+        res = LL_CALL(utimens, path, tv);
+    }
+
+    struct stat st;
+    if (res >= 0)
+    {
+        res = _getattr(path, file, &st);
+    }
+    g_free(path);
+
+    if (res < 0)
+    {
+        _reply_status(req, res);
+    }
+    else
+    {
+        fuse_reply_attr(req, &st, ll.attr_timeout);
+    }
+}
+
+static void ll_readlink (fuse_req_t req, fuse_ino_t ino)
+{
+    _begin(req);
+    char *path = _node_path(ino, NULL);
+    char buf[PATH_MAX + 1];
+    int res = path ? LL_CALL(readlink, path, buf, sizeof(buf)) : -ENOENT;
+    g_free(path);
+    if (res < 0)
+    {
+        _reply_status(req, res);
+    }
+    else
+    {
+        buf[PATH_MAX] = 0;
+        fuse_reply_readlink(req, buf);
+    }
+}
+
+static void ll_mkdir (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    _begin(req);
+    char *path = _child_path(parent, name);
+    int res = path ? LL_CALL(mkdir, path, mode) : -ENOENT;
+    g_free(path);
+    _reply_entry(req, parent, name, res);
+}
+
+static void ll_symlink (fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
+{
+    _begin(req);
+    char *path = _child_path(parent, name);
+    int res = path ? LL_CALL(symlink, link, path) : -ENOENT;
+    g_free(path);
+    _reply_entry(req, parent, name, res);
+}
+
+static void ll_unlink (fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    _begin(req);
+    char *path = _child_path(parent, name);
+    int res = path ? LL_CALL(unlink, path) : -ENOENT;
+    g_free(path);
+    if (res >= 0)
+    {
+        _unlinked(parent, name);
+    }
+    _reply_status(req, res);
+}
+
+static void ll_rmdir (fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    _begin(req);
+    char *path = _child_path(parent, name);
+    int res = path ? LL_CALL(rmdir, path) : -ENOENT;
+    g_free(path);
+    if (res >= 0)
+    {
+        _unlinked(parent, name);
+    }
+    _reply_status(req, res);
+}
+
+static void ll_rename (fuse_req_t req, fuse_ino_t parent, const char *name,
+        fuse_ino_t newparent, const char *newname)
+{
+    _begin(req);
+    char *path = _child_path(parent, name);
+    char *newpath = _child_path(newparent, newname);
+    int res = (path && newpath) ? LL_CALL(rename, path, newpath) : -ENOENT;
+    if (res >= 0)
+    {
+        _renamed(parent, name, newparent, newname, path, newpath);
+    }
+    g_free(path);
+    g_free(newpath);
+    _reply_status(req, res);
+}
+
+static void ll_link (fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
+{
+    _begin(req);
+    char *path = _node_path(ino, NULL);
+    char *newpath = _child_path(newparent, newname);
+    int res = (path && newpath) ? LL_CALL(link, path, newpath) : -ENOENT;
+    g_free(path);
+    g_free(newpath);
+    _reply_entry(req, newparent, newname, res);
+}
+
+static void ll_open (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    _begin(req);
+    char *path = _node_path(ino, NULL);
+    int res = path ? LL_CALL(open, path, fi) : -ENOENT;
+    g_free(path);
+    if (res < 0)
+    {
+        _reply_status(req, res);
+    }
+    else
+    {
+        fuse_reply_open(req, fi);
+    }
+}
+
+static void ll_create (fuse_req_t req, fuse_ino_t parent, const char *name,
+        mode_t mode, struct fuse_file_info *fi)
+{
+    _begin(req);
+    char *path = _child_path(parent, name);
+    int res = path ? LL_CALL(create, path, mode, fi) : -ENOENT;
+    struct fuse_entry_param e;
+    if (res >= 0)
+    {
+        res = _lookup(parent, name, &e, FALSE);
+        if (res < 0)
+        {
+            LL_CALL(release, path, fi);
+        }
+    }
+    g_free(path);
+
+    if (res < 0)
+    {
+        _reply_status(req, res);
+    }
+    else
+    {
+        fuse_reply_create(req, &e, fi);
+    }
+}
+
+static void ll_read (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+        struct fuse_file_info *fi)
+{
+    _begin(req);
+    char *path = _node_path(ino, NULL);
+    struct fuse_bufvec *bufv = NULL;
+    int res = -ENOENT;
+    if (path)
+    {
+        res = ll.ops->read_buf ? ll.ops->read_buf(path, &bufv, size, off, fi)
+            : read_buf_with_read(ll.ops, path, &bufv, size, off, fi);
+    }
+    g_free(path);
+    if (res < 0)
+    {
+        _reply_status(req, res);
+    }
+    else
+    {
+        /* An fd-backed buffer is spliced from the file into the reply */
+        fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+    }
+    bufvec_free(bufv);
+}
+
+static void ll_write_buf (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+        off_t off, struct fuse_file_info *fi)
+{
+    _begin(req);
+    char *path = _node_path(ino, NULL);
+    int res = -ENOENT;
+    if (path)
+    {
+        res = ll.ops->write_buf ? ll.ops->write_buf(path, bufv, off, fi)
+            : write_buf_with_write(ll.ops, path, bufv, off, fi);
+    }
+    g_free(path);
+    if (res < 0)
+    {
+        _reply_status(req, res);
+    }
+    else
+    {
+        fuse_reply_write(req, res);
+    }
+}
+
+static void ll_release (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    _begin(req);
+    char *path = _node_path(ino, NULL);
+    /* The handle has to be let go of even if the file is gone */
+    int res = LL_CALL(release, path ? path : "", fi);
+    g_free(path);
+    _reply_status(req, res);
+}
+
+static void ll_opendir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    _begin(req);
+    char *path = _node_path(ino, NULL);
+    int res = path ? LL_CALL(opendir, path, fi) : -ENOENT;
+    g_free(path);
+    if (res < 0)
+    {
+        _reply_status(req, res);
+    }
+    else
+    {
+        fuse_reply_open(req, fi);
+    }
+}
+
+typedef struct
+{
+    fuse_req_t req;
+    char *buf;
+    size_t size;
+    size_t used;
+} ll_dirbuf;
+
+/* A fuse_fill_dir_t which packs the entries into a reply buffer */
+static int _fill_dir (void *data, const char *name, const struct stat *stbuf, off_t off)
+{
+    ll_dirbuf *b = data;
+    struct stat st;
+    if (!stbuf)
+    {
+        memset(&st, 0, sizeof(struct stat));
+        stbuf = &st;
+    }
+
+    size_t len = fuse_add_direntry(b->req, b->buf + b->used, b->size - b->used, name, stbuf, off);
+    if (len > b->size - b->used)
+    {
+        return 1;
+    }
+    b->used += len;
+    return 0;
+}
+
+static void ll_readdir (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+        struct fuse_file_info *fi)
+{
+    _begin(req);
+    char *path = _node_path(ino, NULL);
+    ll_dirbuf b = { .req = req, .buf = g_malloc(size), .size = size, .used = 0 };
+    int res = path ? LL_CALL(readdir, path, &b, _fill_dir, off, fi) : -ENOENT;
+    g_free(path);
+    if (res < 0)
+    {
+        _reply_status(req, res);
+    }
+    else
+    {
+        fuse_reply_buf(req, b.buf, b.used);
+    }
+    g_free(b.buf);
+}
+
+static void ll_releasedir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    _begin(req);
+    char *path = _node_path(ino, NULL);
+    int res = path ? LL_CALL(releasedir, path, fi) : -ENOENT;
+    g_free(path);
+    _reply_status(req, res);
+}
+
+static struct fuse_lowlevel_ops ll_oper = {
+    .init = ll_init,
+    .destroy = ll_destroy,
+    .lookup = ll_lookup,
+    .forget = ll_forget,
+    .getattr = ll_getattr,
+    .setattr = ll_setattr,
+    .readlink = ll_readlink,
+    .mkdir = ll_mkdir,
+    .symlink = ll_symlink,
+    .unlink = ll_unlink,
+    .rmdir = ll_rmdir,
+    .rename = ll_rename,
+    .link = ll_link,
+    .open = ll_open,
+    .create = ll_create,
+    .read = ll_read,
+    .write_buf = ll_write_buf,
+    .release = ll_release,
+    .opendir = ll_opendir,
+    .readdir = ll_readdir,
+    .releasedir = ll_releasedir
+};
+
+static int _serve (struct fuse_session *se, int multithreaded)
+{
+    ll.stop = FALSE;
+    if (pthread_create(&ll.notify_thread, NULL, _notify_thread, NULL) != 0)
+    {
+        error("Couldn't start the invalidation thread");
+        return -1;
+    }
+
+    int res = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+
+    pthread_mutex_lock(&ll.lock);
+    ll.stop = TRUE;
+    pthread_cond_signal(&ll.notify_cond);
+    pthread_mutex_unlock(&ll.lock);
+    pthread_join(ll.notify_thread, NULL);
+    return res;
+}
+
+int tagfs_ll_main (int argc, char **argv, struct fuse_operations *ops,
+        struct tagfs_state *data, double entry_timeout, double attr_timeout,
+        double negative_timeout)
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    char *mountpoint = NULL;
+    int multithreaded = 0;
+    int foreground = 0;
+    int res = -1;
+
+    ll.ops = ops;
+    ll.data = data;
+    ll.entry_timeout = entry_timeout;
+    ll.attr_timeout = attr_timeout;
+    ll.negative_timeout = negative_timeout;
+    pthread_mutex_init(&ll.lock, NULL);
+    pthread_cond_init(&ll.notify_cond, NULL);
+    ll.nodes = g_hash_table_new(g_int64_hash, g_int64_equal);
+    ll.files = g_hash_table_new(g_direct_hash, g_direct_equal);
+    ll.dirs_by_tag = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+            NULL, (GDestroyNotify) g_hash_table_destroy);
+    ll.pending = g_array_new(FALSE, FALSE, sizeof(fuse_ino_t));
+
+    ll.next_ino = FUSE_ROOT_ID;
+    ll_node *root = _node_new("/");
+    root->key = key_new();
+    root->nlookup = 1;
+    _index_dir(root);
+    tagdb_add_change_listener(data->db, _tag_changed, NULL);
+
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1
+            && fuse_opt_add_arg(&args, "-o" TAGFS_SPLICE_OPTIONS) != -1)
+    {
+        ll.ch = fuse_mount(mountpoint, &args);
+        if (ll.ch)
+        {
+            struct fuse_session *se = fuse_lowlevel_new(&args, &ll_oper, sizeof(ll_oper), data);
+            if (se)
+            {
+                if (fuse_set_signal_handlers(se) != -1)
+                {
+                    fuse_session_add_chan(se, ll.ch);
+                    fuse_daemonize(foreground);
+                    res = _serve(se, multithreaded);
+                    fuse_remove_signal_handlers(se);
+                    fuse_session_remove_chan(ll.ch);
+                }
+                fuse_session_destroy(se);
+            }
+            fuse_unmount(mountpoint, ll.ch);
+        }
+        else
+        {
+            error("Couldn't mount at %s", mountpoint);
+        }
+    }
+    free(mountpoint);
+    fuse_opt_free_args(&args);
+
+    GList *nodes = g_hash_table_get_values(ll.nodes);
+    LL(nodes, it)
+    {
+        _node_free(it->data);
+    } LL_END;
+    g_list_free(nodes);
+    g_hash_table_destroy(ll.nodes);
+    g_hash_table_destroy(ll.files);
+    g_hash_table_destroy(ll.dirs_by_tag);
+    g_array_free(ll.pending, TRUE);
+    pthread_cond_destroy(&ll.notify_cond);
+    pthread_mutex_destroy(&ll.lock);
+    return res ? 1 : 0;
+}
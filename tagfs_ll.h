@@ -0,0 +1,30 @@
+#ifndef TAGFS_LL_H
+#define TAGFS_LL_H
+#include "params.h"
+
+/* A frontend on the FUSE low-level API.
+ *
+ * The kernel addresses everything after the first lookup by inode, so the
+ * frontend keeps a table of the inodes it has handed out and the (parent
+ * inode, name) they were looked up by, along with the path. Requests on an
+ * inode go to the operations in ops with the stored path rather than one
+ * which libfuse rebuilds for every call, and getattr on a file goes straight
+ * to the file by its ID. A file has one inode under all of its names. The
+ * kernel's lookup counts are kept, so inodes are dropped when it forgets
+ * them.
+ *
+ * Since the kernel can be told to drop what it has cached, the timeouts can
+ * be long: when the TagDB reports that a tag's files changed, the entries
+ * in the directories with that tag, including the names it was told don't
+ * exist, are invalidated.
+ */
+
+/* Mounts at the mount point in argv and serves ops with data as their
+ * private data until unmounted. Takes the same command line as fuse_main.
+ * A negative_timeout of 0 keeps the kernel from caching missing names.
+ * Returns 0 on a clean unmount */
+int tagfs_ll_main (int argc, char **argv, struct fuse_operations *ops,
+        struct tagfs_state *data, double entry_timeout, double attr_timeout,
+        double negative_timeout);
+
+#endif /* TAGFS_LL_H */
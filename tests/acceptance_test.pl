@@ -25,6 +25,7 @@ my $VALGRIND_OUTPUT = "";
 my $TAGFS_LOG = "";
 my $FUSE_LOG = "";
 my $SHOW_LOGS = 0;
+my $MOUNT_OPTIONS = "-o use_ino,attr_timeout=0";
 my @TESTS = ();
 my @TESTRANGE = ();
 
@@ -48,6 +49,12 @@ if (defined($ENV{SHOW_LOGS}))
     $SHOW_LOGS = 1;
 }
 
+# Runs the tests against the low-level FUSE frontend
+if (defined($ENV{LOWLEVEL}))
+{
+    $MOUNT_OPTIONS = "--lowlevel --attr-timeout=0";
+}
+
 sub setupTestDir
 {
     $testDirName = make_mount_dir();
@@ -66,7 +73,7 @@ sub setupTestDir
     {
         if ($child_pid == 0)
         {
-            my $cmd = "G_DEBUG=gc-friendly G_SLICE=always-malloc valgrind --track-origins=yes --log-file=$VALGRIND_OUTPUT --suppressions=valgrind-suppressions --leak-check=full ../tagfs -o use_ino,attr_timeout=0 --drop-db --data-dir=$dataDirName -g 0 -l $TAGFS_LOG -d $testDirName 2> $FUSE_LOG";
+            my $cmd = "G_DEBUG=gc-friendly G_SLICE=always-malloc valgrind --track-origins=yes --log-file=$VALGRIND_OUTPUT --suppressions=valgrind-suppressions --leak-check=full ../tagfs $MOUNT_OPTIONS --drop-db --data-dir=$dataDirName -g 0 -l $TAGFS_LOG -d $testDirName 2> $FUSE_LOG";
             exec($cmd) or die "Couldn't exec tagfs: $!\n";
         }
         else
@@ -859,6 +866,69 @@ my @tests_list = (
         is(read($lh, my $chars_read, 5), 5, "read from link file succeeds");
         is($chars_read, "HELLO", "correct characters are read");
     },
+    link_same_name_adds_tags =>
+    sub {
+        # A link with the file's own name lists the file under the new tag
+        my $d = "$testDirName/a";
+        my $e = "$testDirName/b";
+        mkdir $d;
+        mkdir $e;
+        my $f = "$d/f";
+        ok(open(my $fh, ">", $f), "file opens") or fail("Couldn't create the file");
+        print $fh "HELLO";
+        close($fh);
+        ok(link($f, "$e/f"), "link succeeds");
+        ok(dir_contains($e, "f"), "the file is listed under the new tag");
+        ok(dir_contains($d, "f"), "the file is still listed under the old tag");
+        ok(dir_contains("$d/b", "f"), "the file has both tags");
+    },
+    link_existing =>
+    sub {
+        my $f = "$testDirName/f";
+        my $g = "$testDirName/g";
+        for my $x ($f, $g)
+        {
+            ok(open(my $fh, ">", $x), "$x opens") or fail("Couldn't create $x");
+            close($fh);
+        }
+        ok(!link($f, $g), "link over an existing file fails");
+        ok($!{EEXIST}, "with EEXIST");
+    },
+    link_into_root_leaves_tags =>
+    sub {
+        # The root doesn't name a tagged file, so the link is refused and
+        # the file keeps only the tags it had
+        my $d = "$testDirName/a";
+        my $e = "$testDirName/b";
+        mkdir $d;
+        mkdir $e;
+        my $f = "$d/f";
+        ok(open(my $fh, ">", $f), "file opens") or fail("Couldn't create the file");
+        close($fh);
+        ok(!link($f, "$testDirName/f"), "link into the root fails");
+        ok($!{EPERM}, "with EPERM");
+        ok(!dir_contains($e, "f"), "the file isn't listed under the other tag");
+        ok(dir_contains($d, "f"), "the file is still listed under its tag");
+    },
+    link_other_name_shares_content =>
+    sub {
+        # A link with another name is a new file sharing the content
+        my $f = "$testDirName/f";
+        my $g = "$testDirName/g";
+        ok(open(my $fh, ">", $f), "file opens") or fail("Couldn't create the file");
+        print $fh "HELLO";
+        close($fh);
+        ok(link($f, $g), "link succeeds");
+        ok(dir_contains($testDirName, "g"), "the new file is listed");
+        is(stat($g)->nlink, 2, "the new file has two links");
+        ok(open($fh, ">>", $g), "new file opens") or fail("Couldn't open the new file");
+        print $fh " WORLD";
+        close($fh);
+        ok(open($fh, "<", $f), "old file opens") or fail("Couldn't open the old file");
+        is(read($fh, my $chars_read, 11), 11, "read from the old file succeeds");
+        is($chars_read, "HELLO WORLD", "the write through the new file is seen");
+        close($fh);
+    },
     rename_root_tag =>
     sub {
         # added for a regression that came from adding subtags
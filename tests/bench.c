@@ -0,0 +1,88 @@
+#include <math.h>
+#include "bench.h"
+#include "util.h"
+
+static FILE *bench_out = NULL;
+static const char *bench_param_names = "";
+static const char *bench_param_values = "";
+
+struct bench_zipf
+{
+    /* cdf[i] is the probability of drawing a value <= i */
+    double *cdf;
+    int n;
+    GRand *rand;
+};
+
+void bench_init (FILE *out, const char *param_names, const char *param_values)
+{
+    bench_out = out;
+    bench_param_names = param_names;
+    bench_param_values = param_values;
+}
+
+void bench_print_header (void)
+{
+    fprintf(bench_out, "benchmark\tops\ttotal_ns\tns_per_op\t%s\n", bench_param_names);
+}
+
+void bench_start (bench_timer *t, const char *name)
+{
+    t->name = name;
+    t->start = monotonic_time_ns();
+}
+
+void bench_stop (bench_timer *t, guint64 ops)
+{
+    guint64 elapsed = monotonic_time_ns() - t->start;
+    fprintf(bench_out, "%s\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT "\t%.1f\t%s\n",
+            t->name, ops, elapsed, ops ? (double) elapsed / ops : 0.0,
+            bench_param_values);
+    fflush(bench_out);
+}
+
+bench_zipf *bench_zipf_new (int n, double s, GRand *rand)
+{
+    bench_zipf *z = g_malloc(sizeof(bench_zipf));
+    z->cdf = g_malloc_n(n, sizeof(double));
+    z->n = n;
+    z->rand = rand;
+
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+    {
+        sum += 1.0 / pow(i + 1, s);
+        z->cdf[i] = sum;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        z->cdf[i] /= sum;
+    }
+    return z;
+}
+
+int bench_zipf_next (bench_zipf *z)
+{
+    double u = g_rand_double(z->rand);
+    int lo = 0;
+    int hi = z->n - 1;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (z->cdf[mid] < u)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void bench_zipf_destroy (bench_zipf *z)
+{
+    g_free(z->cdf);
+    g_free(z);
+}
@@ -0,0 +1,39 @@
+#ifndef BENCH_H
+#define BENCH_H
+#include <stdio.h>
+#include <glib.h>
+
+/* Helpers for the micro-benchmarks.
+ *
+ * Results are written as tab-separated lines, one per timed operation,
+ * preceded by a single header line, so that runs can be compared with
+ * ordinary text tools. Each line ends with the parameters of the run as
+ * given to bench_init.
+ */
+
+typedef struct
+{
+    const char *name;
+    guint64 start;
+} bench_timer;
+
+/* Sets the output stream and the names and values of the run's parameters.
+ * names and values are tab-separated lists of equal length */
+void bench_init (FILE *out, const char *param_names, const char *param_values);
+
+/* Prints the header line */
+void bench_print_header (void);
+
+void bench_start (bench_timer *t, const char *name);
+/* Stops the timer and prints a result line for ops operations */
+void bench_stop (bench_timer *t, guint64 ops);
+
+/* Draws integers in [0, n) where i is drawn with probability proportional
+ * to 1/(i+1)^s. s = 0 gives a uniform distribution */
+typedef struct bench_zipf bench_zipf;
+
+bench_zipf *bench_zipf_new (int n, double s, GRand *rand);
+int bench_zipf_next (bench_zipf *z);
+void bench_zipf_destroy (bench_zipf *z);
+
+#endif /* BENCH_H */
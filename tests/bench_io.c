@@ -0,0 +1,223 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <glib.h>
+#include "params.h"
+#include "bench.h"
+#include "log.h"
+#include "util.h"
+#include "fs_util.h"
+
+/* Times sequential reads and writes of a large file through each of the
+ * ways tagdb_fs can move file data: the copying read and write, their
+ * vectored forms with each block split into --iovecs buffers, and the
+ * buffer-based read_buf and write_buf. read_buf is followed by the copy
+ * into memory which FUSE makes when it can't splice.
+ *
+ * By default a file of --size MiB is written in a temporary directory and
+ * read back. With --file, the given file is only read, so a file on a
+ * mounted tagfs can be read with and without --direct-io-size or with
+ * different --max-read and --max-readahead to compare the mount's modes.
+ * Every block is an operation, so ns_per_op is the time per --block bytes.
+ *
+ * The file is read after being written, so unless the system's page cache
+ * is dropped in between, reads measure the copying rather than the disk.
+ */
+
+static gint size_mb = 256;
+static gint block = 128 * 1024;
+static gint iovecs = 4;
+static gchar *file_name = NULL;
+
+static GOptionEntry options[] =
+{
+  { "size", 's', 0, G_OPTION_ARG_INT, &size_mb, "Size of the file to write in MiB", "N" },
+  { "block", 'b', 0, G_OPTION_ARG_INT, &block, "Bytes in each read or write", "N" },
+  { "iovecs", 'v', 0, G_OPTION_ARG_INT, &iovecs, "Buffers each block is split into for readv and writev", "N" },
+  { "file", 'f', 0, G_OPTION_ARG_FILENAME, &file_name, "Only read this file", "FILE" },
+  { NULL }
+};
+
+static struct iovec *split_block (char *buf)
+{
+    struct iovec *iov = g_malloc_n(iovecs, sizeof(struct iovec));
+    size_t part = block / iovecs;
+    for (int i = 0; i < iovecs; i++)
+    {
+        iov[i].iov_base = buf + i * part;
+        iov[i].iov_len = (i == iovecs - 1) ? block - i * part : part;
+    }
+    return iov;
+}
+
+/* Runs one pass over nblocks blocks of fi's file in the given mode, which
+ * is the name of the benchmark */
+static void pass (const char *mode, struct fuse_file_info *fi, char *buf, guint64 nblocks)
+{
+    struct iovec *iov = split_block(buf);
+    bench_timer t;
+    guint64 done = 0;
+    int res = 0;
+
+    bench_start(&t, mode);
+    for (; done < nblocks; done++)
+    {
+        off_t offset = (off_t) done * block;
+        if (strcmp(mode, "read") == 0)
+        {
+            res = file_info_read(fi, buf, block, offset);
+        }
+        else if (strcmp(mode, "readv") == 0)
+        {
+            res = file_info_readv(fi, iov, iovecs, offset);
+        }
+        else if (strcmp(mode, "read_buf") == 0)
+        {
+            struct fuse_bufvec *src = NULL;
+            res = file_info_read_buf(fi, &src, block, offset);
+            if (res == 0)
+            {
+                struct fuse_bufvec dst = FUSE_BUFVEC_INIT(block);
+                dst.buf[0].mem = buf;
+                res = fuse_buf_copy(&dst, src, 0);
+                bufvec_free(src);
+            }
+        }
+        else if (strcmp(mode, "write") == 0)
+        {
+            res = file_info_write(fi, buf, block, offset);
+        }
+        else if (strcmp(mode, "writev") == 0)
+        {
+            res = file_info_writev(fi, iov, iovecs, offset);
+        }
+        else if (strcmp(mode, "write_buf") == 0)
+        {
+            struct fuse_bufvec src = FUSE_BUFVEC_INIT(block);
+            src.buf[0].mem = buf;
+            res = file_info_write_buf(fi, &src, offset);
+        }
+
+        if (res <= 0)
+        {
+            break;
+        }
+    }
+    bench_stop(&t, done);
+    if (res < 0)
+    {
+        fprintf(stderr, "%s failed after %" G_GUINT64_FORMAT " blocks: %s\n",
+                mode, done, strerror((res == -1) ? errno : -res));
+    }
+    g_free(iov);
+}
+
+static int open_fi (const char *name, int flags, struct fuse_file_info *fi)
+{
+    memset(fi, 0, sizeof(*fi));
+    fi->flags = flags;
+    int fd = open(name, flags, 0644);
+    if (fd < 0)
+    {
+        perror(name);
+        return -1;
+    }
+    fi->fh = fd;
+    return 0;
+}
+
+int main (int argc, char **argv)
+{
+    GError *err = NULL;
+    GOptionContext *context = g_option_context_new("- time the ways of reading and writing file data");
+    g_option_context_add_main_entries(context, options, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &err))
+    {
+        fprintf(stderr, "%s\n", err->message);
+        g_error_free(err);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    if (size_mb < 1 || block < 1 || iovecs < 1 || iovecs > block)
+    {
+        fprintf(stderr, "--size, --block and --iovecs must be positive and --iovecs at most --block\n");
+        return 1;
+    }
+
+    log_open0(stderr, ERROR);
+
+    char *dir = NULL;
+    char *name = file_name;
+    if (!name)
+    {
+        dir = g_strdup("/tmp/tagfs_bench_io.XXXXXX");
+        if (!mkdtemp(dir))
+        {
+            perror("mkdtemp");
+            return 1;
+        }
+        name = g_strdup_printf("%s/data", dir);
+    }
+
+    char *params = g_strdup_printf("%d\t%d\t%s", block, iovecs, name);
+    bench_init(stdout, "block\tiovecs\tfile", params);
+    bench_print_header();
+
+    char *buf = g_malloc(block);
+    memset(buf, 'x', block);
+    struct fuse_file_info fi;
+    guint64 nblocks = ((guint64) size_mb << 20) / block;
+    int res = 0;
+
+    if (!file_name)
+    {
+        const char *writes[] = {"write", "writev", "write_buf"};
+        for (int i = 0; i < G_N_ELEMENTS(writes) && res == 0; i++)
+        {
+            res = open_fi(name, O_WRONLY | O_CREAT | O_TRUNC, &fi);
+            if (res == 0)
+            {
+                pass(writes[i], &fi, buf, nblocks);
+                close(fi.fh);
+            }
+        }
+    }
+    else
+    {
+        struct stat st;
+        if (stat(name, &st) != 0)
+        {
+            perror(name);
+            return 1;
+        }
+        nblocks = (st.st_size + block - 1) / block;
+    }
+
+    const char *reads[] = {"read", "readv", "read_buf"};
+    for (int i = 0; i < G_N_ELEMENTS(reads) && res == 0; i++)
+    {
+        res = open_fi(name, O_RDONLY, &fi);
+        if (res == 0)
+        {
+            pass(reads[i], &fi, buf, nblocks);
+            close(fi.fh);
+        }
+    }
+
+    if (dir)
+    {
+        unlink(name);
+        rmdir(dir);
+        g_free(name);
+        g_free(dir);
+    }
+    g_free(buf);
+    g_free(params);
+    return res ? 1 : 0;
+}
@@ -0,0 +1,690 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <glib.h>
+#include "params.h"
+#include "log.h"
+#include "util.h"
+#include "stage.h"
+#include "tagdb.h"
+#include "tagdb_fs.h"
+#include "fs_util.h"
+#include "op_stats.h"
+#include "op_trace.h"
+
+/* Replays a trace of file system operations directly against the tagdb_fs
+ * operations, linked with fake_fuse rather than mounted, across a number
+ * of threads. Reports the overall throughput and the latency percentiles of
+ * each operation.
+ *
+ * Without --trace, a synthetic trace is generated over a prepopulated tree
+ * of --dirs tags with --files files. Its operations follow a simulation of
+ * the namespace, but when they're replayed across threads they interleave
+ * differently, so some will fail. Failures are counted as errors.
+ *
+ * Traces recorded with tagfs --record-trace can be summarized with
+ * --summary, which prints the latencies seen when they were recorded, or
+ * replayed. With --mount, the trace is replayed with system calls against a
+ * mounted (scratch) file system instead. With --speed, each operation waits
+ * until its recorded time divided by the speed, so 1 replays at the
+ * original pace and 10 ten times faster. The default, 0, replays as fast as
+ * possible.
+ */
+
+static gint nthreads = 4;
+static gint nops = 100000;
+static gint nfiles = 1000;
+static gint ndirs = 20;
+static gint file_size = 4096;
+static gint seed = 1;
+static gchar *trace_file = NULL;
+static gchar *write_trace_file = NULL;
+static gchar *work_dir = NULL;
+static gchar *mount_dir = NULL;
+static gdouble speed = 0;
+static gboolean summary_only = FALSE;
+
+static GOptionEntry options[] =
+{
+  { "threads", 'j', 0, G_OPTION_ARG_INT, &nthreads, "Number of threads replaying the trace", "N" },
+  { "trace", 't', 0, G_OPTION_ARG_FILENAME, &trace_file, "Trace to replay (default: a synthetic trace)", "FILE" },
+  { "ops", 'n', 0, G_OPTION_ARG_INT, &nops, "Number of operations in the synthetic trace", "N" },
+  { "files", 'f', 0, G_OPTION_ARG_INT, &nfiles, "Number of files to start with", "N" },
+  { "dirs", 'd', 0, G_OPTION_ARG_INT, &ndirs, "Number of tags to start with", "N" },
+  { "file-size", 0, 0, G_OPTION_ARG_INT, &file_size, "Size of the files to start with", "BYTES" },
+  { "seed", 's', 0, G_OPTION_ARG_INT, &seed, "Random seed for the synthetic trace", "N" },
+  { "write-trace", 'w', 0, G_OPTION_ARG_FILENAME, &write_trace_file, "Save the synthetic trace", "FILE" },
+  { "mount", 'm', 0, G_OPTION_ARG_FILENAME, &mount_dir, "Replay with system calls against the file system mounted at DIR", "DIR" },
+  { "speed", 0, 0, G_OPTION_ARG_DOUBLE, &speed, "Replay at this multiple of the recorded pace (0 is as fast as possible)", "F" },
+  { "summary", 0, 0, G_OPTION_ARG_NONE, &summary_only, "Print a summary of the trace instead of replaying it", NULL },
+  { "dir", 0, 0, G_OPTION_ARG_FILENAME, &work_dir, "Directory for the database and copies (default: a new temporary directory)", "DIR" },
+  { NULL }
+};
+
+static struct fuse_operations *ops = &tagdb_fs_subfs.operations;
+static GPtrArray *trace;
+static gint next_entry = 0;
+static guint64 replay_start_ns;
+
+#define MAX_READ (1 << 20)
+
+static int timed (op_stats_op op, guint64 start, int res)
+{
+    op_stats_record(op, monotonic_time_ns() - start, res);
+    return res;
+}
+
+/* Waits until it's time to replay e when replaying at --speed */
+static void wait_for (op_trace_entry *e)
+{
+    if (speed <= 0)
+    {
+        return;
+    }
+    guint64 due = replay_start_ns + (guint64) (e->time_ns / speed);
+    guint64 now = monotonic_time_ns();
+    if (due > now)
+    {
+        struct timespec ts;
+        ts.tv_sec = (due - now) / 1000000000;
+        ts.tv_nsec = (due - now) % 1000000000;
+        nanosleep(&ts, NULL);
+    }
+}
+
+static int count_filler (void *buf, const char *name, const struct stat *stbuf, off_t off)
+{
+    (*(int*) buf)++;
+    return 0;
+}
+
+/* Reads the way a mount would: through read_buf if there is one, copying
+ * what it returns into buf as FUSE does when it can't splice */
+static int replay_read (op_trace_entry *e, char *buf, struct fuse_file_info *fi)
+{
+    size_t size = MIN(e->size, MAX_READ);
+    if (!ops->read_buf)
+    {
+        return ops->read(e->path, buf, size, e->offset, fi);
+    }
+
+    struct fuse_bufvec *src = NULL;
+    int res = ops->read_buf(e->path, &src, size, e->offset, fi);
+    if (res == 0)
+    {
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+        dst.buf[0].mem = buf;
+        res = fuse_buf_copy(&dst, src, 0);
+        bufvec_free(src);
+    }
+    return res;
+}
+
+static void replay_entry (op_trace_entry *e, char *buf)
+{
+    struct stat st;
+    struct fuse_file_info fi;
+    int count = 0;
+    guint64 t0;
+    memset(&fi, 0, sizeof(fi));
+
+    t0 = monotonic_time_ns();
+    switch (e->op)
+    {
+        case OP_GETATTR:
+            timed(OP_GETATTR, t0, ops->getattr(e->path, &st));
+            break;
+        case OP_READDIR:
+            timed(OP_READDIR, t0, ops->readdir(e->path, &count, count_filler, 0, &fi));
+            break;
+        case OP_OPEN:
+        case OP_READ:
+            fi.flags = O_RDONLY;
+            if (timed(OP_OPEN, t0, ops->open(e->path, &fi)) == 0)
+            {
+                if (e->op == OP_READ)
+                {
+                    t0 = monotonic_time_ns();
+                    timed(OP_READ, t0, replay_read(e, buf, &fi));
+                }
+                t0 = monotonic_time_ns();
+                timed(OP_RELEASE, t0, ops->release(e->path, &fi));
+            }
+            break;
+        case OP_CREATE:
+            fi.flags = O_CREAT | O_WRONLY;
+            if (timed(OP_CREATE, t0, ops->create(e->path, e->size ? e->size : 0644, &fi)) == 0)
+            {
+                t0 = monotonic_time_ns();
+                timed(OP_RELEASE, t0, ops->release(e->path, &fi));
+            }
+            break;
+        case OP_RENAME:
+            timed(OP_RENAME, t0, ops->rename(e->path, e->path2));
+            break;
+        case OP_MKDIR:
+            timed(OP_MKDIR, t0, ops->mkdir(e->path, e->size ? e->size : 0755));
+            break;
+        case OP_UNLINK:
+            timed(OP_UNLINK, t0, ops->unlink(e->path));
+            break;
+        case OP_RMDIR:
+            timed(OP_RMDIR, t0, ops->rmdir(e->path));
+            break;
+        case OP_WRITE:
+            fi.flags = O_WRONLY;
+            if (timed(OP_OPEN, t0, ops->open(e->path, &fi)) == 0)
+            {
+                t0 = monotonic_time_ns();
+                timed(OP_WRITE, t0, ops->write(e->path, buf, MIN(e->size, MAX_READ), e->offset, &fi));
+                t0 = monotonic_time_ns();
+                timed(OP_RELEASE, t0, ops->release(e->path, &fi));
+            }
+            break;
+        case OP_TRUNCATE:
+            timed(OP_TRUNCATE, t0, ops->truncate(e->path, e->offset));
+            break;
+        default:
+            /* everything else is left out of the replay */
+            break;
+    }
+}
+
+/* Like timed, but for the result of a system call */
+static int timed_sys (op_stats_op op, guint64 start, int res)
+{
+    return timed(op, start, (res < 0) ? -errno : 0);
+}
+
+/* Replays e with system calls under mount_dir. Opens and closes are timed
+ * as part of the read or write, since the kernel may not pass them on */
+static void replay_entry_mounted (op_trace_entry *e, char *buf)
+{
+    struct stat st;
+    char *path = g_build_filename(mount_dir, e->path, NULL);
+    char *path2 = NULL;
+    guint64 t0 = monotonic_time_ns();
+    int fd;
+
+    switch (e->op)
+    {
+        case OP_GETATTR:
+            timed_sys(OP_GETATTR, t0, lstat(path, &st));
+            break;
+        case OP_READDIR:
+            {
+                DIR *d = opendir(path);
+                if (d)
+                {
+                    while (readdir(d) != NULL)
+                        continue;
+                    closedir(d);
+                }
+                timed_sys(OP_READDIR, t0, d ? 0 : -1);
+            }
+            break;
+        case OP_OPEN:
+        case OP_READ:
+            fd = open(path, O_RDONLY);
+            if (fd >= 0 && e->op == OP_READ)
+            {
+                int res = pread(fd, buf, MIN(e->size, MAX_READ), e->offset);
+                close(fd);
+                timed_sys(OP_READ, t0, res);
+            }
+            else
+            {
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+                timed_sys(e->op, t0, fd);
+            }
+            break;
+        case OP_WRITE:
+            fd = open(path, O_WRONLY);
+            if (fd >= 0)
+            {
+                int res = pwrite(fd, buf, MIN(e->size, MAX_READ), e->offset);
+                close(fd);
+                timed_sys(OP_WRITE, t0, res);
+            }
+            else
+            {
+                timed_sys(OP_WRITE, t0, fd);
+            }
+            break;
+        case OP_CREATE:
+            fd = open(path, O_CREAT | O_WRONLY, e->size ? e->size : 0644);
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            timed_sys(OP_CREATE, t0, fd);
+            break;
+        case OP_RENAME:
+            path2 = g_build_filename(mount_dir, e->path2, NULL);
+            timed_sys(OP_RENAME, t0, rename(path, path2));
+            break;
+        case OP_MKDIR:
+            timed_sys(OP_MKDIR, t0, mkdir(path, e->size ? e->size : 0755));
+            break;
+        case OP_UNLINK:
+            timed_sys(OP_UNLINK, t0, unlink(path));
+            break;
+        case OP_RMDIR:
+            timed_sys(OP_RMDIR, t0, rmdir(path));
+            break;
+        case OP_TRUNCATE:
+            timed_sys(OP_TRUNCATE, t0, truncate(path, e->offset));
+            break;
+        default:
+            break;
+    }
+    g_free(path);
+    g_free(path2);
+}
+
+static void *replay_thread (void *data)
+{
+    char *buf = g_malloc0(MAX_READ);
+    gint i;
+    while ((i = __atomic_fetch_add(&next_entry, 1, __ATOMIC_RELAXED)) < trace->len)
+    {
+        op_trace_entry *e = g_ptr_array_index(trace, i);
+        wait_for(e);
+        if (mount_dir)
+        {
+            replay_entry_mounted(e, buf);
+        }
+        else
+        {
+            replay_entry(e, buf);
+        }
+    }
+    g_free(buf);
+    return NULL;
+}
+
+static void populate (void)
+{
+    char *data = g_malloc0(file_size);
+    char path[64];
+    for (int i = 0; i < ndirs; i++)
+    {
+        g_snprintf(path, 64, "/t%d", i);
+        ops->mkdir(path, 0755);
+    }
+    for (int i = 0; i < nfiles; i++)
+    {
+        struct fuse_file_info fi;
+        memset(&fi, 0, sizeof(fi));
+        fi.flags = O_CREAT | O_WRONLY;
+        g_snprintf(path, 64, "/t%d/f%d", i % ndirs, i);
+        if (ops->create(path, 0644, &fi) == 0)
+        {
+            ops->write(path, data, file_size, 0, &fi);
+            ops->release(path, &fi);
+        }
+    }
+    g_free(data);
+}
+
+static void populate_mounted (void)
+{
+    char *data = g_malloc0(file_size);
+    char path[PATH_MAX];
+    for (int i = 0; i < ndirs; i++)
+    {
+        g_snprintf(path, PATH_MAX, "%s/t%d", mount_dir, i);
+        mkdir(path, 0755);
+    }
+    for (int i = 0; i < nfiles; i++)
+    {
+        g_snprintf(path, PATH_MAX, "%s/t%d/f%d", mount_dir, i % ndirs, i);
+        int fd = open(path, O_CREAT | O_WRONLY, 0644);
+        if (fd >= 0)
+        {
+            if (write(fd, data, file_size) != file_size)
+            {
+                fprintf(stderr, "Couldn't write %s\n", path);
+            }
+            close(fd);
+        }
+    }
+    g_free(data);
+}
+
+static char *random_element (GPtrArray *a, GRand *r)
+{
+    return g_ptr_array_index(a, g_rand_int_range(r, 0, a->len));
+}
+
+static GPtrArray *synthetic_trace (void)
+{
+    GRand *r = g_rand_new_with_seed(seed);
+    GPtrArray *res = g_ptr_array_new_with_free_func((GDestroyNotify) op_trace_entry_free);
+    GPtrArray *dirs = g_ptr_array_new_with_free_func(g_free);
+    GPtrArray *files = g_ptr_array_new_with_free_func(g_free);
+    int created = 0;
+
+    for (int i = 0; i < ndirs; i++)
+    {
+        g_ptr_array_add(dirs, g_strdup_printf("/t%d", i));
+    }
+    for (int i = 0; i < nfiles; i++)
+    {
+        g_ptr_array_add(files, g_strdup_printf("/t%d/f%d", i % ndirs, i));
+    }
+
+    for (int i = 0; i < nops; i++)
+    {
+        op_trace_entry *e = NULL;
+        int p = g_rand_int_range(r, 0, 100);
+        /* Keep enough files around for the other operations */
+        if (files->len < 2 && p >= 80)
+        {
+            p = 75;
+        }
+
+        if (p < 40)
+        {
+            e = op_trace_entry_new(OP_GETATTR,
+                    (p < 30) ? random_element(files, r) : random_element(dirs, r), NULL);
+        }
+        else if (p < 55)
+        {
+            e = op_trace_entry_new(OP_READDIR, (p < 53) ? random_element(dirs, r) : "/", NULL);
+        }
+        else if (p < 65)
+        {
+            e = op_trace_entry_new(OP_OPEN, random_element(files, r), NULL);
+        }
+        else if (p < 80)
+        {
+            e = op_trace_entry_new(OP_READ, random_element(files, r), NULL);
+            e->size = file_size;
+        }
+        else if (p < 85)
+        {
+            int k = g_rand_int_range(r, 0, files->len);
+            char *from = g_ptr_array_index(files, k);
+            char *base = g_path_get_basename(from);
+            char *to = g_strdup_printf("%s/%s", random_element(dirs, r), base);
+            e = op_trace_entry_new(OP_RENAME, from, to);
+            g_free(files->pdata[k]);
+            files->pdata[k] = to;
+            g_free(base);
+        }
+        else if (p < 88)
+        {
+            char *dir = g_strdup_printf("/n%d", i);
+            e = op_trace_entry_new(OP_MKDIR, dir, NULL);
+            e->size = 0755;
+            g_ptr_array_add(dirs, dir);
+        }
+        else if (p < 94)
+        {
+            char *file = g_strdup_printf("%s/c%d", random_element(dirs, r), created++);
+            e = op_trace_entry_new(OP_CREATE, file, NULL);
+            e->size = 0644;
+            g_ptr_array_add(files, file);
+        }
+        else
+        {
+            int k = g_rand_int_range(r, 0, files->len);
+            e = op_trace_entry_new(OP_UNLINK, g_ptr_array_index(files, k), NULL);
+            g_ptr_array_remove_index_fast(files, k);
+        }
+        g_ptr_array_add(res, e);
+    }
+
+    g_ptr_array_free(dirs, TRUE);
+    g_ptr_array_free(files, TRUE);
+    g_rand_free(r);
+    return res;
+}
+
+static void save_trace (GPtrArray *t, const char *file_name)
+{
+    GString *out = g_string_new("# time_ns\tthread\top\tresult\tlatency_ns\tpath\tpath2\tsize\toffset\n");
+    for (int i = 0; i < t->len; i++)
+    {
+        op_trace_format(out, g_ptr_array_index(t, i));
+    }
+    GError *err = NULL;
+    if (!g_file_set_contents(file_name, out->str, out->len, &err))
+    {
+        fprintf(stderr, "Couldn't write the trace: %s\n", err->message);
+        g_error_free(err);
+    }
+    g_string_free(out, TRUE);
+}
+
+static void print_latencies (const char *name, op_stats_summary *s)
+{
+    printf("%s\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT
+            "\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT
+            "\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT "\n",
+            name, s->calls, s->errors, s->total_ns / s->calls,
+            op_stats_percentile(s, 0.5),
+            op_stats_percentile(s, 0.9),
+            op_stats_percentile(s, 0.99),
+            op_stats_percentile(s, 0.999),
+            s->max_ns);
+}
+
+/* Prints the operations in the trace and the latencies they had when it was
+ * recorded */
+static void summarize (void)
+{
+    op_stats_summary *s = g_malloc0_n(OP_COUNT, sizeof(op_stats_summary));
+    GHashTable *threads = g_hash_table_new(g_direct_hash, g_direct_equal);
+    guint64 duration = 0;
+
+    for (int i = 0; i < trace->len; i++)
+    {
+        op_trace_entry *e = g_ptr_array_index(trace, i);
+        op_stats_summary *os = &s[e->op];
+        os->calls++;
+        os->errors += (e->result < 0);
+        os->total_ns += e->latency_ns;
+        os->max_ns = MAX(os->max_ns, e->latency_ns);
+        os->histogram[op_stats_bucket(e->latency_ns)]++;
+        duration = MAX(duration, e->time_ns + e->latency_ns);
+        g_hash_table_insert(threads, GUINT_TO_POINTER(e->thread + 1), NULL);
+    }
+
+    printf("entries\tthreads\tduration_ns\n");
+    printf("%u\t%u\t%" G_GUINT64_FORMAT "\n\n", trace->len, g_hash_table_size(threads), duration);
+    printf("op\tcalls\terrors\tmean_ns\tp50_ns\tp90_ns\tp99_ns\tp999_ns\tmax_ns\n");
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        if (s[op].calls)
+        {
+            print_latencies(op_stats_names[op], &s[op]);
+        }
+    }
+    g_hash_table_destroy(threads);
+    g_free(s);
+}
+
+static void report (guint64 elapsed_ns)
+{
+    op_stats_summary s;
+    guint64 total = 0;
+    guint64 errors = 0;
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        op_stats_collect(op, &s);
+        total += s.calls;
+        errors += s.errors;
+    }
+
+    printf("threads\tentries\tcalls\terrors\telapsed_ns\tcalls_per_sec\n");
+    printf("%d\t%u\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT "\t%.1f\n\n",
+            nthreads, trace->len, total, errors, elapsed_ns,
+            elapsed_ns ? total * 1e9 / elapsed_ns : 0.0);
+
+    printf("op\tcalls\terrors\tmean_ns\tp50_ns\tp90_ns\tp99_ns\tp999_ns\tmax_ns\n");
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        op_stats_collect(op, &s);
+        if (s.calls)
+        {
+            print_latencies(op_stats_names[op], &s);
+        }
+    }
+}
+
+static GPtrArray *load_trace (void)
+{
+    GError *err = NULL;
+    GPtrArray *res = op_trace_load(trace_file, &err);
+    if (!res)
+    {
+        fprintf(stderr, "Couldn't read the trace: %s\n", err->message);
+        g_error_free(err);
+    }
+    return res;
+}
+
+int main (int argc, char **argv)
+{
+    GError *err = NULL;
+    GOptionContext *context = g_option_context_new("- replay file system operations without a mount");
+    g_option_context_add_main_entries(context, options, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &err))
+    {
+        fprintf(stderr, "%s\n", err->message);
+        g_error_free(err);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    if (nthreads < 1 || ndirs < 1 || nfiles < 1 || file_size < 0 || speed < 0)
+    {
+        fprintf(stderr, "--threads, --dirs and --files must be positive and --speed not negative\n");
+        return 1;
+    }
+
+    log_open0(stderr, ERROR);
+
+    if (summary_only)
+    {
+        if (!trace_file)
+        {
+            fprintf(stderr, "--summary needs a --trace\n");
+            return 1;
+        }
+        if (!(trace = load_trace()))
+        {
+            return 1;
+        }
+        summarize();
+        g_ptr_array_free(trace, TRUE);
+        log_close();
+        return 0;
+    }
+
+    struct tagfs_state *state = NULL;
+    char *db_name = NULL;
+    gboolean own_dir = FALSE;
+    if (mount_dir)
+    {
+        if (!trace_file)
+        {
+            populate_mounted();
+        }
+    }
+    else
+    {
+        own_dir = (work_dir == NULL);
+        if (own_dir)
+        {
+            work_dir = g_strdup("/tmp/tagfs_replay.XXXXXX");
+            if (!mkdtemp(work_dir))
+            {
+                perror("mkdtemp");
+                return 1;
+            }
+        }
+
+        state = g_malloc0(sizeof(struct tagfs_state));
+        db_name = g_build_filename(work_dir, "tagfs.db", NULL);
+        state->copiesdir = g_build_filename(work_dir, "copies", NULL);
+        state->copies = copies_new(state->copiesdir, COPIES_FD_CACHE_ENTRIES);
+        unlink(db_name);
+        state->db = tagdb_new(db_name);
+        state->stage = new_stage();
+        state->listings = tagdb_fs_listing_cache_new(state->db, LISTING_CACHE_BYTES);
+        state->attrs = stat_cache_new(STAT_CACHE_ENTRIES);
+        fuse_init(state);
+
+        populate();
+    }
+
+    if (trace_file)
+    {
+        if (!(trace = load_trace()))
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        trace = synthetic_trace();
+        if (write_trace_file)
+        {
+            save_trace(trace, write_trace_file);
+        }
+    }
+
+    pthread_t *threads = g_malloc_n(nthreads, sizeof(pthread_t));
+    replay_start_ns = monotonic_time_ns();
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_create(&threads[i], NULL, replay_thread, NULL);
+    }
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    guint64 elapsed = monotonic_time_ns() - replay_start_ns;
+
+    report(elapsed);
+
+    g_free(threads);
+    g_ptr_array_free(trace, TRUE);
+    if (state)
+    {
+        tagdb_destroy(state->db);
+        dir_listing_cache_destroy(state->listings);
+        stat_cache_destroy(state->attrs);
+        copies_destroy(state->copies);
+        stage_destroy(state->stage);
+        g_free(state->copiesdir);
+        g_free(state);
+    }
+    if (own_dir)
+    {
+        char *cmd = g_strdup_printf("rm -rf '%s'", work_dir);
+        if (system(cmd) != 0)
+        {
+            fprintf(stderr, "Couldn't remove %s\n", work_dir);
+        }
+        g_free(cmd);
+    }
+    g_free(db_name);
+    g_free(work_dir);
+    log_close();
+    return 0;
+}
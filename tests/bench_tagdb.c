@@ -0,0 +1,355 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include "bench.h"
+#include "log.h"
+#include "util.h"
+#include "key.h"
+#include "tagdb.h"
+#include "tagdb_util.h"
+
+/* Builds a synthetic TagDB and times its core operations. Each bulk phase
+ * runs in a single transaction, as the file system does for a single
+ * operation, so the figures reflect TagDB rather than the disk's fsync
+ * latency.
+ *
+ * Tags are made in chains of length --depth (t0, t0::t1, t0::t1::t2, t3,
+ * ...). Each file gets --tags-per-file distinct tags, drawn with Zipfian
+ * popularity of exponent --zipf.
+ */
+
+static gint nfiles = 10000;
+static gint ntags = 500;
+static gint tags_per_file = 3;
+static gint depth = 1;
+static gdouble zipf = 1.0;
+static gint nqueries = 1000;
+static gint seed = 1;
+static gchar *db_dir = NULL;
+
+static GOptionEntry options[] =
+{
+  { "files", 'f', 0, G_OPTION_ARG_INT, &nfiles, "Number of files", "N" },
+  { "tags", 't', 0, G_OPTION_ARG_INT, &ntags, "Number of tags", "N" },
+  { "tags-per-file", 'p', 0, G_OPTION_ARG_INT, &tags_per_file, "Tags on each file", "N" },
+  { "depth", 'd', 0, G_OPTION_ARG_INT, &depth, "Length of the tag hierarchy chains", "N" },
+  { "zipf", 'z', 0, G_OPTION_ARG_DOUBLE, &zipf, "Exponent of the tag popularity distribution (0 is uniform)", "S" },
+  { "queries", 'q', 0, G_OPTION_ARG_INT, &nqueries, "Number of calls for each lookup benchmark", "N" },
+  { "seed", 's', 0, G_OPTION_ARG_INT, &seed, "Random seed", "N" },
+  { "dir", 0, 0, G_OPTION_ARG_FILENAME, &db_dir, "Directory for the database (default: a new temporary directory)", "DIR" },
+  { NULL }
+};
+
+/* full paths of each tag */
+static char **tag_paths;
+/* one of the tags of each file, for tagdb_lookup_file */
+static file_id_t *file_first_tag;
+static File **files;
+static Tag **tags;
+
+static void make_tags (TagDB *db)
+{
+    bench_timer t;
+    tag_paths = g_malloc0_n(ntags, sizeof(char*));
+    tags = g_malloc0_n(ntags, sizeof(Tag*));
+    for (int i = 0; i < ntags; i++)
+    {
+        if (i % depth == 0)
+        {
+            tag_paths[i] = g_strdup_printf("t%d", i);
+        }
+        else
+        {
+            tag_paths[i] = g_strdup_printf("%s" TPS "t%d", tag_paths[i - 1], i);
+        }
+    }
+
+    tagdb_begin_transaction(db);
+    bench_start(&t, "make_tag");
+    for (int i = 0; i < ntags; i++)
+    {
+        tags[i] = tagdb_make_tag(db, tag_paths[i]);
+    }
+    bench_stop(&t, ntags);
+    tagdb_end_transaction(db);
+}
+
+static void insert_files (TagDB *db)
+{
+    bench_timer t;
+    files = g_malloc0_n(nfiles, sizeof(File*));
+    for (int i = 0; i < nfiles; i++)
+    {
+        char name[32];
+        g_snprintf(name, 32, "f%d", i);
+        files[i] = new_file(name);
+    }
+
+    tagdb_begin_transaction(db);
+    bench_start(&t, "insert_file");
+    for (int i = 0; i < nfiles; i++)
+    {
+        insert_file(db, files[i]);
+    }
+    bench_stop(&t, nfiles);
+    tagdb_end_transaction(db);
+}
+
+static void tag_files (TagDB *db, bench_zipf *z)
+{
+    bench_timer t;
+    guint64 ops = 0;
+    int per_file = MIN(tags_per_file, ntags);
+    file_id_t *chosen = g_malloc_n(per_file, sizeof(file_id_t));
+    file_first_tag = g_malloc0_n(nfiles, sizeof(file_id_t));
+
+    tagdb_begin_transaction(db);
+    bench_start(&t, "add_tag_to_file");
+    for (int i = 0; i < nfiles; i++)
+    {
+        for (int j = 0; j < per_file; j++)
+        {
+            /* Draw until we get a tag the file doesn't already have. Very
+             * skewed distributions may take a while, so give up eventually */
+            file_id_t id;
+            int tries = 0;
+            gboolean dup;
+            do
+            {
+                id = tag_id(tags[bench_zipf_next(z)]);
+                dup = FALSE;
+                for (int k = 0; k < j; k++)
+                {
+                    dup = dup || (chosen[k] == id);
+                }
+            } while (dup && ++tries < 100);
+
+            chosen[j] = id;
+            if (!dup)
+            {
+                add_tag_to_file(db, files[i], id, NULL);
+                ops++;
+            }
+        }
+        file_first_tag[i] = chosen[0];
+    }
+    bench_stop(&t, ops);
+    tagdb_end_transaction(db);
+    g_free(chosen);
+}
+
+static void list_files (TagDB *db, bench_zipf *z, int key_length, const char *name)
+{
+    bench_timer t;
+    tagdb_key_t *keys = g_malloc_n(nqueries, sizeof(tagdb_key_t));
+    for (int i = 0; i < nqueries; i++)
+    {
+        keys[i] = key_new();
+        for (int j = 0; j < key_length; j++)
+        {
+            key_push_end(keys[i], tag_id(tags[bench_zipf_next(z)]));
+        }
+    }
+
+    bench_start(&t, name);
+    for (int i = 0; i < nqueries; i++)
+    {
+        g_list_free(get_files_list(db, keys[i]));
+    }
+    bench_stop(&t, nqueries);
+
+    for (int i = 0; i < nqueries; i++)
+    {
+        key_destroy(keys[i]);
+    }
+    g_free(keys);
+}
+
+static void list_tags (TagDB *db, bench_zipf *z)
+{
+    bench_timer t;
+    tagdb_key_t *keys = g_malloc_n(nqueries, sizeof(tagdb_key_t));
+    for (int i = 0; i < nqueries; i++)
+    {
+        keys[i] = key_new();
+        key_push_end(keys[i], tag_id(tags[bench_zipf_next(z)]));
+    }
+
+    bench_start(&t, "get_tags_list");
+    for (int i = 0; i < nqueries; i++)
+    {
+        g_list_free(get_tags_list(db, keys[i]));
+    }
+    bench_stop(&t, nqueries);
+
+    for (int i = 0; i < nqueries; i++)
+    {
+        key_destroy(keys[i]);
+    }
+    g_free(keys);
+}
+
+static void lookup_tags (TagDB *db, GRand *r)
+{
+    bench_timer t;
+    int *which = g_malloc_n(nqueries, sizeof(int));
+    for (int i = 0; i < nqueries; i++)
+    {
+        which[i] = g_rand_int_range(r, 0, ntags);
+    }
+
+    bench_start(&t, "lookup_tag");
+    for (int i = 0; i < nqueries; i++)
+    {
+        lookup_tag(db, tag_paths[which[i]]);
+    }
+    bench_stop(&t, nqueries);
+    g_free(which);
+}
+
+static void lookup_files (TagDB *db, GRand *r)
+{
+    bench_timer t;
+    int *which = g_malloc_n(nqueries, sizeof(int));
+    tagdb_key_t *keys = g_malloc_n(nqueries, sizeof(tagdb_key_t));
+    for (int i = 0; i < nqueries; i++)
+    {
+        which[i] = g_rand_int_range(r, 0, nfiles);
+        keys[i] = key_new();
+        key_push_end(keys[i], file_first_tag[which[i]]);
+    }
+
+    bench_start(&t, "tagdb_lookup_file");
+    for (int i = 0; i < nqueries; i++)
+    {
+        tagdb_lookup_file(db, keys[i], file_name(files[which[i]]));
+    }
+    bench_stop(&t, nqueries);
+
+    for (int i = 0; i < nqueries; i++)
+    {
+        key_destroy(keys[i]);
+    }
+    g_free(keys);
+    g_free(which);
+}
+
+static TagDB *restart (TagDB *db, const char *db_name)
+{
+    bench_timer t;
+    tagdb_destroy(db);
+    bench_start(&t, "startup");
+    db = tagdb_new(db_name);
+    bench_stop(&t, 1);
+    return db;
+}
+
+/* Deletes the tags at the ends of the chains, which have no sub-tags */
+static void delete_tags (TagDB *db)
+{
+    bench_timer t;
+    GList *leaves = NULL;
+    int n = 0;
+    for (int i = ntags - 1; i >= 0 && n < nqueries; i--)
+    {
+        if (i % depth == depth - 1 || i == ntags - 1)
+        {
+            Tag *tag = lookup_tag(db, tag_paths[i]);
+            if (tag)
+            {
+                leaves = g_list_prepend(leaves, tag);
+                n++;
+            }
+        }
+    }
+
+    tagdb_begin_transaction(db);
+    bench_start(&t, "delete_tag");
+    LL(leaves, it)
+    {
+        delete_tag(db, it->data);
+    } LL_END;
+    bench_stop(&t, n);
+    tagdb_end_transaction(db);
+    g_list_free(leaves);
+}
+
+int main (int argc, char **argv)
+{
+    GError *err = NULL;
+    GOptionContext *context = g_option_context_new("- time TagDB operations on a synthetic database");
+    g_option_context_add_main_entries(context, options, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &err))
+    {
+        fprintf(stderr, "%s\n", err->message);
+        g_error_free(err);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    if (nfiles < 1 || ntags < 1 || tags_per_file < 1 || depth < 1 || nqueries < 1)
+    {
+        fprintf(stderr, "--files, --tags, --tags-per-file, --depth and --queries must be positive\n");
+        return 1;
+    }
+
+    gboolean own_dir = (db_dir == NULL);
+    if (own_dir)
+    {
+        db_dir = g_strdup("/tmp/tagdb_bench.XXXXXX");
+        if (!mkdtemp(db_dir))
+        {
+            perror("mkdtemp");
+            return 1;
+        }
+    }
+    char *db_name = g_strdup_printf("%s/bench.db", db_dir);
+    unlink(db_name);
+
+    log_open0(stderr, ERROR);
+
+    char *params = g_strdup_printf("%d\t%d\t%d\t%d\t%g\t%d",
+            nfiles, ntags, tags_per_file, depth, zipf, seed);
+    bench_init(stdout, "files\ttags\ttags_per_file\tdepth\tzipf\tseed", params);
+    bench_print_header();
+
+    GRand *r = g_rand_new_with_seed(seed);
+    bench_zipf *z = bench_zipf_new(ntags, zipf, r);
+
+    TagDB *db = tagdb_new(db_name);
+    make_tags(db);
+    insert_files(db);
+    tag_files(db, z);
+    list_files(db, z, 1, "get_files_list");
+    list_files(db, z, 2, "get_files_list_2");
+    list_tags(db, z);
+    lookup_tags(db, r);
+    lookup_files(db, r);
+    db = restart(db, db_name);
+    delete_tags(db);
+    tagdb_destroy(db);
+
+    for (int i = 0; i < ntags; i++)
+    {
+        g_free(tag_paths[i]);
+    }
+    g_free(tag_paths);
+    g_free(tags);
+    g_free(files);
+    g_free(file_first_tag);
+    bench_zipf_destroy(z);
+    g_rand_free(r);
+    g_free(params);
+
+    unlink(db_name);
+    if (own_dir)
+    {
+        rmdir(db_dir);
+    }
+    g_free(db_name);
+    g_free(db_dir);
+    log_close();
+    return 0;
+}
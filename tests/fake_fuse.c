@@ -1,3 +1,5 @@
+#include <errno.h>
+#include <string.h>
 #include <glib.h>
 #include "log.h"
 #include "fake_fuse.h"
@@ -6,7 +8,10 @@ fuse_context *fuse_ctx = NULL;
 
 int fuse_init (void *user_data)
 {
-    fuse_ctx = g_malloc(sizeof(fuse_context));
+    fuse_ctx = g_malloc0(sizeof(fuse_context));
+    fuse_ctx->uid = getuid();
+    fuse_ctx->gid = getgid();
+    fuse_ctx->pid = getpid();
     fuse_ctx->private_data = user_data;
     return 0;
 }
@@ -22,3 +27,79 @@ int fake_fuse_dir_filler (void *buf, const char *name,
     log_msg("Filling in %s\n", name);
     return 0;
 }
+
+size_t fuse_buf_size (const struct fuse_bufvec *bufv)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < bufv->count; i++)
+    {
+        size += bufv->buf[i].size;
+    }
+    return size;
+}
+
+/* Copies len bytes between the current positions in two buffers, going
+ * through memory when both are files */
+static ssize_t _buf_copy_one (const struct fuse_buf *dst, size_t dst_off,
+        const struct fuse_buf *src, size_t src_off, size_t len)
+{
+    if (!(src->flags & FUSE_BUF_IS_FD))
+    {
+        char *from = (char*) src->mem + src_off;
+        if (!(dst->flags & FUSE_BUF_IS_FD))
+        {
+            memmove((char*) dst->mem + dst_off, from, len);
+            return len;
+        }
+        return pwrite(dst->fd, from, len, dst->pos + dst_off);
+    }
+    if (!(dst->flags & FUSE_BUF_IS_FD))
+    {
+        return pread(src->fd, (char*) dst->mem + dst_off, len, src->pos + src_off);
+    }
+
+    char *tmp = g_malloc(len);
+    ssize_t res = pread(src->fd, tmp, len, src->pos + src_off);
+    if (res > 0)
+    {
+        res = pwrite(dst->fd, tmp, res, dst->pos + dst_off);
+    }
+    g_free(tmp);
+    return res;
+}
+
+ssize_t fuse_buf_copy (struct fuse_bufvec *dst, struct fuse_bufvec *src,
+        enum fuse_buf_copy_flags flags)
+{
+    ssize_t copied = 0;
+    while (dst->idx < dst->count && src->idx < src->count)
+    {
+        const struct fuse_buf *d = &dst->buf[dst->idx];
+        const struct fuse_buf *s = &src->buf[src->idx];
+        size_t len = MIN(d->size - dst->off, s->size - src->off);
+        ssize_t res = _buf_copy_one(d, dst->off, s, src->off, len);
+        if (res < 0)
+        {
+            return copied ? copied : -errno;
+        }
+        copied += res;
+        dst->off += res;
+        src->off += res;
+        if (dst->off == d->size)
+        {
+            dst->idx++;
+            dst->off = 0;
+        }
+        if (src->off == s->size)
+        {
+            src->idx++;
+            src->off = 0;
+        }
+        if ((size_t) res < len)
+        {
+            /* The end of a file */
+            break;
+        }
+    }
+    return copied;
+}
@@ -2,12 +2,17 @@
  *
  * Any of the tests which use fake fuse should create their user_data
  * to fill in. It isn't necessary to pad the struct to work with everything
+ *
+ * Sources built with TAGFS_FAKE_FUSE get this header from params.h in
+ * place of <fuse.h>, so the file system operations can be called directly
+ * without a mount.
  */
 #ifndef FAKE_FUSE_H
 #define FAKE_FUSE_H
 
 #include <unistd.h>
 #include <stdint.h>
+#include <fcntl.h>
 #include <utime.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -17,15 +22,27 @@
 struct _fuse_context
 {
     uid_t uid;
+    gid_t gid;
     pid_t pid;
     void *private_data;
+    mode_t umask;
 };
 
+/* Laid out like the FUSE 2.9 struct so that code which logs or sets any of
+ * the fields compiles against either */
 struct fuse_file_info
 {
     int flags;
-
+    unsigned long fh_old;
+    int writepage;
+    unsigned int direct_io : 1;
+    unsigned int keep_cache : 1;
+    unsigned int flush : 1;
+    unsigned int nonseekable : 1;
+    unsigned int flock_release : 1;
+    unsigned int padding : 27;
     uint64_t fh;
+    uint64_t lock_owner;
 };
 
 typedef struct _fuse_context fuse_context;
@@ -41,4 +58,92 @@ typedef int (*fuse_fill_dir_t) (void *buf, const char *name,
 int fake_fuse_dir_filler (void *buf, const char *name,
         const struct stat *stbuf, off_t off);
 
+/* The data buffers of FUSE 2.9 */
+enum fuse_buf_flags
+{
+    FUSE_BUF_IS_FD = (1 << 1),
+    FUSE_BUF_FD_SEEK = (1 << 2),
+    FUSE_BUF_FD_RETRY = (1 << 3)
+};
+
+enum fuse_buf_copy_flags
+{
+    FUSE_BUF_NO_SPLICE = (1 << 1),
+    FUSE_BUF_FORCE_SPLICE = (1 << 2),
+    FUSE_BUF_SPLICE_MOVE = (1 << 3),
+    FUSE_BUF_SPLICE_NONBLOCK = (1 << 4)
+};
+
+struct fuse_buf
+{
+    size_t size;
+    enum fuse_buf_flags flags;
+    void *mem;
+    int fd;
+    off_t pos;
+};
+
+struct fuse_bufvec
+{
+    size_t count;
+    size_t idx;
+    size_t off;
+    struct fuse_buf buf[1];
+};
+
+#define FUSE_BUFVEC_INIT(size__) \
+    ((struct fuse_bufvec) { 1, 0, 0, { { size__, (enum fuse_buf_flags) 0, NULL, -1, 0 } } })
+
+size_t fuse_buf_size (const struct fuse_bufvec *bufv);
+/* Copies without splicing, so it's only as fast as pread and pwrite */
+ssize_t fuse_buf_copy (struct fuse_bufvec *dst, struct fuse_bufvec *src,
+        enum fuse_buf_copy_flags flags);
+
+typedef struct fuse_dirhandle *fuse_dirh_t;
+typedef int (*fuse_dirfil_t) (fuse_dirh_t h, const char *name, int type,
+        ino_t ino);
+
+/* The operations of the high-level API that marco.pl knows about */
+struct fuse_operations
+{
+    int (*getattr) (const char *, struct stat *);
+    int (*readlink) (const char *, char *, size_t);
+    int (*getdir) (const char *, fuse_dirh_t, fuse_dirfil_t);
+    int (*mknod) (const char *, mode_t, dev_t);
+    int (*mkdir) (const char *, mode_t);
+    int (*unlink) (const char *);
+    int (*rmdir) (const char *);
+    int (*symlink) (const char *, const char *);
+    int (*rename) (const char *, const char *);
+    int (*link) (const char *, const char *);
+    int (*chmod) (const char *, mode_t);
+    int (*chown) (const char *, uid_t, gid_t);
+    int (*truncate) (const char *, off_t);
+    int (*utime) (const char *, struct utimbuf *);
+    int (*open) (const char *, struct fuse_file_info *);
+    int (*read) (const char *, char *, size_t, off_t, struct fuse_file_info *);
+    int (*write) (const char *, const char *, size_t, off_t, struct fuse_file_info *);
+    int (*statfs) (const char *, struct statvfs *);
+    int (*flush) (const char *, struct fuse_file_info *);
+    int (*release) (const char *, struct fuse_file_info *);
+    int (*fsync) (const char *, int, struct fuse_file_info *);
+    int (*setxattr) (const char *, const char *, const char *, size_t, int);
+    int (*getxattr) (const char *, const char *, char *, size_t);
+    int (*listxattr) (const char *, char *, size_t);
+    int (*removexattr) (const char *, const char *);
+    int (*opendir) (const char *, struct fuse_file_info *);
+    int (*readdir) (const char *, void *, fuse_fill_dir_t, off_t, struct fuse_file_info *);
+    int (*releasedir) (const char *, struct fuse_file_info *);
+    int (*fsyncdir) (const char *, int, struct fuse_file_info *);
+    void (*destroy) (void *);
+    int (*access) (const char *, int);
+    int (*create) (const char *, mode_t, struct fuse_file_info *);
+    int (*ftruncate) (const char *, off_t, struct fuse_file_info *);
+    int (*fgetattr) (const char *, struct stat *, struct fuse_file_info *);
+    int (*lock) (const char *, struct fuse_file_info *, int, struct flock *);
+    int (*utimens) (const char *, const struct timespec tv[2]);
+    int (*write_buf) (const char *, struct fuse_bufvec *, off_t, struct fuse_file_info *);
+    int (*read_buf) (const char *, struct fuse_bufvec **, size_t, off_t, struct fuse_file_info *);
+};
+
 #endif
@@ -1,6 +1,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <time.h>
 #include "util.h"
 
 #define ID_STRING_MAX_LEN 16
@@ -245,3 +246,10 @@ unsigned short rand_lim (unsigned short limit)
     return retval + 1;
 }
 
+
+guint64 monotonic_time_ns (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (guint64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
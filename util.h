@@ -59,4 +59,6 @@ extern int high_water_alloc(void **buf, size_t *bufsize, size_t newsize);
 char *to_charp (size_t size, size_t n);
 size_t charp_to_size (size_t length, char *s);
 unsigned short rand_lim (unsigned short limit);
+/* Nanoseconds on CLOCK_MONOTONIC. Only useful for measuring intervals */
+guint64 monotonic_time_ns (void);
 #endif /* UTIL_H */